@@ -29,14 +29,28 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * The disk does one sector per operation. Requests wait in a queue
+ * until the disk is idle; then the scheduling policy picks one, any
+ * queued requests that continue it on disk are merged in behind it,
+ * and the interrupt handler runs the resulting sectors back to back,
+ * starting each one as soon as the last finishes. lhd_io, the device
+ * operation, is built on this: it submits requests and waits. The
+ * policy (C-LOOK by default) can be changed with the "dksched" menu
+ * command.
  */
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/ioctl.h>
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
+#include <copyinout.h>
+#include <diskstats.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -60,6 +74,31 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Most sectors merged behind one request */
+#define LHD_MAXMERGE	64
+
+/*
+ * Deadlines, in revolutions of the disk: a request that has waited
+ * this long is served next regardless of where it is. Reads are
+ * usually waited for; writes usually aren't.
+ */
+#define LHD_READREVS	30
+#define LHD_WRITEREVS	300
+
+/* Revolution speed to assume if the disk doesn't say */
+#define LHD_DEFAULTRPM	3600
+
+/* Bounce buffer size for lhd_io on user memory */
+#define LHD_BOUNCESIZE	4096
+
+/* Requests lhd_io submits at once for a kernel uio */
+#define LHD_IOBATCH	16
+
+/* Disks lhd_byname can find */
+#define LHD_MAXUNITS	16
+
+static struct lhd_softc *lhd_units[LHD_MAXUNITS];
+
 /*
  * Shortcut for reading a register.
  */
@@ -95,42 +134,387 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 	return EAGAIN;
 }
 
+////////////////////////////////////////////////////////////
+// scheduling
+
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Is time A before time B?
+ */
+static
+bool
+lhd_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * First come, first served.
+ */
+static
+struct lhd_req *
+lhd_pick_fifo(struct lhd_softc *lh, const struct timespec *now)
+{
+	(void)now;
+	return lh->lh_queue;
+}
+
+/*
+ * C-LOOK: the lowest sector at or past the head, wrapping around to
+ * the lowest sector overall, so the head sweeps upward across the
+ * disk and then comes back. But if any request has passed its
+ * deadline, the one that passed it first goes next, so a stream of
+ * requests in one area can't starve one elsewhere.
+ */
+static
+struct lhd_req *
+lhd_pick_clook(struct lhd_softc *lh, const struct timespec *now)
+{
+	struct lhd_req *req, *late, *ahead, *lowest;
+
+	late = ahead = lowest = NULL;
+	for (req = lh->lh_queue; req != NULL; req = req->lr_next) {
+		if (lhd_before(&req->lr_deadline, now) &&
+		    (late == NULL ||
+		     lhd_before(&req->lr_deadline, &late->lr_deadline))) {
+			late = req;
+		}
+		if (req->lr_sector >= lh->lh_head &&
+		    (ahead == NULL || req->lr_sector < ahead->lr_sector)) {
+			ahead = req;
+		}
+		if (lowest == NULL || req->lr_sector < lowest->lr_sector) {
+			lowest = req;
+		}
+	}
+	if (late != NULL) {
+		return late;
+	}
+	return ahead != NULL ? ahead : lowest;
+}
+
+/*
+ * The policies, default first.
+ */
+static const struct lhd_sched lhd_scheds[] = {
+	{ .ls_name = "clook", .ls_pick = lhd_pick_clook },
+	{ .ls_name = "fifo", .ls_pick = lhd_pick_fifo },
+};
+#define LHD_NSCHEDS	(sizeof(lhd_scheds) / sizeof(lhd_scheds[0]))
+
+const char *
+lhd_getsched(struct lhd_softc *lh)
+{
+	const char *name;
+
+	spinlock_acquire(&lh->lh_lock);
+	name = lh->lh_sched->ls_name;
+	spinlock_release(&lh->lh_lock);
+	return name;
+}
+
+int
+lhd_setsched(struct lhd_softc *lh, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LHD_NSCHEDS; i++) {
+		if (!strcmp(lhd_scheds[i].ls_name, name)) {
+			/* Takes effect the next time the disk goes idle */
+			spinlock_acquire(&lh->lh_lock);
+			lh->lh_sched = &lhd_scheds[i];
+			spinlock_release(&lh->lh_lock);
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+/*
+ * Take REQ off the queue.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_unqueue(struct lhd_softc *lh, struct lhd_req *req)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_req **pp;
+
+	for (pp = &lh->lh_queue; *pp != req; pp = &(*pp)->lr_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = req->lr_next;
+	req->lr_next = NULL;
+}
+
+/*
+ * Append queued requests that pick up on disk where the last request
+ * of the run leaves off, in the same direction.
+ */
+static
+void
+lhd_merge(struct lhd_softc *lh)
+{
+	struct lhd_req *tail, *req;
+	uint32_t total;
+
+	tail = lh->lh_run;
+	total = tail->lr_nsects;
+	KASSERT(tail->lr_next == NULL);
+
+ again:
+	for (req = lh->lh_queue; req != NULL; req = req->lr_next) {
+		if (req->lr_write == tail->lr_write &&
+		    req->lr_sector == tail->lr_sector + tail->lr_nsects &&
+		    total + req->lr_nsects <= LHD_MAXMERGE) {
+			lhd_unqueue(lh, req);
+			if (req->lr_write) {
+				lh->lh_stats.ds_write.dr_merged++;
+			}
+			else {
+				lh->lh_stats.ds_read.dr_merged++;
+			}
+			tail->lr_next = req;
+			tail = req;
+			total += req->lr_nsects;
+			goto again;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// request processing
+
+/*
+ * Start the next sector of the current request.
+ */
+static
+void
+lhd_startsect(struct lhd_softc *lh)
+{
+	struct lhd_req *req = lh->lh_run;
+	char *ptr;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req->lr_pos < req->lr_nsects);
+
+	if (req->lr_pos == 0) {
+		gettime(&req->lr_started);
+	}
+
+	ptr = (char *)req->lr_buf + req->lr_pos * LHD_SECTSIZE;
+
+	/*
+	 * Are we writing? If so, transfer the data to the on-card
+	 * buffer.
+	 */
+	if (req->lr_write) {
+		memcpy(lh->lh_buf, ptr, LHD_SECTSIZE);
+		membar_store_store();
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->lr_sector + req->lr_pos);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT,
+		 req->lr_write ? (LHD_WORKING | LHD_ISWRITE) : LHD_WORKING);
+}
+
+/*
+ * If the disk is idle, start something: the rest of the current run,
+ * or else a new run chosen by the scheduling policy.
+ */
+static
+void
+lhd_dispatch(struct lhd_softc *lh)
+{
+	struct timespec now;
+	struct lhd_req *req;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_run == NULL) {
+		if (lh->lh_queue == NULL) {
+			return;
+		}
+		gettime(&now);
+		req = lh->lh_sched->ls_pick(lh, &now);
+		KASSERT(req != NULL);
+		lhd_unqueue(lh, req);
+		lh->lh_run = req;
+		lh->lh_stats.ds_runs++;
+		lhd_merge(lh);
+	}
+	lhd_startsect(lh);
+}
+
+/*
+ * Finish a request. Requests with callbacks are added to *DONELIST
+ * so the callbacks can be run after dropping the lock; waiters are
+ * woken.
+ */
+static
+void
+lhd_complete(struct lhd_softc *lh, struct lhd_req *req, int err,
+	     struct lhd_req **donelist)
+{
+	struct timespec now;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	gettime(&now);
+	diskstats_done(&lh->lh_stats, req->lr_write,
+		       err ? 0 : req->lr_nsects * LHD_SECTSIZE, err,
+		       &req->lr_submitted, &req->lr_started, &now);
+
+	req->lr_result = err;
+	req->lr_done = true;
+	if (req->lr_callback != NULL) {
+		req->lr_next = *donelist;
+		*donelist = req;
+	}
+	else {
+		req->lr_next = NULL;
+		wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+	}
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, collect the data and move on to the next sector.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct lhd_req *req, *donelist, *next;
 	uint32_t val;
+	int err;
+
+	donelist = NULL;
+	spinlock_acquire(&lh->lh_lock);
 
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
-	    case LHD_IDLE:
-	    case LHD_WORKING:
-		break;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
+	    default:
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	req = lh->lh_run;
+	if (req == NULL) {
+		/* Nothing was running; ignore it */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	err = lhd_code_to_errno(lh, val);
+
+	/*
+	 * Are we reading? If so, and if we succeeded, transfer the
+	 * data out of the on-card buffer.
+	 */
+	if (err == 0 && !req->lr_write) {
+		membar_load_load();
+		memcpy((char *)req->lr_buf + req->lr_pos * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+
+	lh->lh_head = req->lr_sector + req->lr_pos + 1;
+	req->lr_pos++;
+	if (err != 0 || req->lr_pos == req->lr_nsects) {
+		lh->lh_run = req->lr_next;
+		lhd_complete(lh, req, err, &donelist);
 	}
+	lhd_dispatch(lh);
+
+	spinlock_release(&lh->lh_lock);
+
+	for (req = donelist; req != NULL; req = next) {
+		next = req->lr_next;
+		req->lr_callback(req);
+	}
+}
+
+/*
+ * Queue a request, and start the disk if it's idle.
+ */
+int
+lhd_submit(struct lhd_softc *lh, struct lhd_req *req)
+{
+	struct timespec wait;
+	struct lhd_req **pp;
+	uint32_t usecs;
+
+	if (req->lr_nsects == 0 || req->lr_sector > lh->lh_dev.d_blocks ||
+	    req->lr_nsects > lh->lh_dev.d_blocks - req->lr_sector) {
+		return EINVAL;
+	}
+
+	usecs = lh->lh_revusecs *
+		(req->lr_write ? LHD_WRITEREVS : LHD_READREVS);
+	wait.tv_sec = usecs / 1000000;
+	wait.tv_nsec = (usecs % 1000000) * 1000;
+	gettime(&req->lr_submitted);
+	timespec_add(&req->lr_submitted, &wait, &req->lr_deadline);
+
+	req->lr_result = 0;
+	req->lr_done = false;
+	req->lr_pos = 0;
+	req->lr_next = NULL;
+
+	spinlock_acquire(&lh->lh_lock);
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		/* nothing */
+	}
+	*pp = req;
+	diskstats_submit(&lh->lh_stats);
+	if (lh->lh_run == NULL) {
+		lhd_dispatch(lh);
+	}
+	spinlock_release(&lh->lh_lock);
+	return 0;
+}
+
+/*
+ * Wait for a request submitted without a callback, and return its
+ * result.
+ */
+int
+lhd_wait(struct lhd_softc *lh, struct lhd_req *req)
+{
+	KASSERT(req->lr_callback == NULL);
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!req->lr_done) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+	return req->lr_result;
+}
+
+/*
+ * Find an attached disk by name.
+ */
+struct lhd_softc *
+lhd_byname(const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LHD_MAXUNITS; i++) {
+		if (lhd_units[i] != NULL &&
+		    !strcmp(lhd_units[i]->lh_name, name)) {
+			return lhd_units[i];
+		}
+	}
+	return NULL;
 }
 
 /*
@@ -156,12 +540,22 @@ static
 int
 lhd_ioctl(struct device *d, int op, userptr_t data)
 {
-	/*
-	 * We don't support any ioctls.
-	 */
-	(void)d;
-	(void)op;
-	(void)data;
+	struct lhd_softc *lh = d->d_data;
+	struct diskstats snap;
+
+	switch (op) {
+	    case DIOCGSTATS:
+		/* copy it out of the lock; copyout can fault */
+		spinlock_acquire(&lh->lh_lock);
+		snap = lh->lh_stats;
+		spinlock_release(&lh->lh_lock);
+		return copyout(&snap, data, sizeof(snap));
+	    case DIOCCLRSTATS:
+		spinlock_acquire(&lh->lh_lock);
+		diskstats_clear(&lh->lh_stats);
+		spinlock_release(&lh->lh_lock);
+		return 0;
+	}
 	return EIOCTL;
 }
 
@@ -179,6 +573,138 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Check if a kernel uio can be done in place: every iovec has to be
+ * whole sectors.
+ */
+static
+bool
+lhd_uio_direct(struct uio *uio)
+{
+	unsigned i;
+
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return false;
+	}
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		if (uio->uio_iov[i].iov_len % LHD_SECTSIZE != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * I/O on a kernel uio, in place: submit a request for each iovec, up
+ * to LHD_IOBATCH at a time, so the scheduler can see them all and
+ * merge them, then wait for all of them.
+ */
+static
+int
+lhd_io_direct(struct lhd_softc *lh, struct uio *uio)
+{
+	struct lhd_req reqs[LHD_IOBATCH];
+	struct iovec *iov;
+	uint32_t sector;
+	unsigned i, n;
+	int result, err;
+
+	sector = uio->uio_offset / LHD_SECTSIZE;
+	result = 0;
+	while (result == 0 && uio->uio_resid > 0) {
+		KASSERT(uio->uio_iovcnt > 0);
+
+		for (n=0; n < LHD_IOBATCH && n < uio->uio_iovcnt; n++) {
+			iov = &uio->uio_iov[n];
+			reqs[n].lr_sector = sector;
+			reqs[n].lr_nsects = iov->iov_len / LHD_SECTSIZE;
+			reqs[n].lr_buf = iov->iov_kbase;
+			reqs[n].lr_write = uio->uio_rw == UIO_WRITE;
+			reqs[n].lr_callback = NULL;
+			reqs[n].lr_data = NULL;
+			sector += reqs[n].lr_nsects;
+		}
+
+		for (i=0; i<n; i++) {
+			iov = &uio->uio_iov[i];
+			if (iov->iov_len == 0) {
+				continue;
+			}
+			/* The range was checked by lhd_io */
+			err = lhd_submit(lh, &reqs[i]);
+			KASSERT(err == 0);
+		}
+		for (i=0; i<n; i++) {
+			iov = uio->uio_iov;
+			if (iov->iov_len > 0) {
+				err = lhd_wait(lh, &reqs[i]);
+				if (err != 0 && result == 0) {
+					result = err;
+				}
+				uio->uio_offset += iov->iov_len;
+				uio->uio_resid -= iov->iov_len;
+				iov->iov_kbase =
+					(char *)iov->iov_kbase + iov->iov_len;
+				iov->iov_len = 0;
+			}
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+		}
+	}
+	return result;
+}
+
+/*
+ * I/O on anything else (user memory, mostly), through a bounce
+ * buffer.
+ */
+static
+int
+lhd_io_bounce(struct lhd_softc *lh, struct uio *uio)
+{
+	struct lhd_req req;
+	void *buf;
+	size_t len;
+	int result;
+
+	buf = kmalloc(LHD_BOUNCESIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	result = 0;
+	while (result == 0 && uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > LHD_BOUNCESIZE) {
+			len = LHD_BOUNCESIZE;
+		}
+
+		req.lr_sector = uio->uio_offset / LHD_SECTSIZE;
+		req.lr_nsects = len / LHD_SECTSIZE;
+		req.lr_buf = buf;
+		req.lr_write = uio->uio_rw == UIO_WRITE;
+		req.lr_callback = NULL;
+		req.lr_data = NULL;
+
+		if (req.lr_write) {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
+		}
+		result = lhd_submit(lh, &req);
+		if (result == 0) {
+			result = lhd_wait(lh, &req);
+		}
+		if (result == 0 && !req.lr_write) {
+			result = uiomove(buf, len, uio);
+		}
+	}
+
+	kfree(buf);
+	return result;
+}
+
 /*
  * I/O function (for both reads and writes)
  */
@@ -192,9 +718,6 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -202,66 +725,15 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (uio->uio_offset / LHD_SECTSIZE > lh->lh_dev.d_blocks ||
+	    len > lh->lh_dev.d_blocks - sector) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (lhd_uio_direct(uio)) {
+		return lhd_io_direct(lh, uio);
 	}
-
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
-		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
-		}
-	}
-
-	return 0;
+	return lhd_io_bounce(lh, uio);
 }
 
 static const struct device_ops lhd_devops = {
@@ -276,25 +748,37 @@ static const struct device_ops lhd_devops = {
 int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
-	char name[32];
+	uint32_t rpm;
+	int result;
 
 	/* Figure out what our name is. */
-	snprintf(name, sizeof(name), "lhd%d", lhdno);
+	snprintf(lh->lh_name, sizeof(lh->lh_name), "lhd%d", lhdno);
 
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
+	/* Deadlines are in revolutions; find out how long one is. */
+	rpm = lhd_rdreg(lh, LHD_REG_RPM);
+	if (rpm == 0) {
+		rpm = LHD_DEFAULTRPM;
+	}
+	lh->lh_revusecs = 60000000 / rpm;
+	if (lh->lh_revusecs > 1000000) {
+		/* keep deadlines from overflowing */
+		lh->lh_revusecs = 1000000;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
+	lh->lh_sched = &lhd_scheds[0];
+	lh->lh_queue = NULL;
+	lh->lh_run = NULL;
+	lh->lh_head = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -303,6 +787,22 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
 	lh->lh_dev.d_data = lh;
 
+	/* Set up statistics; failing to register them isn't fatal. */
+	diskstats_init(&lh->lh_stats, lh->lh_dev.d_blocks, rpm);
+	result = diskstats_register(lh->lh_name, &lh->lh_stats, &lh->lh_lock);
+	if (result) {
+		kprintf("%s: stats not registered: %s\n", lh->lh_name,
+			strerror(result));
+	}
+
 	/* Add the VFS device structure to the VFS device list. */
-	return vfs_adddev(name, &lh->lh_dev, 1);
+	result = vfs_adddev(lh->lh_name, &lh->lh_dev, 1);
+	if (result) {
+		return result;
+	}
+
+	if (lhdno >= 0 && lhdno < LHD_MAXUNITS) {
+		lhd_units[lhdno] = lh;
+	}
+	return 0;
 }
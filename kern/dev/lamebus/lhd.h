@@ -30,6 +30,9 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <kern/time.h>
+#include <kern/diskstats.h>
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -37,6 +40,46 @@
  */
 #define LHD_SECTSIZE  512
 
+struct lhd_softc;
+
+/*
+ * An I/O request. The submitter fills in the first group of fields
+ * and passes the request to lhd_submit, which returns at once. When
+ * the request is done, either LR_CALLBACK is called (from interrupt
+ * context, so it may not sleep) or, if it's NULL, the submitter
+ * collects the result with lhd_wait. The request must stay put until
+ * then.
+ */
+struct lhd_req {
+	/* Set by the submitter */
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsects;		/* Number of sectors */
+	void *lr_buf;			/* Kernel buffer of lr_nsects sectors */
+	bool lr_write;			/* Write (otherwise read) */
+	void (*lr_callback)(struct lhd_req *);	/* Or NULL to wait */
+	void *lr_data;			/* For the callback's use */
+
+	/* Private to the driver */
+	int lr_result;			/* Result, once done */
+	bool lr_done;			/* Finished */
+	uint32_t lr_pos;		/* Sectors done so far */
+	struct timespec lr_deadline;	/* Serve by this time */
+	struct timespec lr_submitted;	/* When queued (for stats) */
+	struct timespec lr_started;	/* When first sector began */
+	struct lhd_req *lr_next;	/* Queue or run linkage */
+};
+
+/*
+ * A scheduling policy: picks the next request to start from the
+ * queue when the disk goes idle. NOW is the current time. Policies
+ * are chosen by name with lhd_setsched; see lhd.c for the list.
+ */
+struct lhd_sched {
+	const char *ls_name;
+	struct lhd_req *(*ls_pick)(struct lhd_softc *lh,
+				   const struct timespec *now);
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -50,14 +93,36 @@ struct lhd_softc {
 	 * Initialized by config_lhd
 	 */
 
+	char lh_name[16];		/* "lhdN" */
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	uint32_t lh_revusecs;		/* Time for one revolution */
+
+	struct spinlock lh_lock;	/* Protects the rest */
+	const struct lhd_sched *lh_sched; /* Scheduling policy */
+	struct wchan *lh_wchan;		/* For lhd_wait */
+	struct lhd_req *lh_queue;	/* Waiting requests, oldest first */
+	struct lhd_req *lh_run;		/* Requests in progress, in order */
+	uint32_t lh_head;		/* Sector after the last one done */
+	struct diskstats lh_stats;	/* I/O statistics */
 
 	struct device lh_dev;		/* VFS device structure */
 };
 
+/* Asynchronous I/O */
+int lhd_submit(struct lhd_softc *lh, struct lhd_req *req);
+int lhd_wait(struct lhd_softc *lh, struct lhd_req *req);
+
+/*
+ * lhd_byname   - Find the attached disk called NAME ("lhd0"), or NULL.
+ * lhd_getsched - Name of the disk's scheduling policy.
+ * lhd_setsched - Switch the disk to the policy called NAME. Requests
+ *                already queued are carried over. Returns EINVAL if
+ *                there's no such policy.
+ */
+struct lhd_softc *lhd_byname(const char *name);
+const char *lhd_getsched(struct lhd_softc *lh);
+int lhd_setsched(struct lhd_softc *lh, const char *name);
+
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
@@ -33,71 +33,283 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block. This is done in the buffer cache; there's
+ * no need to read the old contents, and the zeros reach the disk
+ * with the rest of the block's data.
  */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct buf *buf;
+	int result;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	result = buffer_get(sfs->sfs_device, block, sfs->sfs_blocksize, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), sfs->sfs_blocksize);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
 }
 
 /*
- * Allocate a block.
+ * Allocate a run of up to MAXBLOCKS contiguous blocks, starting with
+ * the first free block at or after GOAL. Hands back the first block
+ * and how many we got, which is at least one. If RESERVED isn't
+ * NULL, it counts blocks the caller set aside with sfs_breserve;
+ * those may be used as well as unreserved ones, and come out of it
+ * first.
+ *
+ * The goal should be where the caller would like the block to be:
+ * right after the file's previous block, or near its inode, so that
+ * files are laid out contiguously. Searching from there rather than
+ * from block 0 also means we don't rescan the full part of the disk
+ * on every allocation.
+ *
+ * The freemap lock is only held while the bitmap is touched; the
+ * blocks are ours once they're marked, so clearing them can happen
+ * without the lock.
  */
+static
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_ballocrun_common(struct sfs_fs *sfs, uint32_t *reserved, daddr_t goal,
+		     uint32_t maxblocks, daddr_t *diskblock, uint32_t *nblocks)
 {
+	uint32_t avail, fromreserve, i, j;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	KASSERT(maxblocks > 0);
+
+	if (goal >= sfs->sfs_sb.sb_nblocks) {
+		goal = 0;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	/* Don't take blocks promised to other delayed writes */
+	avail = sfs->sfs_nfree - sfs->sfs_nreserved;
+	if (reserved != NULL) {
+		KASSERT(*reserved <= sfs->sfs_nreserved);
+		avail += *reserved;
+	}
+	if (avail == 0) {
+		lock_release(sfs->sfs_freemaplock);
+		return ENOSPC;
+	}
+	if (maxblocks > avail) {
+		maxblocks = avail;
+	}
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, maxblocks,
+				   diskblock, nblocks);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs->sfs_nfree -= *nblocks;
+	fromreserve = 0;
+	if (reserved != NULL) {
+		fromreserve = *nblocks < *reserved ? *nblocks : *reserved;
+		*reserved -= fromreserve;
+		sfs->sfs_nreserved -= fromreserve;
+	}
+	sfs_bdirty(sfs, *diskblock, *nblocks);
+	lock_release(sfs->sfs_freemaplock);
 
-	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
+	if (*diskblock + *nblocks > sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
-		      sfs->sfs_sb.sb_volname, *diskblock);
+		      sfs->sfs_sb.sb_volname, *diskblock + *nblocks - 1);
 	}
 
-	/* Clear block before returning it */
-	result = sfs_clearblock(sfs, *diskblock);
-	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+	/* Clear the blocks before returning them */
+	for (i=0; i<*nblocks; i++) {
+		result = sfs_clearblock(sfs, *diskblock + i);
+		if (result) {
+			for (j=0; j<i; j++) {
+				buffer_drop(sfs->sfs_device, *diskblock + j,
+					    sfs->sfs_blocksize);
+			}
+			lock_acquire(sfs->sfs_freemaplock);
+			for (j=0; j<*nblocks; j++) {
+				bitmap_unmark(sfs->sfs_freemap,
+					      *diskblock + j);
+			}
+			sfs->sfs_nfree += *nblocks;
+			if (fromreserve > 0) {
+				*reserved += fromreserve;
+				sfs->sfs_nreserved += fromreserve;
+			}
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
 	}
-	return result;
+	return 0;
+}
+
+int
+sfs_ballocrun(struct sfs_fs *sfs, daddr_t goal, uint32_t maxblocks,
+	      daddr_t *diskblock, uint32_t *nblocks)
+{
+	return sfs_ballocrun_common(sfs, NULL, goal, maxblocks,
+				    diskblock, nblocks);
+}
+
+/*
+ * Allocate a single block, near GOAL if possible.
+ */
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
+{
+	uint32_t nblocks;
+
+	return sfs_ballocrun(sfs, goal, 1, diskblock, &nblocks);
+}
+
+/*
+ * Allocate blocks for file SV. These are the same as sfs_ballocrun
+ * and sfs_balloc, except that while SV's held blocks are being
+ * flushed (see sfs_dalloc.c) the space comes out of what was
+ * reserved for them, so the flush can't be starved by other writers.
+ */
+int
+sfs_vballocrun(struct sfs_vnode *sv, daddr_t goal, uint32_t maxblocks,
+	       daddr_t *diskblock, uint32_t *nblocks)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	return sfs_ballocrun_common(sfs,
+				    sv->sv_daflushing ?
+				    &sv->sv_dareserved : NULL,
+				    goal, maxblocks, diskblock, nblocks);
+}
+
+int
+sfs_vballoc(struct sfs_vnode *sv, daddr_t goal, daddr_t *diskblock)
+{
+	uint32_t nblocks;
+
+	return sfs_vballocrun(sv, goal, 1, diskblock, &nblocks);
 }
 
 /*
- * Free a block.
+ * Free a block. Any cached copy is now garbage; throw it away rather
+ * than write it back.
+ *
+ * With a journal, the block stays in use until the running
+ * transaction commits (see sfs_journal.c).
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
+	buffer_drop(sfs->sfs_device, diskblock, sfs->sfs_blocksize);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_jfreed != NULL) {
+		bitmap_mark(sfs->sfs_jfreed, diskblock);
+		sfs->sfs_njfreed++;
+	}
+	else {
+		bitmap_unmark(sfs->sfs_freemap, diskblock);
+		sfs->sfs_nfree++;
+	}
+	/* (Either way its freemap block will need writing) */
+	sfs_bdirty(sfs, diskblock, 1);
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Note that the freemap bits for NBLOCKS blocks starting at DISKBLOCK
+ * have changed, so the freemap blocks holding them get written at
+ * the next sync, and only those. Call with sfs_freemaplock held.
+ */
+void
+sfs_bdirty(struct sfs_fs *sfs, daddr_t diskblock, uint32_t nblocks)
+{
+	uint32_t first, last, i;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(nblocks > 0);
+
+	first = diskblock / SFS_BITSPERBLOCK(sfs->sfs_blocksize);
+	last = (diskblock + nblocks - 1) / SFS_BITSPERBLOCK(sfs->sfs_blocksize);
+	for (i=first; i<=last; i++) {
+		if (!bitmap_isset(sfs->sfs_freemapdirtymap, i)) {
+			bitmap_mark(sfs->sfs_freemapdirtymap, i);
+		}
+	}
 	sfs->sfs_freemapdirty = true;
 }
 
+/*
+ * Set aside NBLOCKS free blocks without choosing which ones, so that
+ * allocating them later can't fail for lack of space. Until they're
+ * given back with sfs_bunreserve, sfs_balloc won't hand them out.
+ */
+int
+sfs_breserve(struct sfs_fs *sfs, uint32_t nblocks)
+{
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_nfree - sfs->sfs_nreserved < nblocks) {
+		lock_release(sfs->sfs_freemaplock);
+		return ENOSPC;
+	}
+	sfs->sfs_nreserved += nblocks;
+	lock_release(sfs->sfs_freemaplock);
+	return 0;
+}
+
+void
+sfs_bunreserve(struct sfs_fs *sfs, uint32_t nblocks)
+{
+	lock_acquire(sfs->sfs_freemaplock);
+	KASSERT(sfs->sfs_nreserved >= nblocks);
+	sfs->sfs_nreserved -= nblocks;
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Count the free blocks. Called at mount time.
+ */
+void
+sfs_bcount(struct sfs_fs *sfs)
+{
+	uint32_t i;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs->sfs_nfree = 0;
+	for (i=0; i<sfs->sfs_sb.sb_nblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_freemap, i)) {
+			sfs->sfs_nfree++;
+		}
+	}
+	sfs->sfs_nreserved = 0;
+	lock_release(sfs->sfs_freemaplock);
+}
+
 /*
  * Check if a block is in use.
  */
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
@@ -35,39 +35,267 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <vfs.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Number of blocks mapped by an indirect block with LEVELS levels of
+ * indirection. With big blocks a triple indirect block maps more
+ * blocks than a 32-bit file block number can count; since no file
+ * can have that many, stop at 0xffffffff.
+ */
+static
+uint32_t
+sfs_ibrange(struct sfs_fs *sfs, unsigned levels)
+{
+	uint32_t perib = SFS_DBPERIDB(sfs->sfs_blocksize);
+	uint32_t range = 1;
+
+	for (; levels > 0; levels--) {
+		if (range > 0xffffffff / perib) {
+			return 0xffffffff;
+		}
+		range *= perib;
+	}
+	return range;
+}
+
+/*
+ * Figure out which of the inode's indirect blocks maps FILEBLOCK,
+ * which is counted from the end of the direct blocks. Hands back a
+ * pointer to the inode's entry for that indirect block, its number
+ * of levels of indirection, and FILEBLOCK's offset within the range
+ * it maps.
+ */
+static
+int
+sfs_ibfind(struct sfs_vnode *sv, uint32_t fileblock,
+	   uint32_t **ibptr, unsigned *levels, uint32_t *offset)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	COMPILE_ASSERT(SFS_NINDIRECT == 1);
+	COMPILE_ASSERT(SFS_NDINDIRECT == 1);
+	COMPILE_ASSERT(SFS_NTINDIRECT == 1);
+
+	if (fileblock < sfs_ibrange(sfs, 1)) {
+		*ibptr = &sv->sv_i.sfi_indirect;
+		*levels = 1;
+		*offset = fileblock;
+		return 0;
+	}
+	fileblock -= sfs_ibrange(sfs, 1);
+
+	if (fileblock < sfs_ibrange(sfs, 2)) {
+		*ibptr = &sv->sv_i.sfi_dindirect;
+		*levels = 2;
+		*offset = fileblock;
+		return 0;
+	}
+	fileblock -= sfs_ibrange(sfs, 2);
+
+	if (fileblock < sfs_ibrange(sfs, 3)) {
+		*ibptr = &sv->sv_i.sfi_tindirect;
+		*levels = 3;
+		*offset = fileblock;
+		return 0;
+	}
+
+	/* Past the end of what we can map */
+	return EFBIG;
+}
+
+/*
+ * Get entry INDEX of the indirect block IDBLOCK. If there's no block
+ * there and DOALLOC is set, allocate one, near GOAL.
+ */
+static
+int
+sfs_ibentry(struct sfs_vnode *sv, daddr_t idblock, uint32_t index,
+	    bool doalloc, daddr_t goal, daddr_t *ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	daddr_t block;
+	int result;
+
+	KASSERT(index < SFS_DBPERIDB(sfs->sfs_blocksize));
+
+	result = buffer_read(sfs->sfs_device, idblock, sfs->sfs_blocksize,
+			     &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	block = iddata[index];
+	if (block == 0 && doalloc) {
+		result = sfs_vballoc(sv, goal, &block);
+		if (result) {
+			buffer_release(idbuf);
+			return result;
+		}
+
+		/* Remember the block we allocated */
+		iddata[index] = block;
+
+		/* The indirect block is now dirty */
+		sfs_jdirty(sfs, idbuf);
+	}
+	buffer_release(idbuf);
+
+	*ret = block;
+	return 0;
+}
+
+/*
+ * sfs_bmap for blocks past the direct blocks. If allocating, new
+ * blocks (including any indirect blocks needed) go near GOAL.
+ */
+static
+int
+sfs_bmap_indirect(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		  daddr_t goal, daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t *ibptr;
+	unsigned levels;
+	uint32_t offset, span, leafbase, perib;
+	daddr_t block;
+	daddr_t idblock;
+	int result;
+
+	/* Find which indirect block it's under. */
+	result = sfs_ibfind(sv, fileblock - SFS_NDIRECT,
+			    &ibptr, &levels, &offset);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Sequential access keeps using the same bottom-level
+	 * indirect block. If it's the one we found last time, skip
+	 * walking down to it.
+	 */
+	perib = SFS_DBPERIDB(sfs->sfs_blocksize);
+	leafbase = fileblock - offset % perib;
+	spinlock_acquire(&sv->sv_bmaplock);
+	idblock = (sv->sv_bmapbase == leafbase) ? sv->sv_bmapblock : 0;
+	spinlock_release(&sv->sv_bmaplock);
+
+	if (idblock == 0) {
+		/* Get the disk block number of the top indirect block. */
+		idblock = *ibptr;
+
+		if (idblock==0 && !doalloc) {
+			/*
+			 * There's no indirect block allocated. We
+			 * weren't asked to allocate anything, so
+			 * pretend it was filled with all zeros.
+			 */
+			*diskblock = 0;
+			return 0;
+		}
+		else if (idblock==0) {
+			result = sfs_vballoc(sv, goal, &idblock);
+			if (result) {
+				return result;
+			}
+
+			/* Remember the block we just allocated */
+			*ibptr = idblock;
+
+			/* Mark the inode dirty */
+			sv->sv_dirty = true;
+
+			/* (sfs_balloc left a zeroed buffer for it) */
+		}
+
+		/* Go down to the bottom level. */
+		for (span = 1; levels > 1; levels--) {
+			span *= perib;
+		}
+		while (span > 1) {
+			result = sfs_ibentry(sv, idblock, offset / span,
+					     doalloc, goal, &idblock);
+			if (result) {
+				return result;
+			}
+			if (idblock == 0) {
+				/* Nothing under here */
+				*diskblock = 0;
+				return 0;
+			}
+			offset %= span;
+			span /= perib;
+		}
+
+		spinlock_acquire(&sv->sv_bmaplock);
+		sv->sv_bmapbase = leafbase;
+		sv->sv_bmapblock = idblock;
+		spinlock_release(&sv->sv_bmaplock);
+	}
+
+	/* Get the block out of the bottom-level indirect block */
+	result = sfs_ibentry(sv, idblock, offset % perib, doalloc,
+			     goal, &block);
+	if (result) {
+		return result;
+	}
+
+	/* Hand back the result and return. */
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: %s: Data block %u (block %u of file %u) "
+		      "marked free\n", sfs->sfs_sb.sb_volname,
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Pick where to put a new block for FILEBLOCK: right after the block
+ * before it, if there is one, so the file comes out contiguous;
+ * otherwise right after the inode.
+ */
+static
+daddr_t
+sfs_bmap_goal(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	daddr_t prev;
+
+	if (fileblock > 0 &&
+	    sfs_bmap(sv, fileblock - 1, false, &prev) == 0 && prev != 0) {
+		return prev + 1;
+	}
+	return sv->sv_ino + 1;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * The caller must hold the vnode's lock, for writing if DOALLOC is
+ * set.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(!doalloc || rwlock_do_i_hold_write(sv->sv_lock));
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		return sfs_extent_bmap(sv, fileblock, doalloc, diskblock);
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,7 +310,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_vballoc(sv, sfs_bmap_goal(sv, fileblock),
+					     &block);
 			if (result) {
 				return result;
 			}
@@ -105,127 +334,168 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's under one of the indirect blocks. Look first without
+	 * allocating; if it's not there, we need to know where the
+	 * previous block is to know where to put it. That can't be
+	 * looked up from inside the walk, which holds each indirect
+	 * block while allocating under it.
 	 */
+	result = sfs_bmap_indirect(sv, fileblock, false, 0, diskblock);
+	if (result || *diskblock != 0 || !doalloc) {
+		return result;
+	}
+	return sfs_bmap_indirect(sv, fileblock, true,
+				 sfs_bmap_goal(sv, fileblock), diskblock);
+}
 
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+/*
+ * Get disk blocks for file blocks FILEBLOCK through
+ * FILEBLOCK+NBLOCKS-1 ahead of a write that covers all of them, in
+ * as few contiguous runs as the free space allows. This is only an
+ * optimization: anything it can't get is left for sfs_bmap to
+ * allocate (or fail to) one block at a time during the write.
+ *
+ * Block-mapped files don't do this; their blocks come from sfs_bmap
+ * with the previous block as the goal, which keeps them contiguous
+ * when the space is there.
+ */
+void
+sfs_bmap_allocrange(struct sfs_vnode *sv, uint32_t fileblock,
+		    uint32_t nblocks)
+{
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
 
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		sfs_extent_allocrange(sv, fileblock, nblocks);
 	}
+}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+/*
+ * Discard the blocks under the indirect block *IBPTR that are at or
+ * past file block BLOCKLEN. The indirect block has LEVELS levels of
+ * indirection and maps file blocks starting at BASEBLOCK. If nothing
+ * is left under it, free it too and clear *IBPTR.
+ */
+static
+int
+sfs_ibtrunc(struct sfs_fs *sfs, uint32_t *ibptr, unsigned levels,
+	    uint32_t baseblock, uint32_t blocklen)
+{
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t span, entrybase, old;
+	unsigned j;
+	int result;
+	int hasnonzero, iddirty;
 
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
+	if (*ibptr == 0) {
 		return 0;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
-		}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+	/* Number of blocks each entry maps */
+	span = sfs_ibrange(sfs, levels - 1);
 
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+	/*
+	 * (Compare by subtracting; the ends of the ranges can be past
+	 * what 32 bits hold.)
+	 */
+	if (blocklen >= baseblock &&
+	    blocklen - baseblock >= sfs_ibrange(sfs, levels)) {
+		/* All of it is before the proposed EOF */
+		return 0;
+	}
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+	/* Read the indirect block */
+	result = buffer_read(sfs->sfs_device, *ibptr, sfs->sfs_blocksize,
+			     &idbuf);
+	if (result) {
+		return result;
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+	iddata = buffer_map(idbuf);
+
+	hasnonzero = 0;
+	iddirty = 0;
+	for (j=0; j<SFS_DBPERIDB(sfs->sfs_blocksize); j++) {
+		entrybase = baseblock + j * span;
+		if (iddata[j] == 0 ||
+		    (blocklen >= entrybase && blocklen - entrybase >= span)) {
+			/* Nothing there, or nothing past the new EOF */
 		}
-	}
-
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
-
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
+		else if (levels == 1) {
+			/* Discard the block; it's past the new EOF */
+			sfs_bfree(sfs, iddata[j]);
+			iddata[j] = 0;
+			iddirty = 1;
 		}
-
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+		else {
+			old = iddata[j];
+			result = sfs_ibtrunc(sfs, &iddata[j], levels - 1,
+					     entrybase, blocklen);
+			if (iddata[j] != old) {
+				iddirty = 1;
+			}
+			if (result) {
+				if (iddirty) {
+					sfs_jdirty(sfs, idbuf);
+				}
+				buffer_release(idbuf);
+				return result;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = 1;
 		}
 	}
 
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: %s: Data block %u (block %u of file %u) "
-		      "marked free\n", sfs->sfs_sb.sb_volname,
-		      block, fileblock, sv->sv_ino);
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		buffer_release_and_invalidate(idbuf);
+		sfs_bfree(sfs, *ibptr);
+		*ibptr = 0;
+	}
+	else {
+		if (iddirty) {
+			/* The indirect block is dirty */
+			sfs_jdirty(sfs, idbuf);
+		}
+		buffer_release(idbuf);
 	}
-	*diskblock = block;
 	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for ftruncate() and from sfs_reclaim. The caller must hold
+ * the vnode's lock for writing.
  */
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t *ibptrs[3];
 
 	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	uint32_t blocklen = SFS_OFFBLOCKS(sfs, len);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	uint32_t i;
+	daddr_t block;
+	uint32_t baseblock;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	/* Drop anything past the new EOF that has no disk block yet */
+	sfs_dalloc_trunc(sv, len);
+
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		return sfs_extent_itrunc(sv, len);
+	}
+
+	/* Indirect blocks may go away; forget the one sfs_bmap cached */
+	spinlock_acquire(&sv->sv_bmaplock);
+	sv->sv_bmapbase = 0;
+	sv->sv_bmapblock = 0;
+	spinlock_release(&sv->sv_bmaplock);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -240,64 +510,126 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/* Then the single, double, and triple indirect blocks. */
+	ibptrs[0] = &sv->sv_i.sfi_indirect;
+	ibptrs[1] = &sv->sv_i.sfi_dindirect;
+	ibptrs[2] = &sv->sv_i.sfi_tindirect;
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+	for (i=0; i<3; i++) {
+		result = sfs_ibtrunc(sfs, ibptrs[i], i + 1, baseblock,
+				     blocklen);
 		if (result) {
-			vfs_biglock_release();
+			sv->sv_dirty = true;
 			return result;
 		}
+		baseblock += sfs_ibrange(sfs, i + 1);
+	}
 
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
+	/* Set the file size */
+	sv->sv_i.sfi_size = len;
 
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
+	/* Mark the inode dirty */
+	sv->sv_dirty = true;
+
+	return 0;
+}
+
+/*
+ * Write back the indirect block IDBLOCK, which has LEVELS levels of
+ * indirection, and everything under it.
+ */
+static
+int
+sfs_ibsync(struct sfs_fs *sfs, daddr_t idblock, unsigned levels)
+{
+	struct buf *idbuf;
+	uint32_t *iddata;
+	daddr_t *blocks;
+	unsigned i, num;
+	int result;
+
+	/* Copy the entries out; we can't hold the buffer while syncing */
+	blocks = kmalloc(SFS_DBPERIDB(sfs->sfs_blocksize) * sizeof(daddr_t));
+	if (blocks == NULL) {
+		return ENOMEM;
+	}
+	result = buffer_read(sfs->sfs_device, idblock, sfs->sfs_blocksize,
+			     &idbuf);
+	if (result) {
+		kfree(blocks);
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+	num = 0;
+	for (i=0; i<SFS_DBPERIDB(sfs->sfs_blocksize); i++) {
+		if (iddata[i] != 0) {
+			blocks[num++] = iddata[i];
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
+	}
+	buffer_release(idbuf);
+
+	if (levels > 1) {
+		for (i=0; i<num; i++) {
+			result = sfs_ibsync(sfs, blocks[i], levels - 1);
 			if (result) {
-				vfs_biglock_release();
+				kfree(blocks);
 				return result;
 			}
 		}
+		num = 0;
 	}
+	blocks[num++] = idblock;
 
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
+	result = buffer_syncblocks(sfs->sfs_device, blocks, num,
+				   sfs->sfs_blocksize);
+	kfree(blocks);
+	return result;
+}
 
-	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+/*
+ * Write back a file's own blocks - its inode, its indirect blocks,
+ * and its data - for fsync, without flushing the rest of the volume. The
+ * inode should already have been synced into the buffer cache, and
+ * the caller must hold the vnode's lock so the block map holds still.
+ */
+int
+sfs_syncfile(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t blocks[1 + SFS_NDIRECT];
+	daddr_t ibs[3];
+	unsigned i, num;
+	int result;
 
-	vfs_biglock_release();
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		return sfs_extent_syncfile(sv);
+	}
+
+	/* Inode and direct blocks */
+	num = 0;
+	blocks[num++] = sv->sv_ino;
+	for (i=0; i<SFS_NDIRECT; i++) {
+		if (sv->sv_i.sfi_direct[i] != 0) {
+			blocks[num++] = sv->sv_i.sfi_direct[i];
+		}
+	}
+	result = buffer_syncblocks(sfs->sfs_device, blocks, num,
+				   sfs->sfs_blocksize);
+	if (result) {
+		return result;
+	}
+
+	/* The indirect blocks and what they point to */
+	ibs[0] = sv->sv_i.sfi_indirect;
+	ibs[1] = sv->sv_i.sfi_dindirect;
+	ibs[2] = sv->sv_i.sfi_tindirect;
+	for (i=0; i<3; i++) {
+		if (ibs[i] != 0) {
+			result = sfs_ibsync(sfs, ibs[i], i + 1);
+			if (result) {
+				return result;
+			}
+		}
+	}
 	return 0;
 }
-
@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Delayed allocation.
+ *
+ * Blocks written past EOF aren't given disk blocks right away.
+ * Instead the vnode holds their contents in memory, in a run of
+ * consecutive file blocks, and they get disk blocks all together
+ * when the run is flushed: when a write doesn't continue it, when it
+ * is full, or when the vnode is synced. That way a file written a
+ * little at a time still gets its blocks allocated in runs, and a
+ * file that's written and removed before being synced never touches
+ * the freemap.
+ *
+ * The run's length limit is a window that works like the read-ahead
+ * window: it starts small, doubles each time a file being appended
+ * to fills it, and drops back to the minimum when the file is written
+ * anywhere else. So streaming writers get large contiguous runs while
+ * other files don't tie up much memory.
+ *
+ * So that flushing can't run out of space, each block held is
+ * counted against the free space with sfs_breserve when it's taken
+ * on, along with enough for any indirect or extent blocks the run
+ * might need. The flush allocates out of that reservation (see
+ * sfs_vballocrun) and only gives back what's left over.
+ *
+ * All of this is covered by the vnode's lock; only readers, who
+ * hold it shared, look at the held blocks without holding it for
+ * writing.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * Window limits, in blocks and in bytes; with big blocks the window
+ * can still grow to the minimum.
+ */
+#define SFS_DA_MINWINDOW	4
+#define SFS_DA_MAXBYTES		(32*1024)
+
+/*
+ * Blocks reserved for metadata per run, in the worst case. A run is
+ * shorter than an indirect block's range, so it crosses at most one
+ * boundary between bottom-level indirect blocks. The worst such
+ * boundary is between the double and triple indirect ranges, or
+ * between two children of the triple indirect block: a new chain on
+ * each side, five blocks in all. An extent-mapped file needs at
+ * most two: one to deepen the inode's list and one to split an
+ * extent block. (If a run comes back from the allocator in many
+ * pieces it can need more splits; those come out of the general
+ * free pool.)
+ */
+#define SFS_DA_IBMETA		5
+#define SFS_DA_EXTMETA		2
+
+/*
+ * Metadata reservation for a run in SV.
+ */
+static
+uint32_t
+sfs_dalloc_metablocks(struct sfs_vnode *sv)
+{
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		return SFS_DA_EXTMETA;
+	}
+	return SFS_DA_IBMETA;
+}
+
+/*
+ * If FILEBLOCK is being held in memory, return a pointer to its
+ * contents; otherwise NULL.
+ */
+void *
+sfs_dalloc_find(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (sv->sv_dacount == 0 || fileblock < sv->sv_dastart ||
+	    fileblock - sv->sv_dastart >= sv->sv_dacount) {
+		return NULL;
+	}
+	return sv->sv_dadata +
+		((fileblock - sv->sv_dastart) << sfs->sfs_blockshift);
+}
+
+/*
+ * Return the lowest file block a write might end up holding in
+ * memory: the first one past EOF, or the start of the current run.
+ */
+uint32_t
+sfs_dalloc_limit(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t limit;
+
+	limit = SFS_OFFBLOCKS(sfs, sv->sv_i.sfi_size);
+	if (sv->sv_dacount > 0 && sv->sv_dastart < limit) {
+		limit = sv->sv_dastart;
+	}
+	return limit;
+}
+
+/*
+ * Get disk blocks for the held blocks and move their contents into
+ * the buffer cache.
+ */
+int
+sfs_dalloc_flush(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	daddr_t block;
+	uint32_t i, n, need;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	n = sv->sv_dacount;
+	if (n == 0) {
+		return 0;
+	}
+
+	/* Allocate out of the space set aside for these. */
+	sv->sv_daflushing = true;
+
+	sfs_bmap_allocrange(sv, sv->sv_dastart, n);
+
+	result = 0;
+	for (i=0; i<n; i++) {
+		result = sfs_bmap(sv, sv->sv_dastart + i, true, &block);
+		if (result) {
+			break;
+		}
+		/* We have the whole block, so don't read the old one */
+		result = buffer_get(sfs->sfs_device, block,
+				    sfs->sfs_blocksize, &buf);
+		if (result) {
+			break;
+		}
+		memcpy(buffer_map(buf), sv->sv_dadata + i * sfs->sfs_blocksize,
+		       sfs->sfs_blocksize);
+		buffer_mark_dirty(buf);
+		buffer_release(buf);
+	}
+	sv->sv_daflushing = false;
+
+	if (i < n) {
+		/*
+		 * Keep whatever didn't make it, and keep enough of the
+		 * reservation to cover it. If what's left is short, try
+		 * to top it up; if that doesn't work there's nothing
+		 * better to do than go on without.
+		 */
+		memmove(sv->sv_dadata, sv->sv_dadata + i * sfs->sfs_blocksize,
+			(n - i) * sfs->sfs_blocksize);
+		sv->sv_dastart += i;
+		sv->sv_dacount = n - i;
+		need = n - i + sfs_dalloc_metablocks(sv);
+		if (sv->sv_dareserved > need) {
+			sfs_bunreserve(sfs, sv->sv_dareserved - need);
+			sv->sv_dareserved = need;
+		}
+		else if (sv->sv_dareserved < need &&
+			 sfs_breserve(sfs, need - sv->sv_dareserved) == 0) {
+			sv->sv_dareserved = need;
+		}
+		return result;
+	}
+
+	/* Give back whatever the metadata didn't need. */
+	sfs_bunreserve(sfs, sv->sv_dareserved);
+	sv->sv_dareserved = 0;
+
+	sv->sv_dacount = 0;
+	kfree(sv->sv_dadata);
+	sv->sv_dadata = NULL;
+	return 0;
+}
+
+/*
+ * Get the block a write to FILEBLOCK should go into, if it's one to
+ * hold in memory: either it's held already, or it's past EOF and can
+ * start or extend the run. Hands back NULL if the write should go to
+ * disk as usual.
+ */
+int
+sfs_dalloc_getblock(struct sfs_vnode *sv, uint32_t fileblock, void **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t need, maxwindow;
+	bool appending;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	*ret = sfs_dalloc_find(sv, fileblock);
+	if (*ret != NULL || sv->sv_i.sfi_type != SFS_TYPE_FILE) {
+		return 0;
+	}
+
+	/* Blocks before EOF go to disk. */
+	if (((off_t)fileblock << sfs->sfs_blockshift) < sv->sv_i.sfi_size) {
+		return 0;
+	}
+
+	maxwindow = SFS_DA_MAXBYTES >> sfs->sfs_blockshift;
+	if (maxwindow < SFS_DA_MINWINDOW) {
+		maxwindow = SFS_DA_MINWINDOW;
+	}
+
+	if (sv->sv_dawindow == 0) {
+		sv->sv_dawindow = SFS_DA_MINWINDOW;
+	}
+
+	if (sv->sv_dacount > 0 &&
+	    (fileblock != sv->sv_dastart + sv->sv_dacount ||
+	     sv->sv_dacount == sv->sv_dawindow)) {
+		/* Can't add to the run; write it out and start over */
+		appending = (fileblock == sv->sv_dastart + sv->sv_dacount);
+		result = sfs_dalloc_flush(sv);
+		if (result) {
+			return result;
+		}
+		if (!appending) {
+			sv->sv_dawindow = SFS_DA_MINWINDOW;
+		}
+		else if (sv->sv_dawindow < maxwindow) {
+			sv->sv_dawindow *= 2;
+		}
+	}
+
+	if (sv->sv_dacount == 0) {
+		/* Starting a run; if we can't, just go to disk */
+		need = 1 + sfs_dalloc_metablocks(sv);
+		if (sfs_breserve(sfs, need)) {
+			return 0;
+		}
+		sv->sv_dadata = kmalloc(sv->sv_dawindow * sfs->sfs_blocksize);
+		if (sv->sv_dadata == NULL) {
+			sfs_bunreserve(sfs, need);
+			return 0;
+		}
+		sv->sv_dastart = fileblock;
+	}
+	else {
+		need = 1;
+		result = sfs_breserve(sfs, need);
+		if (result) {
+			return result;
+		}
+	}
+	sv->sv_dareserved += need;
+
+	*ret = sv->sv_dadata + sv->sv_dacount * sfs->sfs_blocksize;
+	bzero(*ret, sfs->sfs_blocksize);
+	sv->sv_dacount++;
+	return 0;
+}
+
+/*
+ * The file is being truncated to LEN bytes; drop held blocks past
+ * that, and clear the rest of the one LEN ends in.
+ */
+void
+sfs_dalloc_trunc(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t blocklen, keep, release;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	if (sv->sv_dacount == 0) {
+		return;
+	}
+
+	blocklen = SFS_OFFBLOCKS(sfs, len);
+	keep = 0;
+	if (blocklen > sv->sv_dastart) {
+		keep = blocklen - sv->sv_dastart;
+	}
+	if (keep >= sv->sv_dacount) {
+		keep = sv->sv_dacount;
+	}
+	else {
+		/* (There may be nothing reserved if a flush failed.) */
+		release = sv->sv_dacount - keep;
+		if (release > sv->sv_dareserved) {
+			release = sv->sv_dareserved;
+		}
+		sfs_bunreserve(sfs, release);
+		sv->sv_dareserved -= release;
+		sv->sv_dacount = keep;
+	}
+
+	if (keep == 0) {
+		sfs_bunreserve(sfs, sv->sv_dareserved);
+		sv->sv_dareserved = 0;
+		kfree(sv->sv_dadata);
+		sv->sv_dadata = NULL;
+		return;
+	}
+
+	if (SFS_OFFINBLOCK(sfs, len) != 0 &&
+	    SFS_OFFBLOCK(sfs, len) >= sv->sv_dastart) {
+		bzero(sv->sv_dadata + (len - ((off_t)sv->sv_dastart <<
+					      sfs->sfs_blockshift)),
+		      sfs->sfs_blocksize - SFS_OFFINBLOCK(sfs, len));
+	}
+}
@@ -35,6 +35,8 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
+#include <buf.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -95,6 +97,442 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+// Hashed directories
+//
+// See <kern/sfs.h> for the layout. Each block is a bucket; the
+// table is preallocated, so every bucket has a disk block and the
+// size of the directory is the number of buckets times the block
+// size.
+
+/*
+ * Hash a name. The name may be a directory entry straight off disk,
+ * so don't look past SFS_NAMELEN bytes.
+ */
+static
+uint32_t
+sfs_dir_hash(const char *name)
+{
+	uint32_t h;
+	unsigned i;
+
+	h = SFS_DIRHASH_BASIS;
+	for (i=0; i<SFS_NAMELEN && name[i] != 0; i++) {
+		h = (h ^ (unsigned char)name[i]) * SFS_DIRHASH_PRIME;
+	}
+	return h;
+}
+
+/*
+ * Check if a directory is hashed.
+ */
+static
+bool
+sfs_dir_ishashed(struct sfs_vnode *sv)
+{
+	return (sv->sv_i.sfi_flags & SFS_IF_HASHDIR) != 0;
+}
+
+/*
+ * Get the number of buckets in a hashed directory.
+ */
+static
+unsigned
+sfs_dir_nbuckets(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t size;
+	unsigned nb;
+
+	KASSERT(sfs_dir_ishashed(sv));
+
+	size = sv->sv_i.sfi_size;
+	nb = size >> sfs->sfs_blockshift;
+	if ((size & (sfs->sfs_blocksize - 1)) != 0 || nb == 0 ||
+	    (nb & (nb - 1)) != 0) {
+		panic("sfs: %s: hashed directory %u: Invalid size %u\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino, size);
+	}
+	return nb;
+}
+
+/*
+ * Get the buffer holding bucket BUCKET of a hashed directory.
+ */
+static
+int
+sfs_dir_getbucket(struct sfs_vnode *sv, unsigned bucket, struct buf **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t diskblock;
+	int result;
+
+	result = sfs_bmap(sv, bucket, false, &diskblock);
+	if (result) {
+		return result;
+	}
+	if (diskblock == 0) {
+		panic("sfs: %s: hashed directory %u: bucket %u has no block\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino, bucket);
+	}
+	return buffer_read(sfs->sfs_device, diskblock, sfs->sfs_blocksize, ret);
+}
+
+/*
+ * Check if a bucket has no free slots.
+ */
+static
+bool
+sfs_dir_bucketfull(struct sfs_fs *sfs, const struct sfs_direntry *sds)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_DIRENTPERBLOCK(sfs->sfs_blocksize); i++) {
+		if (sds[i].sfd_ino == SFS_NOINO) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Look up a name in a hashed directory. Same interface as
+ * sfs_dir_findname; the empty slot handed back is the first one on
+ * the name's probe sequence, which is where the name should go.
+ */
+static
+int
+sfs_dir_hashfind(struct sfs_vnode *sv, const char *name,
+		 uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	struct sfs_direntry *sds;
+	unsigned per, nb, mask, bucket, i, k;
+	int empty = -1;
+	bool full;
+	int result;
+
+	if (strlen(name) >= SFS_NAMELEN) {
+		/* Can't be in here */
+		return ENOENT;
+	}
+
+	per = SFS_DIRENTPERBLOCK(sfs->sfs_blocksize);
+	nb = sfs_dir_nbuckets(sv);
+	mask = nb - 1;
+	bucket = sfs_dir_hash(name) & mask;
+
+	for (k=0; k<nb; k++) {
+		result = sfs_dir_getbucket(sv, bucket, &buf);
+		if (result) {
+			return result;
+		}
+		sds = buffer_map(buf);
+
+		full = true;
+		for (i=0; i<per; i++) {
+			if (sds[i].sfd_ino == SFS_NOINO) {
+				if (empty < 0) {
+					empty = bucket * per + i;
+				}
+				full = false;
+				continue;
+			}
+
+			/*
+			 * NAME is shorter than sfd_name, so this stops
+			 * inside sfd_name even if it isn't terminated.
+			 */
+			if (!strcmp(sds[i].sfd_name, name)) {
+				if (slot != NULL) {
+					*slot = bucket * per + i;
+				}
+				if (ino != NULL) {
+					*ino = sds[i].sfd_ino;
+				}
+				buffer_release(buf);
+				return 0;
+			}
+		}
+		buffer_release(buf);
+
+		/* Nothing probed past a bucket with room in it */
+		if (!full) {
+			break;
+		}
+		bucket = (bucket + 1) & mask;
+	}
+
+	if (emptyslot != NULL && empty >= 0) {
+		*emptyslot = empty;
+	}
+	return ENOENT;
+}
+
+/*
+ * Choose the number of buckets for a hashed directory that is to
+ * hold NENTRIES entries: enough that it starts out no more than
+ * about two-thirds full.
+ */
+static
+unsigned
+sfs_dir_hashsize(struct sfs_fs *sfs, unsigned nentries)
+{
+	unsigned nb;
+
+	nb = 1;
+	while (nb * SFS_DIRENTPERBLOCK(sfs->sfs_blocksize) <
+	       nentries + nentries / 2) {
+		nb *= 2;
+	}
+	return nb;
+}
+
+/*
+ * Rebuild a directory as a hash table with NEWNB buckets. This is
+ * used both to convert a flat directory and to grow a hashed one.
+ *
+ * All the blocks are allocated before anything is rewritten, so
+ * running out of space (ENOSPC) or out of room in the inode (EFBIG)
+ * leaves the directory as it was.
+ */
+static
+int
+sfs_dir_rehash(struct sfs_vnode *sv, unsigned newnb)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry *old, *new;
+	unsigned per, oldn, newn, i, j, mask, bucket;
+	off_t oldsize;
+	daddr_t diskblock;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+	KASSERT(newnb > 0 && (newnb & (newnb - 1)) == 0);
+
+	oldsize = sv->sv_i.sfi_size;
+	oldn = sfs_dir_nentries(sv);
+	per = SFS_DIRENTPERBLOCK(sfs->sfs_blocksize);
+	newn = newnb * per;
+	KASSERT(newn >= oldn);
+	mask = newnb - 1;
+
+	old = kmalloc(oldn * sizeof(struct sfs_direntry));
+	if (old == NULL) {
+		return ENOMEM;
+	}
+	new = kmalloc(newn * sizeof(struct sfs_direntry));
+	if (new == NULL) {
+		kfree(old);
+		return ENOMEM;
+	}
+
+	/* Read everything in and lay out the new table in memory. */
+	for (i=0; i<oldn; i++) {
+		result = sfs_readdir(sv, i, &old[i]);
+		if (result) {
+			goto out;
+		}
+	}
+	bzero(new, newn * sizeof(struct sfs_direntry));
+	for (i=0; i<oldn; i++) {
+		if (old[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		/* There's room somewhere, since newn >= oldn */
+		bucket = sfs_dir_hash(old[i].sfd_name) & mask;
+		while (1) {
+			for (j=0; j<per; j++) {
+				if (new[bucket * per + j].sfd_ino
+				    == SFS_NOINO) {
+					break;
+				}
+			}
+			if (j < per) {
+				break;
+			}
+			bucket = (bucket + 1) & mask;
+		}
+		new[bucket * per + j] = old[i];
+	}
+
+	/* Allocate all the blocks. */
+	for (i=0; i<newnb; i++) {
+		result = sfs_bmap(sv, i, true, &diskblock);
+		if (result) {
+			/* Give back whatever we got */
+			sfs_itrunc(sv, oldsize);
+			goto out;
+		}
+	}
+
+	/* Write it out. */
+	for (i=0; i<newnb; i++) {
+		result = sfs_metaio(sv, (off_t)i << sfs->sfs_blockshift,
+				   &new[i * per],
+				   sfs->sfs_blocksize, UIO_WRITE);
+		if (result) {
+			goto out;
+		}
+	}
+	KASSERT(sv->sv_i.sfi_size == newnb * sfs->sfs_blocksize);
+	sv->sv_i.sfi_flags |= SFS_IF_HASHDIR;
+	sv->sv_dirty = true;
+	result = 0;
+
+ out:
+	kfree(new);
+	kfree(old);
+	return result;
+}
+
+/*
+ * Pick the slot for a new name in a hashed directory, growing the
+ * table if the name would land too far from its home bucket.
+ */
+static
+int
+sfs_dir_hashslot(struct sfs_vnode *sv, const char *name, int *ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned nb, home, dist;
+	int emptyslot = -1;
+	int result;
+
+	nb = sfs_dir_nbuckets(sv);
+	home = sfs_dir_hash(name) & (nb - 1);
+
+	result = sfs_dir_hashfind(sv, name, NULL, NULL, &emptyslot);
+	if (result == 0) {
+		return EEXIST;
+	}
+	if (result != ENOENT) {
+		return result;
+	}
+
+	if (emptyslot >= 0) {
+		dist = emptyslot / SFS_DIRENTPERBLOCK(sfs->sfs_blocksize);
+		dist = (dist - home) & (nb - 1);
+		if (dist <= SFS_DIR_MAXPROBE) {
+			*ret = emptyslot;
+			return 0;
+		}
+	}
+
+	/* Too crowded; double the table. */
+	result = sfs_dir_rehash(sv, nb * 2);
+	if (result == ENOSPC || result == EFBIG) {
+		/* Can't grow; make do with a long probe if there's room. */
+		if (emptyslot < 0) {
+			return ENOSPC;
+		}
+		*ret = emptyslot;
+		return 0;
+	}
+	if (result) {
+		return result;
+	}
+
+	emptyslot = -1;
+	result = sfs_dir_hashfind(sv, name, NULL, NULL, &emptyslot);
+	KASSERT(result != 0);
+	if (result != ENOENT) {
+		return result;
+	}
+	KASSERT(emptyslot >= 0);
+	*ret = emptyslot;
+	return 0;
+}
+
+/*
+ * Remove the entry in slot SLOT of a hashed directory.
+ *
+ * If the entry's bucket was full, entries after it may have probed
+ * past it, and lookups for them would now stop at the hole. So pull
+ * back the first such entry found into the hole, which moves the
+ * hole to where that entry was, and repeat until we get to a bucket
+ * nothing probed past.
+ */
+static
+int
+sfs_dir_hashunlink(struct sfs_vnode *sv, int slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *holebuf, *buf;
+	struct sfs_direntry *hole, *sds;
+	unsigned per, nb, mask, holebucket, bucket, holeslot, home, i;
+	bool full;
+	int result;
+
+	per = SFS_DIRENTPERBLOCK(sfs->sfs_blocksize);
+	nb = sfs_dir_nbuckets(sv);
+	mask = nb - 1;
+	holebucket = slot / per;
+	holeslot = slot % per;
+	KASSERT(holebucket < nb);
+
+	result = sfs_dir_getbucket(sv, holebucket, &holebuf);
+	if (result) {
+		return result;
+	}
+	hole = buffer_map(holebuf);
+	KASSERT(hole[holeslot].sfd_ino != SFS_NOINO);
+	full = sfs_dir_bucketfull(sfs, hole);
+	bzero(&hole[holeslot], sizeof(hole[holeslot]));
+	sfs_jdirty(sfs, holebuf);
+
+	bucket = holebucket;
+	while (full) {
+		bucket = (bucket + 1) & mask;
+		if (bucket == holebucket) {
+			break;
+		}
+
+		result = sfs_dir_getbucket(sv, bucket, &buf);
+		if (result) {
+			buffer_release(holebuf);
+			return result;
+		}
+		sds = buffer_map(buf);
+		full = sfs_dir_bucketfull(sfs, sds);
+
+		/* Look for an entry whose probe crossed the hole */
+		for (i=0; i<per; i++) {
+			if (sds[i].sfd_ino == SFS_NOINO) {
+				continue;
+			}
+			home = sfs_dir_hash(sds[i].sfd_name) & mask;
+			if (((bucket - home) & mask) >=
+			    ((bucket - holebucket) & mask)) {
+				break;
+			}
+		}
+		if (i == per) {
+			buffer_release(buf);
+			continue;
+		}
+
+		/* Move it */
+		hole[holeslot] = sds[i];
+		sfs_jdirty(sfs, holebuf);
+		buffer_release(holebuf);
+		bzero(&sds[i], sizeof(sds[i]));
+		sfs_jdirty(sfs, buf);
+
+		holebuf = buf;
+		hole = sds;
+		holebucket = bucket;
+		holeslot = i;
+	}
+
+	buffer_release(holebuf);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
@@ -107,6 +545,10 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
 
+	if (sfs_dir_ishashed(sv)) {
+		return sfs_dir_hashfind(sv, name, ino, slot, emptyslot);
+	}
+
 	nentries = sfs_dir_nentries(sv);
 
 	/* For each slot... */
@@ -153,10 +595,24 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int emptyslot = -1;
+	int nentries;
 	int result;
 	struct sfs_direntry sd;
 
+	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
+		return ENAMETOOLONG;
+	}
+
+	if (sfs_dir_ishashed(sv)) {
+		result = sfs_dir_hashslot(sv, name, &emptyslot);
+		if (result) {
+			return result;
+		}
+		goto gotslot;
+	}
+
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
 	if (result!=0 && result!=ENOENT) {
@@ -166,15 +622,36 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return EEXIST;
 	}
 
-	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
-		return ENAMETOOLONG;
-	}
-
 	/* If we didn't get an empty slot, add the entry at the end. */
 	if (emptyslot < 0) {
-		emptyslot = sfs_dir_nentries(sv);
+		nentries = sfs_dir_nentries(sv);
+
+		/*
+		 * Unless the directory is getting big enough that
+		 * searching it linearly is slow; then make it a hash
+		 * table. If that doesn't work out for lack of space,
+		 * appending might still.
+		 */
+		if (nentries >= SFS_DIR_FLATMAX) {
+			result = sfs_dir_rehash(sv,
+					sfs_dir_hashsize(sfs, nentries + 1));
+			if (result == 0) {
+				result = sfs_dir_hashslot(sv, name,
+							  &emptyslot);
+				if (result) {
+					return result;
+				}
+				goto gotslot;
+			}
+			if (result != ENOSPC && result != EFBIG) {
+				return result;
+			}
+		}
+		emptyslot = nentries;
 	}
 
+ gotslot:
+
 	/* Set up the entry. */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = ino;
@@ -197,6 +674,10 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_direntry sd;
 
+	if (sfs_dir_ishashed(sv)) {
+		return sfs_dir_hashunlink(sv, slot);
+	}
+
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
@@ -207,7 +688,8 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 
 /*
  * Look for a name in a directory and hand back a vnode for the
- * file, if there is one.
+ * file, if there is one. The caller holds the directory's lock,
+ * which also keeps the link count of anything in it from changing.
  */
 int
 sfs_lookonce(struct sfs_vnode *sv, const char *name,
@@ -0,0 +1,695 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Block mapping for extent-mapped files. (See <kern/sfs.h> for the
+ * layout.)
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Number of blocks written back at once by sfs_ext_syncrun */
+#define SYNCCHUNK 32
+
+////////////////////////////////////////////////////////////
+// Extent lists
+//
+// These work on a sorted array of extents, which is either the
+// inode's own list or the contents of an extent block.
+
+/*
+ * Find the extent in EXTS (N of them) with the highest starting file
+ * block that isn't past FILEBLOCK. Returns -1 if there isn't one.
+ */
+static
+int
+sfs_ext_find(const struct sfs_extent *exts, unsigned n, uint32_t fileblock)
+{
+	unsigned lo, hi, mid;
+
+	/* Binary search for the first extent starting past FILEBLOCK */
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (exts[mid].sfe_fileblock <= fileblock) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return (int)lo - 1;
+}
+
+/*
+ * Look up FILEBLOCK in EXTS. Returns the disk block, or 0 if it's in
+ * a hole.
+ */
+static
+daddr_t
+sfs_ext_lookup(const struct sfs_extent *exts, unsigned n, uint32_t fileblock)
+{
+	int i;
+
+	i = sfs_ext_find(exts, n, fileblock);
+	if (i < 0 || fileblock - exts[i].sfe_fileblock >= exts[i].sfe_len) {
+		return 0;
+	}
+	return exts[i].sfe_diskblock + (fileblock - exts[i].sfe_fileblock);
+}
+
+/*
+ * Add the mapping FILEBLOCK -> BLOCK to EXTS, which has *N entries
+ * and room for MAX. FILEBLOCK must be in a hole. If BLOCK continues
+ * the extent before it or the one after it (or both), grow that
+ * extent instead of adding a new one. Returns false if a new one was
+ * needed and there wasn't room.
+ */
+static
+bool
+sfs_ext_add(struct sfs_extent *exts, unsigned *n, unsigned max,
+	    uint32_t fileblock, daddr_t block)
+{
+	struct sfs_extent *prev, *next;
+	unsigned j;
+	int i;
+
+	i = sfs_ext_find(exts, *n, fileblock);
+	prev = (i >= 0) ? &exts[i] : NULL;
+	next = ((unsigned)(i + 1) < *n) ? &exts[i + 1] : NULL;
+
+	if (prev != NULL &&
+	    prev->sfe_fileblock + prev->sfe_len == fileblock &&
+	    prev->sfe_diskblock + prev->sfe_len == block) {
+		prev->sfe_len++;
+		if (next != NULL &&
+		    next->sfe_fileblock == fileblock + 1 &&
+		    next->sfe_diskblock == block + 1) {
+			/* Filled the gap between them; merge */
+			prev->sfe_len += next->sfe_len;
+			for (j = i + 1; j + 1 < *n; j++) {
+				exts[j] = exts[j + 1];
+			}
+			(*n)--;
+			bzero(&exts[*n], sizeof(exts[*n]));
+		}
+		return true;
+	}
+
+	if (next != NULL &&
+	    next->sfe_fileblock == fileblock + 1 &&
+	    next->sfe_diskblock == block + 1) {
+		next->sfe_fileblock--;
+		next->sfe_diskblock--;
+		next->sfe_len++;
+		return true;
+	}
+
+	if (*n >= max) {
+		return false;
+	}
+	for (j = *n; j > (unsigned)(i + 1); j--) {
+		exts[j] = exts[j - 1];
+	}
+	exts[i + 1].sfe_fileblock = fileblock;
+	exts[i + 1].sfe_diskblock = block;
+	exts[i + 1].sfe_len = 1;
+	(*n)++;
+	return true;
+}
+
+/*
+ * Free the blocks mapped by EXTS (*N entries) at or past file block
+ * BLOCKLEN, dropping extents that end up empty. Returns true if
+ * anything changed.
+ */
+static
+bool
+sfs_ext_trunc(struct sfs_fs *sfs, struct sfs_extent *exts, unsigned *n,
+	      uint32_t blocklen)
+{
+	struct sfs_extent *e;
+	uint32_t keep, k;
+	bool changed = false;
+
+	while (*n > 0) {
+		e = &exts[*n - 1];
+		if (e->sfe_fileblock + e->sfe_len <= blocklen) {
+			break;
+		}
+		changed = true;
+
+		keep = 0;
+		if (e->sfe_fileblock < blocklen) {
+			keep = blocklen - e->sfe_fileblock;
+		}
+		for (k = keep; k < e->sfe_len; k++) {
+			sfs_bfree(sfs, e->sfe_diskblock + k);
+		}
+		if (keep > 0) {
+			e->sfe_len = keep;
+			break;
+		}
+		bzero(e, sizeof(*e));
+		(*n)--;
+	}
+	return changed;
+}
+
+////////////////////////////////////////////////////////////
+// Extent blocks
+
+/*
+ * The inode's extent list is full. Move the extents out into an
+ * extent block and make the inode an index with one entry.
+ */
+static
+int
+sfs_ext_deepen(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *sfi = &sv->sv_i;
+	struct sfs_extblock *eb;
+	struct buf *buf;
+	daddr_t block;
+	int result;
+
+	KASSERT(sfi->sfi_extdepth == 0);
+
+	result = sfs_vballoc(sv, sv->sv_ino, &block);
+	if (result) {
+		return result;
+	}
+	/* (sfs_balloc left a zeroed buffer for it in the cache) */
+	result = buffer_read(sfs->sfs_device, block, sfs->sfs_blocksize, &buf);
+	if (result) {
+		sfs_bfree(sfs, block);
+		return result;
+	}
+	eb = buffer_map(buf);
+
+	eb->seb_nextents = sfi->sfi_nextents;
+	memcpy(eb->seb_extents, sfi->sfi_extents,
+	       sfi->sfi_nextents * sizeof(struct sfs_extent));
+	sfs_jdirty(sfs, buf);
+	buffer_release(buf);
+
+	bzero(sfi->sfi_extents, sizeof(sfi->sfi_extents));
+	sfi->sfi_extents[0].sfe_diskblock = block;
+	sfi->sfi_nextents = 1;
+	sfi->sfi_extdepth = 1;
+	sv->sv_dirty = true;
+	return 0;
+}
+
+/*
+ * The extent block EB, for index entry IDX, is full. Move the upper
+ * half of it to a new extent block.
+ */
+static
+int
+sfs_ext_split(struct sfs_vnode *sv, unsigned idx, struct sfs_extblock *eb)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *sfi = &sv->sv_i;
+	struct sfs_extblock *neb;
+	struct buf *nbuf;
+	daddr_t block;
+	unsigned half, j;
+	int result;
+
+	KASSERT(sfi->sfi_extdepth == 1);
+
+	if (sfi->sfi_nextents >= SFS_NINOEXTENTS) {
+		/* The index is full too */
+		return EFBIG;
+	}
+
+	result = sfs_vballoc(sv, sfi->sfi_extents[idx].sfe_diskblock, &block);
+	if (result) {
+		return result;
+	}
+	result = buffer_read(sfs->sfs_device, block, sfs->sfs_blocksize, &nbuf);
+	if (result) {
+		sfs_bfree(sfs, block);
+		return result;
+	}
+	neb = buffer_map(nbuf);
+
+	half = eb->seb_nextents / 2;
+	neb->seb_nextents = eb->seb_nextents - half;
+	memcpy(neb->seb_extents, &eb->seb_extents[half],
+	       neb->seb_nextents * sizeof(struct sfs_extent));
+	bzero(&eb->seb_extents[half],
+	      neb->seb_nextents * sizeof(struct sfs_extent));
+	eb->seb_nextents = half;
+
+	for (j = sfi->sfi_nextents; j > idx + 1; j--) {
+		sfi->sfi_extents[j] = sfi->sfi_extents[j - 1];
+	}
+	sfi->sfi_extents[idx + 1].sfe_fileblock =
+		neb->seb_extents[0].sfe_fileblock;
+	sfi->sfi_extents[idx + 1].sfe_diskblock = block;
+	sfi->sfi_extents[idx + 1].sfe_len = 0;
+	sfi->sfi_nextents++;
+	sv->sv_dirty = true;
+
+	sfs_jdirty(sfs, nbuf);
+	buffer_release(nbuf);
+	return 0;
+}
+
+/*
+ * Add the mapping FILEBLOCK -> BLOCK to the file, which must not
+ * have FILEBLOCK mapped already, growing the tree if need be.
+ */
+static
+int
+sfs_ext_insert(struct sfs_vnode *sv, uint32_t fileblock, daddr_t block)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *sfi = &sv->sv_i;
+	struct sfs_extblock *eb;
+	struct buf *buf;
+	bool ok;
+	unsigned n;
+	int idx;
+	int result;
+
+	if (sfi->sfi_extdepth == 0) {
+		n = sfi->sfi_nextents;
+		if (sfs_ext_add(sfi->sfi_extents, &n, SFS_NINOEXTENTS,
+				fileblock, block)) {
+			sfi->sfi_nextents = n;
+			sv->sv_dirty = true;
+			return 0;
+		}
+
+		/* No room in the inode; go to two levels */
+		result = sfs_ext_deepen(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	KASSERT(sfi->sfi_extdepth == 1);
+
+	/* The first index entry starts at 0, so this always finds one */
+	idx = sfs_ext_find(sfi->sfi_extents, sfi->sfi_nextents, fileblock);
+	KASSERT(idx >= 0);
+
+	result = buffer_read(sfs->sfs_device,
+			     sfi->sfi_extents[idx].sfe_diskblock,
+			     sfs->sfs_blocksize, &buf);
+	if (result) {
+		return result;
+	}
+	eb = buffer_map(buf);
+
+	n = eb->seb_nextents;
+	if (!sfs_ext_add(eb->seb_extents, &n,
+			 SFS_EXTPERBLOCK(sfs->sfs_blocksize),
+			 fileblock, block)) {
+		result = sfs_ext_split(sv, idx, eb);
+		sfs_jdirty(sfs, buf);
+		if (result) {
+			buffer_release(buf);
+			return result;
+		}
+
+		/* Switch to the new block if that's where this goes */
+		if (fileblock >= sfi->sfi_extents[idx + 1].sfe_fileblock) {
+			buffer_release(buf);
+			idx++;
+			result = buffer_read(sfs->sfs_device,
+					     sfi->sfi_extents[idx].sfe_diskblock,
+					     sfs->sfs_blocksize, &buf);
+			if (result) {
+				return result;
+			}
+			eb = buffer_map(buf);
+		}
+
+		n = eb->seb_nextents;
+		ok = sfs_ext_add(eb->seb_extents, &n,
+				 SFS_EXTPERBLOCK(sfs->sfs_blocksize),
+				 fileblock, block);
+		KASSERT(ok);
+	}
+	eb->seb_nextents = n;
+	sfs_jdirty(sfs, buf);
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Look up FILEBLOCK. Hand back the disk block it's mapped to, or 0
+ * if it's in a hole. In that case also hand back (if GOAL isn't
+ * null) where a block for it should go: where the extent before it
+ * would put it if the extent were long enough, so that filling in
+ * the file keeps it contiguous, or else right after the inode.
+ */
+static
+int
+sfs_ext_map(struct sfs_vnode *sv, uint32_t fileblock, daddr_t *diskblock,
+	    daddr_t *goal)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *sfi = &sv->sv_i;
+	const struct sfs_extent *exts;
+	struct sfs_extblock *eb;
+	struct buf *buf;
+	unsigned n;
+	int i;
+	int result;
+
+	buf = NULL;
+	if (sfi->sfi_extdepth == 0) {
+		exts = sfi->sfi_extents;
+		n = sfi->sfi_nextents;
+	}
+	else {
+		/* The first index entry starts at 0, so this finds one */
+		i = sfs_ext_find(sfi->sfi_extents, sfi->sfi_nextents,
+				 fileblock);
+		KASSERT(i >= 0);
+
+		result = buffer_read(sfs->sfs_device,
+				     sfi->sfi_extents[i].sfe_diskblock,
+				     sfs->sfs_blocksize, &buf);
+		if (result) {
+			return result;
+		}
+		eb = buffer_map(buf);
+		exts = eb->seb_extents;
+		n = eb->seb_nextents;
+	}
+
+	*diskblock = sfs_ext_lookup(exts, n, fileblock);
+	if (*diskblock == 0 && goal != NULL) {
+		i = sfs_ext_find(exts, n, fileblock);
+		if (i >= 0) {
+			*goal = exts[i].sfe_diskblock +
+				(fileblock - exts[i].sfe_fileblock);
+		}
+		else {
+			*goal = sv->sv_ino + 1;
+		}
+	}
+
+	if (buf != NULL) {
+		buffer_release(buf);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * sfs_bmap for extent-mapped files.
+ */
+int
+sfs_extent_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block, goal = 0;
+	int result;
+
+	result = sfs_ext_map(sv, fileblock, &block, doalloc ? &goal : NULL);
+	if (result) {
+		return result;
+	}
+
+	if (block == 0 && doalloc) {
+		result = sfs_vballoc(sv, goal, &block);
+		if (result) {
+			return result;
+		}
+		result = sfs_ext_insert(sv, fileblock, block);
+		if (result) {
+			sfs_bfree(sfs, block);
+			return result;
+		}
+	}
+
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: %s: Data block %u (block %u of file %u) "
+		      "marked free\n", sfs->sfs_sb.sb_volname,
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * sfs_bmap_allocrange for extent-mapped files. Each hole in the range
+ * is filled from as few runs of free blocks as we can get, and each
+ * run becomes (at most) one new extent.
+ */
+void
+sfs_extent_allocrange(struct sfs_vnode *sv, uint32_t fileblock,
+		      uint32_t nblocks)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t end, holelen, got, i;
+	daddr_t block, goal, next;
+
+	end = fileblock + nblocks;
+	while (fileblock < end) {
+		if (sfs_ext_map(sv, fileblock, &block, &goal)) {
+			return;
+		}
+		if (block != 0) {
+			fileblock++;
+			continue;
+		}
+
+		/* Find how long the hole is */
+		for (holelen = 1; fileblock + holelen < end; holelen++) {
+			if (sfs_ext_map(sv, fileblock + holelen, &next,
+					NULL)) {
+				return;
+			}
+			if (next != 0) {
+				break;
+			}
+		}
+
+		if (sfs_vballocrun(sv, goal, holelen, &block, &got)) {
+			return;
+		}
+		for (i=0; i<got; i++) {
+			if (sfs_ext_insert(sv, fileblock + i, block + i)) {
+				/* Give back what didn't get mapped */
+				for (; i<got; i++) {
+					sfs_bfree(sfs, block + i);
+				}
+				return;
+			}
+		}
+		fileblock += got;
+	}
+}
+
+/*
+ * sfs_itrunc for extent-mapped files.
+ */
+int
+sfs_extent_itrunc(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *sfi = &sv->sv_i;
+	struct sfs_extent *ie;
+	struct sfs_extblock *eb;
+	struct buf *buf;
+	uint32_t blocklen;
+	unsigned n;
+	int result;
+
+	/* Length in blocks (divide rounding up) */
+	blocklen = SFS_OFFBLOCKS(sfs, len);
+
+	if (sfi->sfi_extdepth == 0) {
+		n = sfi->sfi_nextents;
+		sfs_ext_trunc(sfs, sfi->sfi_extents, &n, blocklen);
+		sfi->sfi_nextents = n;
+	}
+	else {
+		/*
+		 * Work back from the last extent block, freeing the
+		 * ones that empty out, until we get to one that still
+		 * has something in it.
+		 */
+		while (sfi->sfi_nextents > 0) {
+			ie = &sfi->sfi_extents[sfi->sfi_nextents - 1];
+			result = buffer_read(sfs->sfs_device,
+					     ie->sfe_diskblock,
+					     sfs->sfs_blocksize, &buf);
+			if (result) {
+				return result;
+			}
+			eb = buffer_map(buf);
+
+			n = eb->seb_nextents;
+			if (sfs_ext_trunc(sfs, eb->seb_extents, &n,
+					  blocklen)) {
+				eb->seb_nextents = n;
+				sfs_jdirty(sfs, buf);
+			}
+			if (n > 0) {
+				buffer_release(buf);
+				break;
+			}
+
+			buffer_release_and_invalidate(buf);
+			sfs_bfree(sfs, ie->sfe_diskblock);
+			bzero(ie, sizeof(*ie));
+			sfi->sfi_nextents--;
+		}
+		if (sfi->sfi_nextents == 0) {
+			sfi->sfi_extdepth = 0;
+		}
+	}
+
+	/* Set the file size */
+	sfi->sfi_size = len;
+
+	/* Mark the inode dirty */
+	sv->sv_dirty = true;
+
+	return 0;
+}
+
+/*
+ * Write back the cached dirty blocks among the LEN blocks starting at
+ * disk block START.
+ */
+static
+int
+sfs_ext_syncrun(struct sfs_fs *sfs, daddr_t start, uint32_t len)
+{
+	daddr_t blocks[SYNCCHUNK];
+	unsigned i, num;
+	int result;
+
+	while (len > 0) {
+		num = len < SYNCCHUNK ? len : SYNCCHUNK;
+		for (i=0; i<num; i++) {
+			blocks[i] = start + i;
+		}
+		result = buffer_syncblocks(sfs->sfs_device, blocks, num,
+					   sfs->sfs_blocksize);
+		if (result) {
+			return result;
+		}
+		start += num;
+		len -= num;
+	}
+	return 0;
+}
+
+/*
+ * sfs_syncfile for extent-mapped files: write back the inode, the
+ * extent blocks, and the data.
+ */
+int
+sfs_extent_syncfile(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *sfi = &sv->sv_i;
+	struct sfs_extblock *eb, *copy;
+	struct buf *buf;
+	unsigned i, j;
+	int result;
+
+	result = sfs_ext_syncrun(sfs, sv->sv_ino, 1);
+	if (result) {
+		return result;
+	}
+
+	if (sfi->sfi_extdepth == 0) {
+		for (i=0; i<sfi->sfi_nextents; i++) {
+			result = sfs_ext_syncrun(sfs,
+					sfi->sfi_extents[i].sfe_diskblock,
+					sfi->sfi_extents[i].sfe_len);
+			if (result) {
+				return result;
+			}
+		}
+		return 0;
+	}
+
+	/*
+	 * Copy each extent block out, because we can't be holding
+	 * its buffer while writing it back.
+	 */
+	copy = kmalloc(sfs->sfs_blocksize);
+	if (copy == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<sfi->sfi_nextents; i++) {
+		result = buffer_read(sfs->sfs_device,
+				     sfi->sfi_extents[i].sfe_diskblock,
+				     sfs->sfs_blocksize, &buf);
+		if (result) {
+			goto out;
+		}
+		eb = buffer_map(buf);
+		memcpy(copy, eb, sfs->sfs_blocksize);
+		buffer_release(buf);
+
+		result = sfs_ext_syncrun(sfs,
+					 sfi->sfi_extents[i].sfe_diskblock, 1);
+		if (result) {
+			goto out;
+		}
+		for (j=0; j<copy->seb_nextents; j++) {
+			result = sfs_ext_syncrun(sfs,
+					copy->seb_extents[j].sfe_diskblock,
+					copy->seb_extents[j].sfe_len);
+			if (result) {
+				goto out;
+			}
+		}
+	}
+	result = 0;
+ out:
+	kfree(copy);
+	return result;
+}
@@ -39,32 +39,40 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
+#include <kcache.h>
 #include "sfsprivate.h"
 
 
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_NBLOCKS(sfs)        ((sfs)->sfs_sb.sb_nblocks)
-#define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
-#define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
+#define SFS_FS_FREEMAPBITS(sfs) \
+	SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs), (sfs)->sfs_blocksize)
+#define SFS_FS_FREEMAPBLOCKS(sfs) \
+	SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs), (sfs)->sfs_blocksize)
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reading loads the whole bitmap; writing only writes the blocks
+ * marked in sfs_freemapdirtymap (see sfs_bdirty), so the cost of a
+ * sync depends on how much of the freemap changed rather than on
+ * the size of the volume.
  *
- * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
- * sectors of bits, one bit for each sector on the filesystem. The
- * number of blocks in the bitmap is thus rounded up to the nearest
- * multiple of 512*8 = 4096. (This rounded number is SFS_FREEMAPBITS.)
+ * The free block bitmap consists of SFS_FREEMAPBLOCKS blocks of
+ * bits, one bit for each block on the filesystem. The number of
+ * blocks in the bitmap is thus rounded up to the nearest multiple of
+ * the number of bits in a block, which is 512*8 = 4096 with the
+ * smallest block size. (This rounded number is SFS_FREEMAPBITS.)
  * This means that the bitmap will (in general) contain space for some
- * number of invalid sectors that are actually beyond the end of the
- * disk device. This is ok. These sectors are supposed to be marked
+ * number of invalid blocks that are actually beyond the end of the
+ * disk device. This is ok. These blocks are supposed to be marked
  * "in use" by mksfs and never get marked "free".
  *
- * The sectors used by the superblock and the bitmap itself are
+ * The blocks used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
  */
 static
@@ -85,16 +93,22 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	for (j=0; j<freemapblocks; j++) {
 
 		/* Get a pointer to its data */
-		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
+		void *ptr = freemapdata + j*sfs->sfs_blocksize;
 
-		/* and read or write it. The freemap starts at sector 2. */
+		/* and read or write it. The freemap starts at block 2. */
 		if (rw == UIO_READ) {
 			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
-					       SFS_BLOCKSIZE);
+					       sfs->sfs_blocksize);
 		}
-		else {
+		else if (bitmap_isset(sfs->sfs_freemapdirtymap, j)) {
 			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
+						sfs->sfs_blocksize);
+			if (result == 0) {
+				bitmap_unmark(sfs->sfs_freemapdirtymap, j);
+			}
+		}
+		else {
+			result = 0;
 		}
 
 		/* If we failed, stop. */
@@ -105,6 +119,62 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * The fixed metadata at the front of the volume (the superblock, the
+ * root directory inode, and the freemap) is rewritten on every sync,
+ * so we keep it pinned in the buffer cache for as long as the volume
+ * is mounted.
+ */
+#define SFS_FS_METABLOCKS(sfs) (SFS_FREEMAP_START + SFS_FS_FREEMAPBLOCKS(sfs))
+
+/*
+ * Unpin the first NBLOCKS metadata blocks.
+ */
+static
+void
+sfs_unpinmeta(struct sfs_fs *sfs, daddr_t nblocks)
+{
+	struct buf *buf;
+	daddr_t block;
+	int result;
+
+	for (block=0; block<nblocks; block++) {
+		/* It's pinned, so it's in memory, so this can't fail */
+		result = buffer_read(sfs->sfs_device, block,
+				     sfs->sfs_blocksize, &buf);
+		KASSERT(result == 0);
+		buffer_unpin(buf);
+		buffer_release(buf);
+	}
+}
+
+/*
+ * Pin the metadata blocks.
+ */
+static
+int
+sfs_pinmeta(struct sfs_fs *sfs)
+{
+	struct buf *buf;
+	daddr_t block, nblocks;
+	int result;
+
+	COMPILE_ASSERT(SFS_SUPER_BLOCK == 0);
+	nblocks = SFS_FS_METABLOCKS(sfs);
+
+	for (block=0; block<nblocks; block++) {
+		result = buffer_read(sfs->sfs_device, block,
+				     sfs->sfs_blocksize, &buf);
+		if (result) {
+			sfs_unpinmeta(sfs, block);
+			return result;
+		}
+		buffer_pin(buf);
+		buffer_release(buf);
+	}
+	return 0;
+}
+
 /*
  * Sync routine for the vnode table.
  */
@@ -112,14 +182,59 @@ static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
+	struct vnodearray *copy;
+	struct vnode *v;
+	struct sfs_vnode *sv;
 	unsigned i, num;
+	int result;
+
+	copy = vnodearray_create();
+	if (copy == NULL) {
+		return ENOMEM;
+	}
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Take a reference to everything in the table that's in use
+	 * and work from the copy. (Unused vnodes are always clean.)
+	 * We can't take the vnode locks while holding sfs_vnlock, as
+	 * lookups take them in the other order.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	result = vnodearray_setsize(copy, sfs->sfs_nvnodes);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(copy);
+		return result;
+	}
+	num = 0;
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			if (sv->sv_unused) {
+				continue;
+			}
+			VOP_INCREF(&sv->sv_absvn);
+			vnodearray_set(copy, num++, &sv->sv_absvn);
+		}
+	}
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Sync each one. Use sfs_sync_inode rather than VOP_FSYNC;
+	 * the latter would also flush the buffer cache each time,
+	 * and sfs_sync does that once at the end.
+	 */
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		v = vnodearray_get(copy, i);
+		sv = v->vn_data;
+		rwlock_acquire_write(sv->sv_lock);
+		sfs_sync_inode(sv);
+		rwlock_release_write(sv->sv_lock);
+		VOP_DECREF(v);
 	}
+
+	vnodearray_setsize(copy, 0);
+	vnodearray_destroy(copy);
 	return 0;
 }
 
@@ -132,13 +247,16 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
@@ -152,14 +270,17 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -174,8 +295,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -208,28 +327,64 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
+	if (sfs->sfs_jmax > 0) {
+		/* Wait for operations to finish and keep new ones out */
+		rwlock_acquire_write(sfs->sfs_jlock);
+
+		/* Finish the last commit, if its blocks didn't go home */
+		result = sfs_jcheckpoint(sfs);
+		if (result) {
+			goto out;
+		}
+	}
+
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		goto out;
+	}
+
+	if (sfs->sfs_jmax > 0) {
+		/* Keep sfs_reclaim out too, and get ready to commit */
+		lock_acquire(sfs->sfs_vnlock);
+		sfs_jprepare(sfs);
 	}
 
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		goto out_vnlock;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
+		goto out_vnlock;
+	}
+
+	if (sfs->sfs_jmax > 0) {
+		/* Journal all of that, then let it go home */
+		result = sfs_jcommit(sfs);
+	}
+
+ out_vnlock:
+	if (sfs->sfs_jmax > 0) {
+		lock_release(sfs->sfs_vnlock);
+	}
+ out:
+	if (sfs->sfs_jmax > 0) {
+		rwlock_release_write(sfs->sfs_jlock);
+	}
+	if (result) {
+		return result;
+	}
+
+	/* All of the above only updated the buffer cache; flush it. */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
 		return result;
 	}
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -243,13 +398,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The name is fixed at mount time, so no lock is needed */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -262,7 +413,16 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	if (sfs->sfs_freemapdirtymap != NULL) {
+		bitmap_destroy(sfs->sfs_freemapdirtymap);
+	}
+	sfs_jcleanup(sfs);
+	rwlock_destroy(sfs->sfs_jlock);
+	spinlock_cleanup(&sfs->sfs_jtxlock);
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnhash);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -277,18 +437,41 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. Nothing
+	 * can load a new vnode without going through one we already
+	 * have, or through vfs_getroot, which the vfs list lock held
+	 * by our caller shuts out.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > sfs->sfs_nunused) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_nreserved == 0);
+	KASSERT(sfs->sfs_jtxcount == 0);
+	KASSERT(sfs->sfs_njfreed == 0);
+
+	/*
+	 * ...which should have flushed the buffer cache too, but
+	 * make sure, as this is the last chance to fail.
+	 */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	/* Nothing of ours may stay in memory. */
+	sfs_vnode_purge(sfs);
+	sfs_unpinmeta(sfs, SFS_FS_METABLOCKS(sfs));
+	buffer_drop_device(sfs->sfs_device);
 
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
@@ -297,7 +480,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -321,12 +503,15 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
-	 * Make sure our on-disk structures aren't messed up
+	 * Make sure our on-disk structures aren't messed up. (Every
+	 * block size is a multiple of SFS_BLOCKSIZE.)
 	 */
 	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
 
 	/* Allocate object */
@@ -346,22 +531,62 @@ sfs_fs_create(void)
 	/* superblock */
 	/* (ignore sfs_super, we'll read in over it shortly) */
 	sfs->sfs_superdirty = false;
+	sfs->sfs_blocksize = 0;		/* (set from the superblock) */
+	sfs->sfs_blockshift = 0;
 
 	/* device we mount on */
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
 		goto cleanup_object;
 	}
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASHSIZE * sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		goto cleanup_vnlock;
+	}
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_lruhead = sfs->sfs_lrutail = NULL;
+	sfs->sfs_nunused = 0;
 
 	/* freemap */
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vnodes;
+	}
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemapdirtymap = NULL;
+	sfs->sfs_nfree = 0;
+	sfs->sfs_nreserved = 0;
+
+	/* journal */
+	sfs->sfs_jlock = rwlock_create("sfs_jlock");
+	if (sfs->sfs_jlock == NULL) {
+		goto cleanup_freemap;
+	}
+	spinlock_init(&sfs->sfs_jtxlock);
+	sfs->sfs_jmax = 0;
+	sfs->sfs_jseq = 0;
+	sfs->sfs_jtx = NULL;
+	sfs->sfs_jtxcount = 0;
+	sfs->sfs_joverflow = false;
+	sfs->sfs_jckpt = false;
+	sfs->sfs_jfreed = NULL;
+	sfs->sfs_njfreed = 0;
 
 	return sfs;
 
+cleanup_freemap:
+	lock_destroy(sfs->sfs_freemaplock);
+cleanup_vnodes:
+	kfree(sfs->sfs_vnhash);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -387,8 +612,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
 	struct sfs_fs *sfs;
-
-	vfs_biglock_acquire();
+	struct buf *buf;
+	uint32_t bs, devblocks;
+	unsigned shift;
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -396,78 +622,145 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/*
 	 * We can't mount on devices with the wrong sector size.
 	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * (Note: a filesystem block may be composed of several hardware
+	 * sectors; the block size is chosen by mksfs and recorded in
+	 * the superblock. It's always a multiple of SFS_BLOCKSIZE, so
+	 * the sector size has to divide that.)
 	 */
-	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
+	if (SFS_BLOCKSIZE % dev->d_blocksize != 0) {
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
 	}
 
+	/*
+	 * The vnode cache is shared by all mounts; the vfs list lock,
+	 * held by vfs_mount while it calls us, covers us.
+	 */
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = kcache_create("sfs_vnode",
+						sizeof(struct sfs_vnode),
+						sfs_vnode_ctor,
+						sfs_vnode_dtor);
+		if (sfs_vnode_cache == NULL) {
+			return ENOMEM;
+		}
+	}
+
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
 	/* Set the device so we can use sfs_readblock() */
 	sfs->sfs_device = dev;
 
-	/* Load superblock */
-	result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
-			       sizeof(sfs->sfs_sb));
+	/*
+	 * Load superblock. It's at the start of block 0, but we don't
+	 * know the block size until we've read it; read the first
+	 * SFS_BLOCKSIZE bytes and then throw that buffer away, since
+	 * all buffers for a device have to be the same size.
+	 */
+	result = buffer_read(dev, SFS_SUPER_BLOCK, SFS_BLOCKSIZE, &buf);
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
+	memcpy(&sfs->sfs_sb, buffer_map(buf), sizeof(sfs->sfs_sb));
+	buffer_release_and_invalidate(buf);
 
-	/* Make some simple sanity checks */
+	/*
+	 * Make some simple sanity checks. From here on, failing must
+	 * also clear out anything we've loaded into the buffer cache.
+	 */
 
 	if (sfs->sfs_sb.sb_magic != SFS_MAGIC) {
 		kprintf("sfs: Wrong magic number in superblock "
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_sb.sb_magic,
 			SFS_MAGIC);
+		buffer_drop_device(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	if (sfs->sfs_sb.sb_nblocks > dev->d_blocks) {
+	/* Volumes from before sb_blocksize was recorded leave it 0 */
+	bs = sfs->sfs_sb.sb_blocksize;
+	if (bs == 0) {
+		bs = SFS_BLOCKSIZE;
+	}
+	for (shift = 0; shift < 31 && (1U << shift) < bs; shift++) {
+		/* nothing */
+	}
+	if (bs < SFS_BLOCKSIZE || bs > SFS_MAXBLOCKSIZE ||
+	    (1U << shift) != bs) {
+		kprintf("sfs: Invalid block size %u in superblock\n", bs);
+		buffer_drop_device(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+	sfs->sfs_blocksize = bs;
+	sfs->sfs_blockshift = shift;
+
+	devblocks = dev->d_blocks / (bs / dev->d_blocksize);
+	if (sfs->sfs_sb.sb_nblocks > devblocks) {
 		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_sb.sb_nblocks, dev->d_blocks);
+			sfs->sfs_sb.sb_nblocks, devblocks);
 	}
 
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/* Finish anything the journal says was committed */
+	result = sfs_jreplay(sfs);
+	if (result) {
+		buffer_drop_device(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
-	if (sfs->sfs_freemap == NULL) {
+	sfs->sfs_freemapdirtymap = bitmap_create(SFS_FS_FREEMAPBLOCKS(sfs));
+	if (sfs->sfs_freemap == NULL || sfs->sfs_freemapdirtymap == NULL) {
+		buffer_drop_device(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
+		buffer_drop_device(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+	sfs_bcount(sfs);
+
+	result = sfs_jstart(sfs);
+	if (result) {
+		buffer_drop_device(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
+	/* Keep the fixed metadata in the buffer cache */
+	result = sfs_pinmeta(sfs);
+	if (result) {
+		buffer_drop_device(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -35,13 +35,48 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <kcache.h>
 #include "sfsprivate.h"
 
+/* Cache for struct sfs_vnode; created by the first mount. */
+struct kcache *sfs_vnode_cache;
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Constructed state of an sfs_vnode, for the object cache: it has
+ * its locks. The rest is filled in by sfs_loadvnode.
+ */
+int
+sfs_vnode_ctor(void *obj)
+{
+	struct sfs_vnode *sv = obj;
+
+	sv->sv_lock = rwlock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&sv->sv_ralock);
+	spinlock_init(&sv->sv_bmaplock);
+	return 0;
+}
+
+void
+sfs_vnode_dtor(void *obj)
+{
+	struct sfs_vnode *sv = obj;
+
+	spinlock_cleanup(&sv->sv_bmaplock);
+	spinlock_cleanup(&sv->sv_ralock);
+	rwlock_destroy(sv->sv_lock);
+}
+
+
+/*
+ * Write an on-disk inode structure back out to disk, after giving
+ * disk blocks to any file data being held in memory. The caller must
+ * hold the vnode's lock for writing.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -49,6 +84,13 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	result = sfs_dalloc_flush(sv);
+	if (result) {
+		return result;
+	}
+
 	if (sv->sv_dirty) {
 		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
 					sizeof(sv->sv_i));
@@ -60,6 +102,157 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// Vnode table
+
+/*
+ * The vnodes in memory are kept in a hash table keyed by inode
+ * number. When the last reference to a vnode whose file still exists
+ * goes away, the vnode stays in the table with the table holding its
+ * last reference, and goes on an LRU list; loading the inode again
+ * takes it off the list without rereading the disk. Once more than
+ * SFS_VNMAXUNUSED are waiting, the oldest are thrown out.
+ *
+ * Everything here is covered by sfs_vnlock.
+ */
+
+static
+struct sfs_vnode *
+sfs_vnfind(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	for (sv = sfs->sfs_vnhash[ino % SFS_VNHASHSIZE];
+	     sv != NULL; sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_vnhashinsert(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned ix = sv->sv_ino % SFS_VNHASHSIZE;
+
+	sv->sv_hashnext = sfs->sfs_vnhash[ix];
+	sfs->sfs_vnhash[ix] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnhashremove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **p;
+
+	for (p = &sfs->sfs_vnhash[sv->sv_ino % SFS_VNHASHSIZE];
+	     *p != NULL; p = &(*p)->sv_hashnext) {
+		if (*p == sv) {
+			*p = sv->sv_hashnext;
+			sv->sv_hashnext = NULL;
+			KASSERT(sfs->sfs_nvnodes > 0);
+			sfs->sfs_nvnodes--;
+			return;
+		}
+	}
+	panic("sfs: %s: vnode %u not in vnode table\n",
+	      sfs->sfs_sb.sb_volname, sv->sv_ino);
+}
+
+static
+void
+sfs_vnlruremove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(sv->sv_unused);
+
+	if (sv->sv_lruprev != NULL) {
+		sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
+	}
+	else {
+		KASSERT(sfs->sfs_lruhead == sv);
+		sfs->sfs_lruhead = sv->sv_lrunext;
+	}
+	if (sv->sv_lrunext != NULL) {
+		sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
+	}
+	else {
+		KASSERT(sfs->sfs_lrutail == sv);
+		sfs->sfs_lrutail = sv->sv_lruprev;
+	}
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_unused = false;
+	KASSERT(sfs->sfs_nunused > 0);
+	sfs->sfs_nunused--;
+}
+
+static
+void
+sfs_vnlruaddtail(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(!sv->sv_unused);
+
+	sv->sv_lrunext = NULL;
+	sv->sv_lruprev = sfs->sfs_lrutail;
+	if (sfs->sfs_lrutail != NULL) {
+		sfs->sfs_lrutail->sv_lrunext = sv;
+	}
+	else {
+		sfs->sfs_lruhead = sv;
+	}
+	sfs->sfs_lrutail = sv;
+	sv->sv_unused = true;
+	sfs->sfs_nunused++;
+}
+
+/*
+ * Take a vnode out of the table and free it. The caller has the last
+ * reference, and the inode has already been written back.
+ */
+static
+void
+sfs_vnode_destroy(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(!sv->sv_dirty);
+	KASSERT(sv->sv_dacount == 0);
+
+	sfs_vnhashremove(sfs, sv);
+	vnode_cleanup(&sv->sv_absvn);
+	kcache_free(sfs_vnode_cache, sv);
+}
+
+/*
+ * Throw out unused vnodes until there are at most MAXUNUSED left.
+ */
+static
+void
+sfs_vnode_trim(struct sfs_fs *sfs, unsigned maxunused)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	while (sfs->sfs_nunused > maxunused) {
+		sv = sfs->sfs_lruhead;
+		sfs_vnlruremove(sfs, sv);
+		sfs_vnode_destroy(sfs, sv);
+	}
+}
+
+/*
+ * Throw out all unused vnodes; for unmount.
+ */
+void
+sfs_vnode_purge(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnode_trim(sfs, 0);
+	lock_release(sfs->sfs_vnlock);
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -70,16 +263,17 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. sfs_loadvnode only hands
+	 * out references while holding sfs_vnlock, so once we have it
+	 * and the count is still 1, nobody else can get at the vnode.
+	 * Keep holding it until the vnode is out of the table, so the
+	 * inode can't be reloaded from disk before we write it back.
 	 */
+	lock_acquire(sfs->sfs_vnlock);
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
@@ -88,55 +282,52 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
+	/*
+	 * Nobody else has a reference, so nobody else holds sv_lock
+	 * either; this doesn't wait, and so doesn't run afoul of the
+	 * usual order of taking sv_lock first.
+	 */
+	rwlock_acquire_write(sv->sv_lock);
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			rwlock_release_write(sv->sv_lock);
+			lock_release(sfs->sfs_vnlock);
 			return result;
 		}
 	}
 
-	/* Sync the inode to disk */
+	/*
+	 * Sync the inode to disk. (Well, to the buffer cache.) Unused
+	 * vnodes are always clean, so sync and unmount can skip them.
+	 */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	rwlock_release_write(sv->sv_lock);
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
+	if (sv->sv_i.sfi_linkcount == 0) {
+		/* No on-disk references; discard the inode and the vnode */
 		sfs_bfree(sfs, sv->sv_ino);
+		sfs_vnode_destroy(sfs, sv);
 	}
-
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	else {
+		/* Keep it, holding the last reference, in case it's wanted */
+		sfs_vnlruaddtail(sfs, sv);
+		sfs_vnode_trim(sfs, SFS_VNMAXUNUSED);
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
-
-	vnode_cleanup(&sv->sv_absvn);
-
-	vfs_biglock_release();
 
-	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	lock_release(sfs->sfs_vnlock);
 
 	/* Done */
 	return 0;
@@ -144,47 +335,39 @@ sfs_reclaim(struct vnode *v)
 
 /*
  * Function to load a inode into memory as a vnode, or dig up one
- * that's already resident.
+ * that's already resident. The caller holds sfs_vnlock.
  */
+static
 int
-sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
-		 struct sfs_vnode **ret)
+sfs_loadvnode_locked(struct sfs_fs *sfs, uint32_t ino, int forcetype,
+		     struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
 
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
-			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	/* Look in the vnodes table */
+	sv = sfs_vnfind(sfs, ino);
+	if (sv != NULL) {
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+
+		if (sv->sv_unused) {
+			/* The table's reference becomes the caller's */
+			sfs_vnlruremove(sfs, sv);
 		}
-
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
+		else {
 			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
 		}
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kcache_alloc(sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -198,7 +381,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
+		kcache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -208,11 +391,13 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out by sfs_balloc and
-	 * thus the type recorded there will be SFS_TYPE_INVAL.
+	 * thus the type recorded there will be SFS_TYPE_INVAL. New
+	 * files are mapped with extents.
 	 */
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
+		sv->sv_i.sfi_flags = SFS_IF_EXTENTS;
 		sv->sv_dirty = true;
 	}
 
@@ -235,20 +420,29 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kcache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_hashnext = NULL;
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_unused = false;
+	sv->sv_ranextpos = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
+	sv->sv_bmapbase = 0;
+	sv->sv_bmapblock = 0;
+	sv->sv_dadata = NULL;
+	sv->sv_dastart = 0;
+	sv->sv_dacount = 0;
+	sv->sv_dawindow = 0;
+	sv->sv_dareserved = 0;
+	sv->sv_daflushing = false;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	sfs_vnhashinsert(sfs, sv);
 
 	/* Hand it back */
 	*ret = sv;
@@ -256,10 +450,27 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 }
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Same, taking sfs_vnlock.
+ */
+int
+sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
+		 struct sfs_vnode **ret)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	result = sfs_loadvnode_locked(sfs, ino, forcetype, ret);
+	lock_release(sfs->sfs_vnlock);
+	return result;
+}
+
+/*
+ * Create a new filesystem object and hand back its vnode. GOAL is a
+ * block to put its inode near, normally its directory's inode.
  */
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, int type, daddr_t goal,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
@@ -269,7 +480,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, goal, &ino);
 	if (result) {
 		return result;
 	}
@@ -296,25 +507,19 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
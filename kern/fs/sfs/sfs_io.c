@@ -36,8 +36,10 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -46,89 +48,57 @@
 // Basic block-level I/O routines
 
 /*
- * Note: sfs_readblock is used to read the superblock
- * early in mount, before sfs is fully (or even mostly)
- * initialized, and so may not use anything from sfs
- * except sfs_device.
+ * Everything goes through the buffer cache. These two copy a whole
+ * block in or out of it, for callers (superblock, freemap, inodes)
+ * that keep their own copy of the data.
+ *
+ * Note: sfs_readblock is used to replay the journal early in
+ * mount, before sfs is fully (or even mostly) initialized, and so
+ * may not use anything from sfs except sfs_device and sfs_blocksize.
  */
 
 /*
- * Read or write a block, retrying I/O errors.
+ * Read a block, or the first LEN bytes of it.
  */
-static
 int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
+sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
+	struct buf *buf;
 	int result;
-	int tries=0;
-
-	KASSERT(vfs_biglock_do_i_hold());
 
-	DEBUG(DB_SFS, "sfs: %s %llu\n",
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	KASSERT(len <= sfs->sfs_blocksize);
 
- retry:
-	result = DEVOP_IO(sfs->sfs_device, uio);
-	if (result == EINVAL) {
-		/*
-		 * This means the sector we requested was out of range,
-		 * or the seek address we gave wasn't sector-aligned,
-		 * or a couple of other things that are our fault.
-		 */
-		panic("sfs: %s: DEVOP_IO returned EINVAL\n",
-		      sfs->sfs_sb.sb_volname);
-	}
-	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: %s: block %llu I/O error, retrying\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
-		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
-		}
-		else {
-			kprintf("sfs: %s: block %llu I/O error, giving up "
-				"after %d retries\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
-		}
+	result = buffer_read(sfs->sfs_device, block, sfs->sfs_blocksize, &buf);
+	if (result) {
+		return result;
 	}
-	return result;
-}
-
-/*
- * Read a block.
- */
-int
-sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
-{
-	struct iovec iov;
-	struct uio ku;
-
-	KASSERT(len == SFS_BLOCKSIZE);
-
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	memcpy(data, buffer_map(buf), len);
+	buffer_release(buf);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block. If LEN is less than the block size, the rest of the
+ * block is zeroed. This only updates the cache; the disk is written
+ * when the buffer is evicted or synced.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *buf;
+	int result;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len <= sfs->sfs_blocksize);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_get(sfs->sfs_device, block, sfs->sfs_blocksize, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(buf), data, len);
+	bzero((char *)buffer_map(buf) + len, sfs->sfs_blocksize - len);
+	sfs_jdirty(sfs, buf);
+	buffer_release(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -137,9 +107,9 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * need the original contents of the block first, even if we're
+ * writing, so we don't clobber the portion of the block we're not
+ * intending to write over.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -150,30 +120,34 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	void *held;
 	int result;
 
 	/* Allocate missing blocks if and only if we're writing */
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(skipstart + len <= sfs->sfs_blocksize);
 
 	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = SFS_OFFBLOCK(sfs, uio->uio_offset);
+
+	/* Is it (or should it be) held in memory without a disk block? */
+	if (doalloc) {
+		result = sfs_dalloc_getblock(sv, fileblock, &held);
+		if (result) {
+			return result;
+		}
+	}
+	else {
+		held = sfs_dalloc_find(sv, fileblock);
+	}
+	if (held != NULL) {
+		return uiomove((char *)held + skipstart, len, uio);
+	}
 
 	/* Get the disk block number */
 	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
@@ -184,40 +158,36 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * It reads as zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, sfs->sfs_blocksize,
+			     &buf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove((char *)buffer_map(buf) + skipstart, len, uio);
+
+	/*
+	 * If it was a write, the buffer is now dirty. (Even if uiomove
+	 * failed, it may have changed some of it.)
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(buf);
 	}
+	buffer_release(buf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -228,17 +198,29 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	void *held;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = SFS_OFFBLOCK(sfs, uio->uio_offset);
+
+	/* Is it (or should it be) held in memory without a disk block? */
+	if (doalloc) {
+		result = sfs_dalloc_getblock(sv, fileblock, &held);
+		if (result) {
+			return result;
+		}
+	}
+	else {
+		held = sfs_dalloc_find(sv, fileblock);
+	}
+	if (held != NULL) {
+		return uiomove(held, sfs->sfs_blocksize, uio);
+	}
 
 	/* Look up the disk block number */
 	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
@@ -254,35 +236,139 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		 * allocated a block for us.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		return uiomovezeros(sfs->sfs_blocksize, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sfs->sfs_device, diskblock,
+				     sfs->sfs_blocksize, &buf);
+		if (result) {
+			return result;
+		}
+		result = uiomove(buffer_map(buf), sfs->sfs_blocksize, uio);
+		buffer_release(buf);
+		return result;
+	}
 
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * Writing the whole block, so there's no need to read the old
+	 * contents in.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	result = buffer_get(sfs->sfs_device, diskblock, sfs->sfs_blocksize,
+			    &buf);
+	if (result) {
+		return result;
+	}
+	result = uiomove(buffer_map(buf), sfs->sfs_blocksize, uio);
+	if (result && !buffer_is_valid(buf)) {
+		/* Only partly filled in; don't keep it */
+		buffer_release_and_invalidate(buf);
+		return result;
+	}
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return result;
+}
 
-	result = sfs_rwblock(sfs, uio);
+////////////////////////////////////////////////////////////
+// Read-ahead
+
+/*
+ * Read-ahead window limits, in blocks and in bytes. A read that
+ * starts where the last one ended, or at the beginning of the file,
+ * is sequential. The window opens at the minimum on the first
+ * sequential read and doubles each time it's refilled, up to the
+ * maximum (but at least the minimum, with big blocks); any other read
+ * shuts it until the file is being read sequentially again.
+ */
+#define SFS_RA_MINWINDOW	4
+#define SFS_RA_MAXBYTES		(32*1024)
+
+/*
+ * Called at the start of each file read covering LEN bytes at POS.
+ * If the access pattern is sequential, hand the buffer cache the
+ * blocks past the end of this read that it hasn't been asked for yet,
+ * so the disk is fetching them while the caller consumes this read.
+ * Refill only once the caller is into the second half of what we've
+ * asked for, so requests go out in batches rather than a block per
+ * read.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t pos, uint32_t len)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t endblock, fileblocks, fileblock, start, stop, maxwindow;
+	daddr_t diskblock;
+
+	/* First block past this read; number of blocks in the file */
+	endblock = SFS_OFFBLOCKS(sfs, pos + len);
+	fileblocks = SFS_OFFBLOCKS(sfs, sv->sv_i.sfi_size);
+
+	maxwindow = SFS_RA_MAXBYTES >> sfs->sfs_blockshift;
+	if (maxwindow < SFS_RA_MINWINDOW) {
+		maxwindow = SFS_RA_MINWINDOW;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
+	 * Readers share sv_lock, so the pattern state needs its own
+	 * lock. Claim the range to fetch while holding it, so two
+	 * readers don't both ask for the same blocks, and do the
+	 * block mapping after dropping it.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	spinlock_acquire(&sv->sv_ralock);
+	if (pos == 0 && sv->sv_ranextpos != 0) {
+		/* Starting over from the top */
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+	}
+	else if (pos != sv->sv_ranextpos) {
+		/* Random access; don't waste the disk's time */
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+		sv->sv_ranextpos = pos + len;
+		spinlock_release(&sv->sv_ralock);
+		return;
+	}
+	sv->sv_ranextpos = pos + len;
 
-	return result;
+	if (sv->sv_raend < endblock) {
+		sv->sv_raend = endblock;
+	}
+	if (sv->sv_rawindow > 0 &&
+	    sv->sv_raend - endblock >= sv->sv_rawindow / 2) {
+		/* Still far enough ahead */
+		spinlock_release(&sv->sv_ralock);
+		return;
+	}
+
+	/* Open or widen the window */
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RA_MINWINDOW;
+	}
+	else if (sv->sv_rawindow < maxwindow) {
+		sv->sv_rawindow *= 2;
+	}
+
+	start = sv->sv_raend;
+	stop = endblock + sv->sv_rawindow;
+	if (stop > fileblocks) {
+		stop = fileblocks;
+	}
+	if (stop > start) {
+		sv->sv_raend = stop;
+	}
+	spinlock_release(&sv->sv_ralock);
+
+	for (fileblock = start; fileblock < stop; fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_readahead(sfs->sfs_device, diskblock,
+					 sfs->sfs_blocksize);
+		}
+	}
 }
 
 /*
@@ -291,10 +377,15 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	uint32_t blkoff;
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	uint32_t fileblock, n;
+
+	KASSERT(uio->uio_rw == UIO_READ ||
+		rwlock_do_i_hold_write(sv->sv_lock));
 
 	origresid = uio->uio_resid;
 
@@ -317,18 +408,21 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		/* Get the disk started on what's likely to come next */
+		sfs_readahead(sv, uio->uio_offset, uio->uio_resid);
 	}
 
 	/*
 	 * First, do any leading partial block.
 	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
+	blkoff = SFS_OFFINBLOCK(sfs, uio->uio_offset);
 	if (blkoff != 0) {
 		/* Number of bytes at beginning of block to skip */
 		uint32_t skip = blkoff;
 
 		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+		uint32_t len = sfs->sfs_blocksize - blkoff;
 
 		/* ...which might be less than the rest of the block */
 		if (len > uio->uio_resid) {
@@ -350,8 +444,20 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now we should be block-aligned. Do the remaining whole blocks.
 	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	KASSERT(SFS_OFFINBLOCK(sfs, uio->uio_offset) == 0);
+	nblocks = uio->uio_resid >> sfs->sfs_blockshift;
+	fileblock = SFS_OFFBLOCK(sfs, uio->uio_offset);
+	if (uio->uio_rw == UIO_WRITE && nblocks > 1 &&
+	    fileblock < sfs_dalloc_limit(sv)) {
+		/*
+		 * Get space for all of them together, contiguous if we
+		 * can. (Past the limit, they'll be held in memory and
+		 * given disk blocks later.)
+		 */
+		n = sfs_dalloc_limit(sv) - fileblock;
+		sfs_bmap_allocrange(sv, fileblock,
+				    n < nblocks ? n : nblocks);
+	}
 	for (i=0; i<nblocks; i++) {
 		result = sfs_blockio(sv, uio);
 		if (result) {
@@ -362,7 +468,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now do any remaining partial block at the end.
 	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid < sfs->sfs_blocksize);
 
 	if (uio->uio_resid > 0) {
 		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
@@ -381,6 +487,14 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	/*
+	 * If the write stopped partway, don't leave blocks we got for
+	 * the rest of it past EOF, on disk or in memory.
+	 */
+	if (result && uio->uio_rw == UIO_WRITE) {
+		(void)sfs_itrunc(sv, sv->sv_i.sfi_size);
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -412,23 +526,13 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	uint32_t blockoffset;
 	daddr_t diskblock;
 	bool doalloc;
+	struct buf *buf;
+	char *ioptr;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Figure out which block of the vnode (directory, whatever) this is */
-	vnblock = actualpos / SFS_BLOCKSIZE;
-	blockoffset = actualpos % SFS_BLOCKSIZE;
+	vnblock = SFS_OFFBLOCK(sfs, actualpos);
+	blockoffset = SFS_OFFINBLOCK(sfs, actualpos);
 
 	/* Get the disk block number */
 	doalloc = (rw == UIO_WRITE);
@@ -446,26 +550,24 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = buffer_read(sfs->sfs_device, diskblock, sfs->sfs_blocksize,
+			     &buf);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ioptr + blockoffset, len);
+		buffer_release(buf);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy(ioptr + blockoffset, data, len);
+		sfs_jdirty(sfs, buf);
+		buffer_release(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
@@ -0,0 +1,684 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * Without a journal, a crash can leave some of an operation's
+ * metadata blocks written and others not, and only a full sfsck run
+ * can sort that out. With one, changed metadata blocks are collected
+ * into a transaction and written to the journal (see kern/sfs.h for
+ * the format) before any of them goes to its home location, so after
+ * a crash each transaction either happened entirely or not at all,
+ * and getting back to a consistent state only means replaying the
+ * journal at mount time, which takes time proportional to the size
+ * of the journal rather than of the disk.
+ *
+ * A transaction covers all the operations since the last one, so
+ * blocks that are changed over and over (the freemap, a busy
+ * directory, the inode of a file being appended to) are written
+ * once per commit rather than once per change. Commits happen when
+ * the volume is synced, which the syncer does every few seconds, and
+ * on fsync. Operations hold sfs_jlock shared and committing holds it
+ * exclusive, so a transaction only ever contains whole operations.
+ * (sfs_reclaim doesn't take sfs_jlock, as it can be called from
+ * inside an operation; it holds sfs_vnlock throughout instead, and
+ * so does the commit once the vnodes are synced.)
+ *
+ * The buffers of blocks in the running transaction are dirty, but
+ * their writeback is held back (buffer_hold_writeback), so the
+ * buffer cache keeps them in memory and off the disk until the
+ * transaction commits.
+ *
+ * Blocks freed in the running transaction can't be reused until it
+ * commits: if one were, and its new contents reached the disk, a
+ * crash would leave the old metadata pointing at them. So
+ * sfs_bfree sets freed blocks aside in sfs_jfreed, and they're
+ * actually freed when the transaction is prepared for commit.
+ *
+ * Data isn't journaled, but it is all written before the commit
+ * block, so after a crash metadata never points at blocks whose
+ * data didn't make it to the disk.
+ *
+ * A committed transaction stays in the journal until its blocks are
+ * all written home (checkpointed). If that fails, the journal isn't
+ * reused, since it's the only copy of those blocks on disk: the next
+ * sync tries the home writes again first, and until they work,
+ * operations fail rather than start a new transaction.
+ *
+ * If a transaction grows past what the journal can hold, which an
+ * operation starting once it's half full makes unlikely, the rest
+ * of it isn't held back and it's written without using the journal,
+ * with no more protection than a volume without one.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * Most the running transaction may hold in memory, in bytes. Its
+ * blocks can't leave the buffer cache until it commits, so this
+ * leaves half the cache for everything else.
+ */
+#define SFS_JMAXBYTES	(BUFFER_MAXBYTES / 2)
+
+/*
+ * Fold a block into a journal checksum.
+ */
+static
+uint32_t
+sfs_jchecksum(uint32_t sum, const void *data, size_t len)
+{
+	const uint32_t *words = data;
+	unsigned i;
+
+	for (i=0; i<len / sizeof(uint32_t); i++) {
+		sum = ((sum << 1) | (sum >> 31)) ^ words[i];
+	}
+	return sum;
+}
+
+////////////////////////////////////////////////////////////
+// Replay
+
+/*
+ * Check that the journal is somewhere sensible.
+ */
+static
+int
+sfs_jcheckplace(struct sfs_fs *sfs)
+{
+	uint32_t start, len, metablocks;
+
+	start = sfs->sfs_sb.sb_journalstart;
+	len = sfs->sfs_sb.sb_journalblocks;
+	metablocks = SFS_FREEMAP_START +
+		SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks, sfs->sfs_blocksize);
+
+	/* Room for a descriptor, a block, and a commit block */
+	if (len < 3 || start < metablocks || start + len < start ||
+	    start + len > sfs->sfs_sb.sb_nblocks) {
+		kprintf("sfs: %s: Journal at blocks %u-%u is not valid\n",
+			sfs->sfs_sb.sb_volname, start, start + len - 1);
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Go through the transaction in the journal. If REPLAY is false,
+ * just check it, and hand back through TOTAL how many blocks it has,
+ * or 0 if it isn't complete. If REPLAY is true (after checking),
+ * copy its blocks home.
+ *
+ * DESC and DATA are block-sized buffers to work in.
+ */
+static
+int
+sfs_jscan(struct sfs_fs *sfs, bool replay, struct sfs_jdesc *desc,
+	  void *data, uint32_t *total)
+{
+	const struct sfs_jcommit *jc;
+	uint32_t seq, jblock, jend, count, sum, i;
+	daddr_t home;
+	int result;
+
+	seq = sfs->sfs_sb.sb_journalseq;
+	jblock = sfs->sfs_sb.sb_journalstart;
+	jend = jblock + sfs->sfs_sb.sb_journalblocks;
+	count = 0;
+	sum = 0;
+	*total = 0;
+
+	while (jblock < jend) {
+		result = sfs_readblock(sfs, jblock++, desc,
+				       sfs->sfs_blocksize);
+		if (result) {
+			return result;
+		}
+		if (desc->jd_seq != seq) {
+			return 0;
+		}
+		if (desc->jd_magic == SFS_JCOMMIT_MAGIC) {
+			jc = (const struct sfs_jcommit *)desc;
+			if (count > 0 && jc->jc_nblocks == count &&
+			    jc->jc_checksum == sum) {
+				*total = count;
+			}
+			return 0;
+		}
+		if (desc->jd_magic != SFS_JDESC_MAGIC ||
+		    desc->jd_nblocks == 0 ||
+		    desc->jd_nblocks > SFS_JDESCENTRIES(sfs->sfs_blocksize) ||
+		    desc->jd_nblocks > jend - jblock) {
+			return 0;
+		}
+
+		for (i=0; i<desc->jd_nblocks; i++) {
+			home = desc->jd_blocks[i];
+			if (home >= sfs->sfs_sb.sb_nblocks ||
+			    (home >= sfs->sfs_sb.sb_journalstart &&
+			     home < jend)) {
+				return 0;
+			}
+			result = sfs_readblock(sfs, jblock++, data,
+					       sfs->sfs_blocksize);
+			if (result) {
+				return result;
+			}
+			if (replay) {
+				result = sfs_writeblock(sfs, home, data,
+							sfs->sfs_blocksize);
+				if (result) {
+					return result;
+				}
+			}
+			else {
+				sum = sfs_jchecksum(sum, data,
+						    sfs->sfs_blocksize);
+			}
+			count++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Replay the journal, if there's a complete transaction in it. Called
+ * from sfs_domount after the superblock is read and before anything
+ * else is; if anything is replayed, the superblock is read again.
+ */
+int
+sfs_jreplay(struct sfs_fs *sfs)
+{
+	struct sfs_jdesc *desc;
+	void *data;
+	uint32_t total;
+	int result, result2;
+
+	if (sfs->sfs_sb.sb_journalblocks == 0) {
+		return 0;
+	}
+	result = sfs_jcheckplace(sfs);
+	if (result) {
+		return result;
+	}
+
+	desc = kmalloc(sfs->sfs_blocksize);
+	data = kmalloc(sfs->sfs_blocksize);
+	if (desc == NULL || data == NULL) {
+		kfree(desc);
+		kfree(data);
+		return ENOMEM;
+	}
+
+	result = sfs_jscan(sfs, false, desc, data, &total);
+	if (result == 0 && total > 0) {
+		result = sfs_jscan(sfs, true, desc, data, &total);
+
+		/* Even if that failed, don't leave anything dirty */
+		result2 = buffer_sync(sfs->sfs_device);
+		if (result == 0) {
+			result = result2;
+		}
+		if (result == 0) {
+			kprintf("sfs: %s: Replayed %u blocks from journal\n",
+				sfs->sfs_sb.sb_volname, total);
+			result = sfs_readblock(sfs, SFS_SUPER_BLOCK,
+					       &sfs->sfs_sb,
+					       sizeof(sfs->sfs_sb));
+			sfs->sfs_sb.sb_volname[SFS_VOLNAME_SIZE-1] = 0;
+		}
+	}
+
+	kfree(desc);
+	kfree(data);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Setup
+
+/*
+ * Set up for journaling, after sfs_jreplay and after the freemap
+ * is loaded. Does nothing if the volume has no journal.
+ */
+int
+sfs_jstart(struct sfs_fs *sfs)
+{
+	uint32_t len, per;
+	unsigned max;
+
+	len = sfs->sfs_sb.sb_journalblocks;
+	if (len == 0) {
+		return 0;
+	}
+
+	/* Each block takes a slot, plus descriptors and a commit block */
+	per = SFS_JDESCENTRIES(sfs->sfs_blocksize);
+	max = len - 2;
+	while (max + DIVROUNDUP(max, per) + 1 > len) {
+		max--;
+	}
+
+	/*
+	 * The buffer cache can't evict held-back blocks, so with big
+	 * blocks don't let a transaction take up too much of it.
+	 */
+	if (max > SFS_JMAXBYTES / sfs->sfs_blocksize) {
+		max = SFS_JMAXBYTES / sfs->sfs_blocksize;
+	}
+
+	sfs->sfs_jtx = kmalloc(max * sizeof(daddr_t));
+	if (sfs->sfs_jtx == NULL) {
+		return ENOMEM;
+	}
+	sfs->sfs_jfreed = bitmap_create(SFS_FREEMAPBITS(sfs->sfs_sb.sb_nblocks,
+							sfs->sfs_blocksize));
+	if (sfs->sfs_jfreed == NULL) {
+		kfree(sfs->sfs_jtx);
+		sfs->sfs_jtx = NULL;
+		return ENOMEM;
+	}
+
+	/*
+	 * Our superblock is the one the first transaction will write,
+	 * which retires that transaction.
+	 */
+	sfs->sfs_jseq = sfs->sfs_sb.sb_journalseq;
+	sfs->sfs_sb.sb_journalseq = sfs->sfs_jseq + 1;
+	sfs->sfs_jmax = max;
+	return 0;
+}
+
+/*
+ * Release what sfs_jstart set up.
+ */
+void
+sfs_jcleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_jtxcount == 0);
+	KASSERT(sfs->sfs_njfreed == 0);
+
+	if (sfs->sfs_jfreed != NULL) {
+		bitmap_destroy(sfs->sfs_jfreed);
+		sfs->sfs_jfreed = NULL;
+	}
+	kfree(sfs->sfs_jtx);
+	sfs->sfs_jtx = NULL;
+	sfs->sfs_jmax = 0;
+}
+
+////////////////////////////////////////////////////////////
+// Operations
+
+/*
+ * Start an operation that changes the volume. If the running
+ * transaction is getting big, or if enough blocks are waiting for it
+ * to commit before they're free that allocations might fail, commit
+ * it first.
+ */
+int
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (sfs->sfs_jmax == 0) {
+		return 0;
+	}
+
+	/* Unlocked peeks; this is only a heuristic */
+	result = 0;
+	if (sfs->sfs_jckpt || sfs->sfs_jtxcount >= sfs->sfs_jmax / 2 ||
+	    sfs->sfs_njfreed > sfs->sfs_nfree - sfs->sfs_nreserved) {
+		/* If this fails, the next sync will try again */
+		result = FSOP_SYNC(&sfs->sfs_absfs);
+	}
+
+	rwlock_acquire_read(sfs->sfs_jlock);
+	if (sfs->sfs_jckpt) {
+		/* The last transaction still isn't home; can't start more */
+		rwlock_release_read(sfs->sfs_jlock);
+		return result ? result : EIO;
+	}
+	return 0;
+}
+
+/*
+ * Finish an operation.
+ */
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	if (sfs->sfs_jmax == 0) {
+		return;
+	}
+	rwlock_release_read(sfs->sfs_jlock);
+}
+
+/*
+ * Mark a held buffer containing metadata dirty, and add its block to
+ * the running transaction.
+ */
+void
+sfs_jdirty(struct sfs_fs *sfs, struct buf *buf)
+{
+	buffer_mark_dirty(buf);
+
+	if (sfs->sfs_jmax == 0) {
+		return;
+	}
+
+	spinlock_acquire(&sfs->sfs_jtxlock);
+	/*
+	 * While the last transaction is waiting to go home, only
+	 * sfs_reclaim can get here; there's no transaction for its
+	 * changes, so they go to disk like any other dirty block.
+	 */
+	if (!sfs->sfs_joverflow && !sfs->sfs_jckpt &&
+	    buffer_hold_writeback(buf)) {
+		if (sfs->sfs_jtxcount < sfs->sfs_jmax) {
+			sfs->sfs_jtx[sfs->sfs_jtxcount++] =
+				buffer_blocknum(buf);
+		}
+		else {
+			buffer_allow_writeback(buf);
+			sfs->sfs_joverflow = true;
+		}
+	}
+	spinlock_release(&sfs->sfs_jtxlock);
+}
+
+////////////////////////////////////////////////////////////
+// Commit
+
+/*
+ * Get ready to commit: finish freeing the blocks the transaction
+ * freed, and if there's anything to commit, make sure the superblock
+ * is part of it. Called from sfs_sync before the freemap and the
+ * superblock are written, with sfs_jlock held exclusive and
+ * sfs_vnlock held.
+ */
+void
+sfs_jprepare(struct sfs_fs *sfs)
+{
+	unsigned i, j;
+	uint32_t mapblock, block, end;
+
+	KASSERT(rwlock_do_i_hold_write(sfs->sfs_jlock));
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	if (sfs->sfs_njfreed > 0) {
+		/* Freed blocks' buffers are gone; they don't get copied */
+		spinlock_acquire(&sfs->sfs_jtxlock);
+		for (i=j=0; i<sfs->sfs_jtxcount; i++) {
+			if (!bitmap_isset(sfs->sfs_jfreed, sfs->sfs_jtx[i])) {
+				sfs->sfs_jtx[j++] = sfs->sfs_jtx[i];
+			}
+		}
+		sfs->sfs_jtxcount = j;
+		spinlock_release(&sfs->sfs_jtxlock);
+
+		/*
+		 * sfs_bfree marked the freemap blocks covering them
+		 * dirty, so only those need looking at.
+		 */
+		for (mapblock=0; sfs->sfs_njfreed > 0; mapblock++) {
+			KASSERT(mapblock <
+				SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks,
+						  sfs->sfs_blocksize));
+			if (!bitmap_isset(sfs->sfs_freemapdirtymap, mapblock)) {
+				continue;
+			}
+			block = mapblock * SFS_BITSPERBLOCK(sfs->sfs_blocksize);
+			end = block + SFS_BITSPERBLOCK(sfs->sfs_blocksize);
+			if (end > sfs->sfs_sb.sb_nblocks) {
+				end = sfs->sfs_sb.sb_nblocks;
+			}
+			for (; block < end; block++) {
+				if (bitmap_isset(sfs->sfs_jfreed, block)) {
+					bitmap_unmark(sfs->sfs_jfreed, block);
+					bitmap_unmark(sfs->sfs_freemap, block);
+					sfs->sfs_njfreed--;
+					sfs->sfs_nfree++;
+				}
+			}
+		}
+	}
+
+	if (sfs->sfs_jtxcount > 0 || sfs->sfs_freemapdirty) {
+		sfs->sfs_superdirty = true;
+	}
+
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Copy block HOME, which is in the transaction, to journal block
+ * JBLOCK.
+ */
+static
+int
+sfs_jcopy(struct sfs_fs *sfs, daddr_t home, daddr_t jblock, uint32_t *sum)
+{
+	struct buf *hbuf, *jbuf;
+	int result;
+
+	result = buffer_read(sfs->sfs_device, home, sfs->sfs_blocksize,
+			     &hbuf);
+	if (result) {
+		return result;
+	}
+	result = buffer_get(sfs->sfs_device, jblock, sfs->sfs_blocksize, &jbuf);
+	if (result) {
+		buffer_release(hbuf);
+		return result;
+	}
+	memcpy(buffer_map(jbuf), buffer_map(hbuf), sfs->sfs_blocksize);
+	*sum = sfs_jchecksum(*sum, buffer_map(jbuf), sfs->sfs_blocksize);
+	buffer_mark_dirty(jbuf);
+	buffer_release(jbuf);
+	buffer_release(hbuf);
+	return 0;
+}
+
+/*
+ * Write the running transaction to the journal and commit it.
+ */
+static
+int
+sfs_jwrite(struct sfs_fs *sfs)
+{
+	struct buf *buf;
+	struct sfs_jdesc *jd;
+	struct sfs_jcommit *jc;
+	daddr_t jblock;
+	uint32_t sum;
+	unsigned i, j, n;
+	int result;
+
+	jblock = sfs->sfs_sb.sb_journalstart;
+	sum = 0;
+
+	for (i=0; i<sfs->sfs_jtxcount; i += n) {
+		n = sfs->sfs_jtxcount - i;
+		if (n > SFS_JDESCENTRIES(sfs->sfs_blocksize)) {
+			n = SFS_JDESCENTRIES(sfs->sfs_blocksize);
+		}
+
+		result = buffer_get(sfs->sfs_device, jblock++,
+				    sfs->sfs_blocksize, &buf);
+		if (result) {
+			return result;
+		}
+		jd = buffer_map(buf);
+		bzero(jd, sfs->sfs_blocksize);
+		jd->jd_magic = SFS_JDESC_MAGIC;
+		jd->jd_seq = sfs->sfs_jseq;
+		jd->jd_nblocks = n;
+		for (j=0; j<n; j++) {
+			jd->jd_blocks[j] = sfs->sfs_jtx[i + j];
+		}
+		buffer_mark_dirty(buf);
+		buffer_release(buf);
+
+		for (j=0; j<n; j++) {
+			result = sfs_jcopy(sfs, sfs->sfs_jtx[i + j], jblock++,
+					   &sum);
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	/*
+	 * Everything but the commit block goes out first. Since the
+	 * journaled blocks are held back, this writes the journal and
+	 * whatever file data is dirty.
+	 */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	result = buffer_get(sfs->sfs_device, jblock, sfs->sfs_blocksize, &buf);
+	if (result) {
+		return result;
+	}
+	jc = buffer_map(buf);
+	bzero(jc, sfs->sfs_blocksize);
+	jc->jc_magic = SFS_JCOMMIT_MAGIC;
+	jc->jc_seq = sfs->sfs_jseq;
+	jc->jc_nblocks = sfs->sfs_jtxcount;
+	jc->jc_checksum = sum;
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+
+	return buffer_syncblocks(sfs->sfs_device, &jblock, 1,
+				 sfs->sfs_blocksize);
+}
+
+/*
+ * Write the blocks of the committed transaction home, and once
+ * they're all there, start the next transaction. Called by
+ * sfs_jcommit, and at the start of sfs_sync (with sfs_jlock held
+ * exclusive) in case it failed before.
+ *
+ * If a home write fails, the transaction is left as it is, so the
+ * journal still covers its blocks if we crash.
+ */
+int
+sfs_jcheckpoint(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sfs->sfs_jlock));
+
+	if (!sfs->sfs_jckpt) {
+		return 0;
+	}
+
+	/* Nobody can add to the list while we're here, so use it as is */
+	result = buffer_syncblocks(sfs->sfs_device, sfs->sfs_jtx,
+				   sfs->sfs_jtxcount, sfs->sfs_blocksize);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&sfs->sfs_jtxlock);
+	sfs->sfs_jtxcount = 0;
+	sfs->sfs_joverflow = false;
+	sfs->sfs_jckpt = false;
+	spinlock_release(&sfs->sfs_jtxlock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs->sfs_jseq++;
+	sfs->sfs_sb.sb_journalseq = sfs->sfs_jseq + 1;
+	lock_release(sfs->sfs_freemaplock);
+
+	return 0;
+}
+
+/*
+ * Commit the running transaction and write its blocks home. Called
+ * from sfs_sync after sfs_jprepare and after the freemap and the
+ * superblock are written, with the same locks held.
+ *
+ * If writing the journal fails, the transaction stays as it is, to
+ * be tried again at the next sync. Once it's committed, the next one
+ * starts only after its blocks are home (see sfs_jcheckpoint).
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	struct buf *buf;
+	unsigned i, n;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sfs->sfs_jlock));
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(!sfs->sfs_jckpt);
+
+	n = sfs->sfs_jtxcount;
+	if (n == 0 && !sfs->sfs_joverflow) {
+		return 0;
+	}
+
+	if (!sfs->sfs_joverflow) {
+		result = sfs_jwrite(sfs);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* Let the blocks go home */
+	for (i=0; i<n; i++) {
+		/* Held back, so in memory, so this can't fail */
+		result = buffer_read(sfs->sfs_device, sfs->sfs_jtx[i],
+				     sfs->sfs_blocksize, &buf);
+		KASSERT(result == 0);
+		buffer_allow_writeback(buf);
+		buffer_release(buf);
+	}
+
+	spinlock_acquire(&sfs->sfs_jtxlock);
+	sfs->sfs_jckpt = true;
+	spinlock_release(&sfs->sfs_jtxlock);
+
+	return sfs_jcheckpoint(sfs);
+}
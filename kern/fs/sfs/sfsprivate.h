@@ -32,25 +32,70 @@
 
 #include <uio.h> /* for uio_rw */
 
+struct buf; /* in <buf.h> */
+
+
+/*
+ * Size of the vnode hash table, and how many vnodes nobody is using
+ * to keep in memory per volume (see sfs_inode.c).
+ */
+#define SFS_VNHASHSIZE		127
+#define SFS_VNMAXUNUSED		128
+
+/*
+ * A directory that fills up past this many entries is turned into a
+ * hash table, and a hash table is grown rather than put a new entry
+ * more than this many buckets past its home bucket (see sfs_dir.c).
+ */
+#define SFS_DIR_FLATMAX		32
+#define SFS_DIR_MAXPROBE	2
+
+/*
+ * Block arithmetic on file offsets. These are 64 bits wide and the
+ * block size is only known at mount time, so shift and mask rather
+ * than divide.
+ */
+#define SFS_OFFBLOCK(sfs, pos)	((uint32_t)((pos) >> (sfs)->sfs_blockshift))
+#define SFS_OFFINBLOCK(sfs, pos) \
+	((uint32_t)((pos) & ((sfs)->sfs_blocksize - 1)))
+#define SFS_OFFBLOCKS(sfs, len) \
+	SFS_OFFBLOCK(sfs, (len) + (sfs)->sfs_blocksize - 1)
+
 
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
-/* Macro for initializing a uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
-
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_ballocrun(struct sfs_fs *sfs, daddr_t goal, uint32_t maxblocks,
+		daddr_t *diskblock, uint32_t *nblocks);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock);
+int sfs_vballocrun(struct sfs_vnode *sv, daddr_t goal, uint32_t maxblocks,
+		daddr_t *diskblock, uint32_t *nblocks);
+int sfs_vballoc(struct sfs_vnode *sv, daddr_t goal, daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
+int sfs_breserve(struct sfs_fs *sfs, uint32_t nblocks);
+void sfs_bunreserve(struct sfs_fs *sfs, uint32_t nblocks);
+void sfs_bcount(struct sfs_fs *sfs);
+void sfs_bdirty(struct sfs_fs *sfs, daddr_t diskblock, uint32_t nblocks);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
+void sfs_bmap_allocrange(struct sfs_vnode *sv, uint32_t fileblock,
+		uint32_t nblocks);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+int sfs_syncfile(struct sfs_vnode *sv);
+
+/* Functions in sfs_dalloc.c */
+void *sfs_dalloc_find(struct sfs_vnode *sv, uint32_t fileblock);
+int sfs_dalloc_getblock(struct sfs_vnode *sv, uint32_t fileblock,
+		void **ret);
+uint32_t sfs_dalloc_limit(struct sfs_vnode *sv);
+int sfs_dalloc_flush(struct sfs_vnode *sv);
+void sfs_dalloc_trunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
 int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
@@ -62,13 +107,37 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_extent.c */
+int sfs_extent_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		daddr_t *diskblock);
+void sfs_extent_allocrange(struct sfs_vnode *sv, uint32_t fileblock,
+		uint32_t nblocks);
+int sfs_extent_itrunc(struct sfs_vnode *sv, off_t len);
+int sfs_extent_syncfile(struct sfs_vnode *sv);
+
+/* Functions in sfs_journal.c */
+int sfs_jreplay(struct sfs_fs *sfs);
+int sfs_jstart(struct sfs_fs *sfs);
+void sfs_jcleanup(struct sfs_fs *sfs);
+int sfs_jbegin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+void sfs_jdirty(struct sfs_fs *sfs, struct buf *buf);
+void sfs_jprepare(struct sfs_fs *sfs);
+int sfs_jcommit(struct sfs_fs *sfs);
+int sfs_jcheckpoint(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
+extern struct kcache *sfs_vnode_cache;
+int sfs_vnode_ctor(void *obj);
+void sfs_vnode_dtor(void *obj);
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
-int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
+int sfs_makeobj(struct sfs_fs *sfs, int type, daddr_t goal,
+		struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
+void sfs_vnode_purge(struct sfs_fs *sfs);
 
 /* Functions in sfs_io.c */
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
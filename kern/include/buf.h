@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * The buffer cache sits between file systems and block devices. It
+ * holds recently used device blocks in memory, keyed by (device,
+ * block number), so repeated access doesn't go to the disk, and it
+ * delays writes: a modified buffer is only marked dirty, and gets
+ * written out when it is evicted or when the device is synced.
+ * Replacement is LRU.
+ *
+ * A buffer obtained from buffer_read or buffer_get is held
+ * exclusively by the calling thread until it is released; anyone
+ * else asking for the same block waits. Held buffers are never
+ * evicted. A buffer can also be pinned, which keeps it in memory
+ * across releases until it is unpinned; file systems use this for
+ * metadata they rewrite often. Finally, writeback of a buffer can be
+ * held back, which keeps it in memory and keeps its dirty contents
+ * off the disk until they are allowed out again; file systems that
+ * journal use this so blocks don't reach their home locations before
+ * the journal entry that covers them.
+ *
+ * Block numbers are in units of SIZE, which must be the same for all
+ * requests on a given device; the byte offset on the device is
+ * BLOCK*SIZE.
+ *
+ *    buffer_read    - Get the buffer for BLOCK, reading it from the
+ *                     device if it isn't already in memory.
+ *    buffer_get     - Get the buffer for BLOCK without reading it.
+ *                     If the result isn't valid (buffer_is_valid) the
+ *                     caller must fill in the whole block and then
+ *                     mark it valid or dirty before releasing it.
+ *    buffer_map     - Return a pointer to the buffer's data.
+ *    buffer_blocknum - Return the block number the buffer holds.
+ *    buffer_is_valid - Check if the buffer's data is good.
+ *    buffer_mark_valid - Mark the buffer's data as good.
+ *    buffer_mark_dirty - Mark the buffer as needing to be written back.
+ *                     Implies valid.
+ *    buffer_release - Give up a buffer obtained from buffer_read or
+ *                     buffer_get.
+ *    buffer_release_and_invalidate - Same, but also discard the
+ *                     contents (without writing them back).
+ *    buffer_pin     - Keep a held buffer in memory after it's released.
+ *                     Pins nest.
+ *    buffer_unpin   - Undo buffer_pin.
+ *    buffer_hold_writeback - Don't write a held buffer back, or evict
+ *                     it, until buffer_allow_writeback. Returns true
+ *                     if writeback wasn't already held back. Dropping
+ *                     the block (buffer_drop) cancels this.
+ *    buffer_allow_writeback - Undo buffer_hold_writeback.
+ *    buffer_readahead - Start reading BLOCK into the cache in the
+ *                     background. Advisory; may be ignored.
+ *    buffer_drop    - Discard the cached copy of BLOCK, if any, without
+ *                     writing it back. Used when the block is freed.
+ *    buffer_sync    - Write back all dirty buffers for DEV, in block
+ *                     order, except ones whose writeback is held back.
+ *    buffer_syncblocks - Write back those of the listed blocks on DEV
+ *                     that are dirty, in block order, except ones
+ *                     whose writeback is held back. Sorts the list.
+ *    buffer_drop_device - Discard all buffers for DEV, which must have
+ *                     no dirty, held, or pinned buffers. Used at
+ *                     unmount.
+ *    buffer_bootstrap - Initialize.
+ *    buffer_syncer_bootstrap - Start the syncer thread, which flushes
+ *                     dirty data periodically and when too much of
+ *                     the cache is dirty.
+ */
+
+/*
+ * Most memory the cache uses for buffers. It only goes over this if
+ * everything is held, pinned, or held back, so callers that hold
+ * back writeback should keep what they hold well below it.
+ */
+#define BUFFER_MAXBYTES		(128*1024)
+
+struct device; /* in <device.h> */
+struct buf;    /* Opaque */
+
+int buffer_read(struct device *dev, daddr_t block, size_t size,
+		struct buf **ret);
+int buffer_get(struct device *dev, daddr_t block, size_t size,
+	       struct buf **ret);
+void *buffer_map(struct buf *b);
+daddr_t buffer_blocknum(struct buf *b);
+bool buffer_is_valid(struct buf *b);
+void buffer_mark_valid(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_release(struct buf *b);
+void buffer_release_and_invalidate(struct buf *b);
+void buffer_pin(struct buf *b);
+void buffer_unpin(struct buf *b);
+bool buffer_hold_writeback(struct buf *b);
+void buffer_allow_writeback(struct buf *b);
+void buffer_readahead(struct device *dev, daddr_t block, size_t size);
+void buffer_drop(struct device *dev, daddr_t block, size_t size);
+int buffer_sync(struct device *dev);
+int buffer_syncblocks(struct device *dev, daddr_t *blocks, unsigned nblocks,
+		      size_t size);
+void buffer_drop_device(struct device *dev);
+void buffer_bootstrap(void);
+void buffer_syncer_bootstrap(void);
+
+
+#endif /* _BUF_H_ */
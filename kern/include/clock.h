@@ -35,6 +35,7 @@
  */
 
 #include <kern/time.h>
+#include <spinlock.h>
 
 
 /*
@@ -73,11 +74,86 @@ void timespec_sub(const struct timespec *t1,
 		  const struct timespec *t2,
 		  struct timespec *ret);
 
+/*
+ * Convert a time interval to a number of hardclocks, rounding up.
+ * Intervals too long to represent are clamped.
+ */
+unsigned timespec_to_ticks(const struct timespec *ts);
+
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ *
+ * clocksleep_timespec() is the same but with nanosecond resolution;
+ * it sleeps for at least the requested interval, as measured by
+ * gettime().
  */
 void clocksleep(int seconds);
+void clocksleep_timespec(const struct timespec *interval);
+
+
+/*
+ * Timeouts.
+ *
+ * A timeout arranges for a function to be called from hardclock()
+ * after a given number of hardclocks have passed. The function runs
+ * in interrupt context on the cpu where the timeout was added, so it
+ * may not sleep; it may take spinlocks.
+ *
+ * Pending timeouts live in a per-cpu hierarchical timer wheel: the
+ * first level has one slot per hardclock and each further level has
+ * slots TW_SLOTS times as wide. Timeouts in the upper levels are
+ * cascaded down as their time approaches, so both adding and
+ * expiring a timeout are constant-time and each hardclock only looks
+ * at one slot.
+ *
+ * timeout_init	Initialize a timeout to call FUNC(DATA).
+ * timeout_add	Schedule a timeout TICKS hardclocks from now. It must not
+ *		already be pending.
+ * timeout_del	Cancel a timeout. Returns true if it was pending and is
+ *		now cancelled, false if it had already fired (or was never
+ *		added). If the function is running on another cpu, waits
+ *		for it to finish; therefore must not be called from the
+ *		timeout's own function. After timeout_del returns, the
+ *		timeout may be freed.
+ *
+ * A timeout function may add its own timeout again (for the next
+ * hardclock at the earliest), but must not free it.
+ */
+
+#define TW_LEVELS	4
+#define TW_SLOTBITS	6
+#define TW_SLOTS	(1U << TW_SLOTBITS)
+#define TW_SLOTMASK	(TW_SLOTS - 1)
+/* Longest representable timeout; longer ones are rescheduled as needed */
+#define TW_MAXTICKS	((1U << (TW_LEVELS * TW_SLOTBITS)) - 1)
+
+struct timerwheel;
+
+struct timeout {
+	struct timeout *to_next;	/* next in wheel slot */
+	struct timeout **to_prevp;	/* pointer to us; NULL if not pending */
+	struct timerwheel *to_wheel;	/* wheel we are pending/running on */
+	uint32_t to_expires;		/* tick at which we fire */
+	void (*to_func)(void *);	/* function to call */
+	void *to_data;			/* argument for to_func */
+};
+
+struct timerwheel {
+	struct spinlock tw_lock;	/* protects everything here */
+	uint32_t tw_ticks;		/* next tick to process */
+	struct timeout *volatile tw_running; /* timeout being run */
+	struct timeout *tw_due;		/* due this tick, not yet run */
+	struct timeout *tw_slots[TW_LEVELS][TW_SLOTS];
+};
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *data);
+void timeout_add(struct timeout *to, unsigned ticks);
+bool timeout_del(struct timeout *to);
+
+/* Per-cpu setup and the hook called from hardclock. */
+void timerwheel_init(struct timerwheel *tw);
+void timerwheel_tick(struct timerwheel *tw);
 
 
 #endif /* _CLOCK_H_ */
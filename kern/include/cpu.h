@@ -33,6 +33,8 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <clock.h>
+#include <synch.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
@@ -62,6 +64,18 @@ struct cpu {
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
+	/*
+	 * Timeouts scheduled on this cpu. Advanced only by this cpu's
+	 * hardclock, but other cpus may lock it to cancel timeouts.
+	 */
+	struct timerwheel c_timerwheel;
+
+	/*
+	 * Lock contention counters for locks acquired on this cpu;
+	 * see lock_acquire.
+	 */
+	struct lockstats c_lockstats;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
@@ -112,6 +126,14 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Look up cpus: cpu_count returns the number of cpus; cpu_get returns
+ * cpu number N (0 <= N < cpu_count()). Cpus are never destroyed, so
+ * the result can be held onto.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned n);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+/*
+ * Directory name cache.
+ *
+ * Maps (directory vnode, name) to the vnode the name refers to, or
+ * records that the name doesn't exist (a negative entry), so repeated
+ * lookups don't have to search the directory. Entries hold references
+ * to both vnodes. Names longer than DCACHE_NAMELEN-1 aren't cached.
+ *
+ * A file system that uses the cache calls dcache_lookup before
+ * searching a directory, dcache_enter with the result of the search,
+ * and dcache_invalidate for every name it adds, removes, or renames.
+ * The locking rule: dcache_lookup needs no file system locks;
+ * dcache_enter must be called with the directory locked shared (so
+ * the result can't go stale before it's entered); dcache_invalidate
+ * must be called with the directory locked exclusive.
+ *
+ *    dcache_lookup  - Look up NAME in DIR. Returns true on a hit,
+ *                     with *RET set to a new reference to the vnode,
+ *                     or to NULL if the name is known not to exist.
+ *    dcache_enter   - Record that NAME in DIR refers to VN, or if VN
+ *                     is NULL that it does not exist.
+ *    dcache_invalidate - Forget what NAME in DIR refers to.
+ *    dcache_purge   - Forget everything on FS, dropping the references
+ *                     held. Used before unmount.
+ *    dcache_bootstrap - Initialize.
+ */
+
+#define DCACHE_NAMELEN	32
+
+struct fs;	/* in <fs.h> */
+struct vnode;	/* in <vnode.h> */
+
+bool dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret);
+void dcache_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void dcache_invalidate(struct vnode *dir, const char *name);
+void dcache_purge(struct fs *fs);
+void dcache_bootstrap(void);
+
+
+#endif /* _DCACHE_H_ */
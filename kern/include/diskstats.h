@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _DISKSTATS_H_
+#define _DISKSTATS_H_
+
+/*
+ * Disk I/O statistics (struct diskstats is in <kern/diskstats.h> so
+ * userlevel can fetch it with DIOCGSTATS).
+ *
+ * A disk driver keeps a struct diskstats under its own spinlock and
+ * calls these functions while holding it:
+ *
+ *    diskstats_init   - Set up for a disk of NSECTS sectors at RPM.
+ *    diskstats_submit - A request was queued.
+ *    diskstats_done   - A request finished, with ERR as its result,
+ *                       having been submitted, started, and completed
+ *                       at the times given.
+ *    diskstats_clear  - Zero the counters (but not the depth, since
+ *                       those requests are still outstanding).
+ *
+ * The driver may also register the disk by name, which lets the
+ * kernel menu print or clear every disk's numbers at once:
+ *
+ *    diskstats_register - Register DS, protected by LK, as NAME. NAME
+ *                         must stay valid for good.
+ *    diskstats_printall - Print all registered disks' stats.
+ *    diskstats_clearall - Clear all registered disks' stats.
+ */
+
+#include <kern/diskstats.h>
+
+struct spinlock;	/* in <spinlock.h> */
+struct timespec;	/* in <kern/time.h> */
+
+void diskstats_init(struct diskstats *ds, uint32_t nsects, uint32_t rpm);
+void diskstats_submit(struct diskstats *ds);
+void diskstats_done(struct diskstats *ds, bool write, uint32_t bytes, int err,
+		    const struct timespec *submitted,
+		    const struct timespec *started,
+		    const struct timespec *done);
+void diskstats_clear(struct diskstats *ds);
+
+int diskstats_register(const char *name, struct diskstats *ds,
+		       struct spinlock *lk);
+void diskstats_printall(void);
+void diskstats_clearall(void);
+
+
+#endif /* _DISKSTATS_H_ */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KCACHE_H_
+#define _KCACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A kcache hands out fixed-size objects of one type and keeps freed
+ * ones around, still constructed, so they can be reused without
+ * going back through kmalloc and redoing whatever setup the object
+ * needs (creating its locks, wait channels, and so on).
+ *
+ * CTOR, if not NULL, is called on fresh memory to put it in the
+ * constructed state and returns 0 or an error code. DTOR, if not
+ * NULL, undoes CTOR before the memory is released. Objects must be
+ * back in the constructed state when passed to kcache_free. Both may
+ * be called from inside kcache_alloc and kcache_free and so must not
+ * sleep if those are used while holding a spinlock.
+ *
+ * Freed objects are kept on per-cpu lists, overflowing into a shared
+ * depot and from there back to kmalloc.
+ *
+ *    kcache_create  - Create a cache for objects of SIZE bytes.
+ *                     NAME is copied. Returns NULL if out of memory.
+ *    kcache_destroy - Release all cached objects and the cache itself.
+ *                     There must be no objects outstanding.
+ *    kcache_alloc   - Get a constructed object, or NULL if out of
+ *                     memory.
+ *    kcache_free    - Return an object obtained from kcache_alloc.
+ *    kcache_printstats - Print reuse statistics for all caches.
+ */
+
+struct kcache; /* Opaque */
+
+struct kcache *kcache_create(const char *name, size_t size,
+			     int (*ctor)(void *obj),
+			     void (*dtor)(void *obj));
+void kcache_destroy(struct kcache *kc);
+void *kcache_alloc(struct kcache *kc);
+void kcache_free(struct kcache *kc, void *obj);
+void kcache_printstats(void);
+
+
+#endif /* _KCACHE_H_ */
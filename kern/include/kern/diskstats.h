@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_DISKSTATS_H_
+#define _KERN_DISKSTATS_H_
+
+/*
+ * Disk statistics, as returned by the DIOCGSTATS ioctl on a raw disk
+ * device (see kern/ioctl.h).
+ *
+ * Times are in microseconds. A request's latency runs from when it's
+ * submitted to when it completes: the time it waits in the queue
+ * plus the time the disk spends on it. Bucket i of dr_hist counts
+ * requests with latency of at least 2^i usec and less than 2^(i+1);
+ * bucket 0 also takes latencies under 1 usec, and the last bucket
+ * everything past its lower bound.
+ */
+
+#define DISKSTATS_NBUCKETS	24
+
+/* Counters for one direction (read or write) */
+struct diskstats_rw {
+	__u32 dr_requests;		/* requests completed */
+	__u32 dr_errors;		/* ... that failed */
+	__u32 dr_merged;		/* ... merged behind another */
+	__u64 dr_bytes;			/* bytes transferred */
+	__u64 dr_waitusecs;		/* total time queued */
+	__u64 dr_svcusecs;		/* total time in service */
+	__u32 dr_hist[DISKSTATS_NBUCKETS];	/* latency histogram */
+};
+
+struct diskstats {
+	__u32 ds_nsects;		/* disk size, in sectors */
+	__u32 ds_rpm;			/* rotation speed */
+	__u32 ds_submits;		/* requests submitted */
+	__u32 ds_runs;			/* runs of requests started */
+	__u32 ds_depth;			/* requests outstanding now */
+	__u32 ds_maxdepth;		/* most ever outstanding */
+	__u64 ds_depthsum;		/* sum of depth after each submit */
+	struct diskstats_rw ds_read;
+	struct diskstats_rw ds_write;
+};
+
+#endif /* _KERN_DISKSTATS_H_ */
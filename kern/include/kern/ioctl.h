@@ -34,6 +34,8 @@
  * ioctl operation codes
  */
 
-/* (none yet) */
+/* Disks */
+#define DIOCGSTATS	1	/* get statistics (struct diskstats) */
+#define DIOCCLRSTATS	2	/* clear statistics */
 
 #endif /* _KERN_IOCTL_H_*/
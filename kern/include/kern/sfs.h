@@ -37,36 +37,69 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
-#define SFS_BLOCKSIZE     512           /* size of our blocks */
+#define SFS_BLOCKSIZE     512           /* smallest block size */
+#define SFS_MAXBLOCKSIZE  8192          /* largest block size */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
+#define SFS_NINOEXTENTS   8             /* # of extents in inode */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
 #define SFS_NOINO         0             /* inode # for free dir entry */
 #define SFS_ROOTDIR_INO   1             /* loc'n of the root dir inode */
 
+/*
+ * Block size.
+ *
+ * The block size of a volume is sb_blocksize, a power of two from
+ * SFS_BLOCKSIZE to SFS_MAXBLOCKSIZE; 0 means SFS_BLOCKSIZE, for
+ * volumes made before it was recorded. Everything is measured in
+ * blocks of that size, including sb_nblocks. The superblock, inodes,
+ * and journal commit blocks are SFS_BLOCKSIZE bytes long and take up
+ * the start of a block, the rest of which is zero. The geometry
+ * macros below take the block size as an argument.
+ */
+
+/* # direct blks per indirect blk */
+#define SFS_DBPERIDB(bs)   ((bs) / sizeof(uint32_t))
+
 /* Number of bits in a block */
-#define SFS_BITSPERBLOCK (SFS_BLOCKSIZE * CHAR_BIT)
+#define SFS_BITSPERBLOCK(bs) ((bs) * CHAR_BIT)
 
 /* Utility macro */
 #define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*b)
 
 /* Size of free block bitmap (in bits) */
-#define SFS_FREEMAPBITS(nblocks) SFS_ROUNDUP(nblocks, SFS_BITSPERBLOCK)
+#define SFS_FREEMAPBITS(nblocks, bs) \
+	SFS_ROUNDUP(nblocks, SFS_BITSPERBLOCK(bs))
 
 /* Size of free block bitmap (in blocks) */
-#define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
+#define SFS_FREEMAPBLOCKS(nblocks, bs) \
+	(SFS_FREEMAPBITS(nblocks, bs)/SFS_BITSPERBLOCK(bs))
 
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
 
+/* Inode flags for sfi_flags */
+#define SFS_IF_HASHDIR    0x00000001  /* directory is a hash table */
+#define SFS_IF_EXTENTS    0x00000002  /* blocks are mapped by extents */
+
+/*
+ * A run of consecutive blocks: file blocks sfe_fileblock through
+ * sfe_fileblock+sfe_len-1 are disk blocks sfe_diskblock through
+ * sfe_diskblock+sfe_len-1.
+ */
+struct sfs_extent {
+	uint32_t sfe_fileblock;			/* First file block */
+	uint32_t sfe_diskblock;			/* First disk block */
+	uint32_t sfe_len;			/* Number of blocks */
+};
+
 /*
  * On-disk superblock
  */
@@ -74,7 +107,11 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_journalstart;		/* First block of journal */
+	uint32_t sb_journalblocks;		/* Size of journal, or 0 */
+	uint32_t sb_journalseq;			/* Transaction to replay */
+	uint32_t sb_blocksize;			/* Block size, or 0 for 512 */
+	uint32_t reserved[114];			/* unused, set to 0 */
 };
 
 /*
@@ -86,9 +123,41 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_flags;			/* SFS_IF_* flags */
+	uint16_t sfi_nextents;			/* # entries in sfi_extents */
+	uint16_t sfi_extdepth;			/* 0 = extents, 1 = index */
+	struct sfs_extent sfi_extents[SFS_NINOEXTENTS];	/* Extent map */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_waste[128-7-SFS_NDIRECT-3*SFS_NINOEXTENTS];
+						/* unused space, set to 0 */
 };
 
+/*
+ * Extent-mapped files.
+ *
+ * If SFS_IF_EXTENTS is set in sfi_flags, sfi_direct and the indirect
+ * block pointers are not used and the file's blocks are described
+ * by extents instead, kept sorted by file block with no overlaps.
+ * Blocks not in any extent are holes.
+ *
+ * If sfi_extdepth is 0, the first sfi_nextents entries of
+ * sfi_extents are the file's extents. If it is 1, they are an index:
+ * in each entry sfe_diskblock is an extent block, sfe_fileblock is
+ * the lowest file block it may map (for the first entry, 0), and
+ * sfe_len is 0. The extent blocks hold the extents themselves, and
+ * between them cover the file in the order of the index.
+ */
+struct sfs_extblock {
+	uint32_t seb_nextents;			/* # entries in seb_extents */
+	uint32_t seb_reserved;			/* unused, set to 0 */
+	struct sfs_extent seb_extents[];	/* Fills the block */
+};
+
+/* # extents per extent block */
+#define SFS_EXTPERBLOCK(bs) \
+	(((bs) - sizeof(struct sfs_extblock)) / sizeof(struct sfs_extent))
+
 /*
  * On-disk directory entry
  */
@@ -97,5 +166,88 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/* Number of directory entries in a block */
+#define SFS_DIRENTPERBLOCK(bs) ((bs) / sizeof(struct sfs_direntry))
+
+/*
+ * Hashed directories.
+ *
+ * A directory is an array of sfs_direntry, and small directories are
+ * searched linearly. A directory with SFS_IF_HASHDIR set in sfi_flags
+ * is still an array of sfs_direntry, but it is also a hash table:
+ * each block is a bucket, the number of blocks is a power of two,
+ * and an entry lives either in its home bucket (the name's hash
+ * modulo the number of buckets) or, if that was full when the entry
+ * was added, in the first bucket after it (wrapping around) that had
+ * room. The invariant is that every bucket from an entry's home
+ * bucket up to but not including the one it is in is full. Therefore
+ * a lookup can stop at the first bucket that has a free slot.
+ *
+ * The hash is 32-bit FNV-1a over the bytes of the name, not
+ * including the terminating null:
+ *
+ *     h = SFS_DIRHASH_BASIS;
+ *     for each byte c: h = (h ^ c) * SFS_DIRHASH_PRIME;
+ *
+ * Because the entries are laid out exactly as in a flat directory,
+ * anything that only reads directories can ignore the flag.
+ */
+#define SFS_DIRHASH_BASIS 2166136261U
+#define SFS_DIRHASH_PRIME 16777619U
+
+/*
+ * Metadata journal.
+ *
+ * If sb_journalblocks is not 0, blocks sb_journalstart through
+ * sb_journalstart+sb_journalblocks-1 (which come after the freemap
+ * and are marked in use in it) hold the journal. Changes to
+ * metadata blocks (the superblock, the freemap, inodes, indirect and
+ * extent blocks, and directory blocks) are collected into a
+ * transaction, and the new contents of all of them are written to
+ * the journal before any of them is written in place. File data is
+ * not journaled.
+ *
+ * The journal holds at most one transaction, starting at the first
+ * journal block: a descriptor block, followed by copies of the
+ * blocks it lists, then another descriptor and its blocks if there
+ * are more than fit in one, and so on; then a commit block. Each
+ * block's copy comes in the same order as in the descriptors.
+ *
+ * The commit block's checksum is computed over the copies, taken as
+ * 32-bit words in on-disk byte order, starting from 0:
+ *
+ *     sum = ((sum << 1) | (sum >> 31)) ^ word;
+ *
+ * A transaction is complete if the descriptors and the commit block
+ * all have the right magic numbers and a sequence number of
+ * sb_journalseq, and the commit block's count and checksum match.
+ * When mounting (or checking) a volume, a complete transaction is
+ * replayed by copying each block to its home location. The copy of
+ * the superblock in a transaction always has sb_journalseq one
+ * greater, so replaying it, or writing its blocks in place normally
+ * after it commits, retires it.
+ */
+#define SFS_JDESC_MAGIC   0x4a444553    /* journal descriptor block */
+#define SFS_JCOMMIT_MAGIC 0x4a434d54    /* journal commit block */
+
+struct sfs_jdesc {
+	uint32_t jd_magic;			/* SFS_JDESC_MAGIC */
+	uint32_t jd_seq;			/* Transaction number */
+	uint32_t jd_nblocks;			/* # entries in jd_blocks */
+	uint32_t jd_blocks[];			/* Home locations */
+};
+
+/* # blocks per descriptor */
+#define SFS_JDESCENTRIES(bs) \
+	(((bs) - sizeof(struct sfs_jdesc)) / sizeof(uint32_t))
+
+struct sfs_jcommit {
+	uint32_t jc_magic;			/* SFS_JCOMMIT_MAGIC */
+	uint32_t jc_seq;			/* Transaction number */
+	uint32_t jc_nblocks;			/* Total # of blocks copied */
+	uint32_t jc_checksum;			/* Checksum of the copies */
+	uint32_t jc_reserved[124];		/* unused, set to 0 */
+};
+
 
 #endif /* _KERN_SFS_H_ */
@@ -39,6 +39,7 @@
 /*
  * Get abstract structure definitions
  */
+#include <spinlock.h>
 #include <fs.h>
 #include <vnode.h>
 
@@ -50,25 +51,89 @@
 
 /*
  * In-memory inode
+ *
+ * sv_lock covers sv_i, sv_dirty, and the file's contents: readers
+ * share it and anything that changes the inode or allocates blocks
+ * holds it for writing. The read-ahead state is updated by readers
+ * and so has its own spinlock. Lock order is the fs-wide sfs_jlock,
+ * then parent directory before child, then sv_lock before the
+ * fs-wide sfs_vnlock and sfs_freemaplock.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
+	struct rwlock *sv_lock;         /* protects inode and contents */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+
+	/* Vnode table linkage (see sfs_inode.c); under sfs_vnlock */
+	struct sfs_vnode *sv_hashnext;  /* next on hash chain */
+	struct sfs_vnode *sv_lruprev;   /* unused vnodes, oldest first */
+	struct sfs_vnode *sv_lrunext;
+	bool sv_unused;                 /* on the LRU list */
+
+	/* Sequential read detection and read-ahead (see sfs_io.c) */
+	struct spinlock sv_ralock;      /* protects the next three */
+	off_t sv_ranextpos;             /* where a sequential read starts */
+	uint32_t sv_rawindow;           /* read-ahead window, in blocks */
+	uint32_t sv_raend;              /* read-ahead issued up to here */
+
+	/* Last bottom-level indirect block sfs_bmap used (see sfs_bmap.c) */
+	struct spinlock sv_bmaplock;    /* protects the next two */
+	uint32_t sv_bmapbase;           /* first file block it maps */
+	daddr_t sv_bmapblock;           /* its disk block, or 0 if none */
+
+	/* File data with no disk blocks yet (see sfs_dalloc.c) */
+	char *sv_dadata;                /* the blocks' contents */
+	uint32_t sv_dastart;            /* first file block held */
+	uint32_t sv_dacount;            /* number of blocks held */
+	uint32_t sv_dawindow;           /* max number to hold */
+	uint32_t sv_dareserved;         /* blocks reserved for them */
+	bool sv_daflushing;             /* allocating from sv_dareserved */
 };
 
 /*
  * In-memory info for a whole fs volume
+ *
+ * sfs_vnlock covers the table of vnodes in memory, including ones
+ * nobody is using that are kept around in case they're wanted again;
+ * sfs_freemaplock covers the freemap and the superblock, and their
+ * dirty flags.
+ *
+ * If the volume has a journal, every operation that changes it holds
+ * sfs_jlock shared, and committing a transaction holds it exclusive
+ * (see sfs_journal.c).
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
+	uint32_t sfs_blocksize;         /* block size, from sfs_sb */
+	unsigned sfs_blockshift;        /* log2 of sfs_blocksize */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* protects the vnode table */
+	struct sfs_vnode **sfs_vnhash;  /* vnodes in memory, by inode */
+	unsigned sfs_nvnodes;           /* number of vnodes in memory */
+	struct sfs_vnode *sfs_lruhead;  /* unused vnodes, oldest first */
+	struct sfs_vnode *sfs_lrutail;
+	unsigned sfs_nunused;           /* number on the LRU list */
+	struct lock *sfs_freemaplock;   /* protects freemap and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_freemapdirtymap; /* freemap blocks modified */
+	uint32_t sfs_nfree;             /* number of free blocks */
+	uint32_t sfs_nreserved;         /* free blocks promised to files */
+	/* Metadata journal (see sfs_journal.c) */
+	unsigned sfs_jmax;              /* max blocks per transaction, or 0 */
+	uint32_t sfs_jseq;              /* number of the running transaction */
+	struct rwlock *sfs_jlock;       /* held shared by operations */
+	struct spinlock sfs_jtxlock;    /* protects the next four */
+	daddr_t *sfs_jtx;               /* blocks in the running transaction */
+	unsigned sfs_jtxcount;          /* number of them */
+	bool sfs_joverflow;             /* more than sfs_jmax of them */
+	bool sfs_jckpt;                 /* they're committed, not yet home */
+	struct bitmap *sfs_jfreed;      /* blocks it frees; sfs_freemaplock */
+	uint32_t sfs_njfreed;           /* number of them */
 };
 
 /*
@@ -37,6 +37,7 @@
 
 #include <cdefs.h>
 #include <hangman.h>
+#include "opt-ticketlock.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -51,12 +52,24 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * With "options ticketlock" spinlocks are ticket locks: each CPU
+ * trying to acquire takes a ticket from splk_next and waits for
+ * splk_owner to reach it. This grants the lock in FIFO order, and
+ * waiters only read splk_owner, which changes once per handoff,
+ * rather than all retrying test-and-set on the same word. Otherwise
+ * they are test-and-test-and-set locks on splk_lock.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
+#if OPT_TICKETLOCK
+	volatile spinlock_data_t splk_next;  /* Next ticket to hand out. */
+	volatile spinlock_data_t splk_owner; /* Ticket now being served. */
+#else
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+#endif
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
 };
@@ -64,11 +77,18 @@ struct spinlock {
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
+#if OPT_TICKETLOCK
+#define SPINLOCK_DATA_INITIALIZERS	SPINLOCK_DATA_INITIALIZER, \
+					SPINLOCK_DATA_INITIALIZER
+#else
+#define SPINLOCK_DATA_INITIALIZERS	SPINLOCK_DATA_INITIALIZER
+#endif
+
 #ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZERS, NULL, \
 				  HANGMAN_LOCKABLE_INITIALIZER }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZERS, NULL }
 #endif
 
 /*
@@ -37,6 +37,12 @@
 
 #include <spinlock.h>
 
+/*
+ * Set up the object caches for locks and CVs. Must be called before
+ * the first lock_create or cv_create.
+ */
+void synch_bootstrap(void);
+
 /*
  * Dijkstra-style semaphore.
  *
@@ -69,6 +75,13 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
+ * The lock is adaptive: a thread that finds the lock held by a thread
+ * that is currently running on another cpu spins for a while (up to
+ * LOCK_SPIN_MAX iterations) in the expectation that it will be
+ * released soon, rather than paying for two context switches. It
+ * goes to sleep if the holder is not running or the spin budget runs
+ * out.
+ *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
  */
@@ -83,6 +96,33 @@ struct lock {
 struct lock *lock_create(const char *name);
 void lock_destroy(struct lock *);
 
+/* Spin budget for lock_acquire; tune with the lock statistics. */
+#define LOCK_SPIN_MAX	1000
+
+/*
+ * Lock contention statistics. These are kept per-cpu (in struct cpu)
+ * so that gathering them doesn't itself cause contention.
+ *
+ *    ls_acquires  - total lock_acquire calls
+ *    ls_contended - acquires that found the lock held
+ *    ls_spinwins  - contended acquires that succeeded without sleeping
+ *    ls_sleeps    - number of times a waiter went to sleep
+ *    ls_spins     - total spin iterations
+ *
+ * lock_printstats prints the totals for all cpus; lock_clearstats
+ * resets them.
+ */
+struct lockstats {
+	unsigned ls_acquires;
+	unsigned ls_contended;
+	unsigned ls_spinwins;
+	unsigned ls_sleeps;
+	unsigned ls_spins;
+};
+
+void lock_printstats(void);
+void lock_clearstats(void);
+
 /*
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
@@ -128,6 +168,9 @@ void cv_destroy(struct cv *);
  *                   waking up again, re-acquire the lock.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
+ *    cv_timedwait - Like cv_wait, but give up after TICKS hardclocks.
+ *                   Returns 0 if signalled and ETIMEDOUT if not; the
+ *                   lock is reacquired either way.
  *
  * For all three operations, the current thread must hold the lock passed
  * in. Note that under normal circumstances the same lock should be used
@@ -138,6 +181,55 @@ void cv_destroy(struct cv *);
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks);
+
+
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers wait
+ * too, so a steady stream of readers can't starve writers. (The flip
+ * side is that a thread that already holds the lock for reading must
+ * not try to get it for reading again; if a writer has arrived in
+ * between, that deadlocks.)
+ *
+ * For the deadlock detector, writers hold the lock like an ordinary
+ * lock; readers only wait for it.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+        char *rwlk_name;
+        HANGMAN_LOCKABLE(rwlk_hangman);	/* Deadlock detector hook. */
+        struct wchan *rwlk_readwchan;	/* Readers wait here */
+        struct wchan *rwlk_writewchan;	/* Writers wait here */
+        struct spinlock rwlk_lock;	/* Protects everything */
+        unsigned rwlk_readers;		/* Number of active readers */
+        unsigned rwlk_waitingwriters;	/* Number of waiting writers */
+        struct thread *rwlk_writer;	/* Active writer, if any */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read   - Get the lock for shared (read) access.
+ *    rwlock_release_read   - Release shared access.
+ *    rwlock_acquire_write  - Get the lock for exclusive (write) access.
+ *    rwlock_release_write  - Release exclusive access. Only the thread
+ *                            holding it may do this.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                            the lock for writing. (Readers are not
+ *                            tracked individually.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
 
 
 #endif /* _SYNCH_H_ */
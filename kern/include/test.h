@@ -57,6 +57,8 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
+int rwtest2(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -97,6 +99,9 @@ int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
 int nettest(int, char **);
+int spinbench(int, char **);
+int timertest(int, char **);
+int lhdtest(int, char **);
 
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
@@ -72,6 +72,7 @@ struct thread {
 	 */
 	char *t_name;			/* Name of this thread */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
+	struct wchan *t_wchan;		/* Wait channel, if on one */
 	threadstate_t t_state;		/* State this thread is in */
 
 	/*
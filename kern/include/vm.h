@@ -81,6 +81,9 @@ extern struct spinlock hpt_lock;
 extern struct hpt_entry **hpt;
 extern int hpt_size;
 
+/* object cache for hpt entries (set up by vm_bootstrap) */
+extern struct kcache *hpt_cache;
+
 void init_ft_hpt(void);
 int allocate_memory(struct hpt_entry * ptr);
 
@@ -90,7 +93,11 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
-/* Allocate/free kernel heap pages (called by kmalloc/kfree) */
+/*
+ * Allocate/free kernel heap pages (called by kmalloc/kfree).
+ * Multi-page allocations are physically contiguous; free_kpages
+ * releases one page, so free them a page at a time.
+ */
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
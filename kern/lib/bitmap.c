@@ -95,29 +95,62 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
-int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+/*
+ * Return the index of the lowest clear bit in W, which must have one.
+ */
+static
+inline
+unsigned
+bitmap_ffz(WORD_TYPE w)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned bit = 0;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
+        KASSERT(w != WORD_ALLBITS);
+
+        w = ~w;
+        if ((w & 0x0f) == 0) {
+                w >>= 4;
+                bit += 4;
+        }
+        if ((w & 0x03) == 0) {
+                w >>= 2;
+                bit += 2;
+        }
+        if ((w & 0x01) == 0) {
+                bit += 1;
+        }
+        return bit;
+}
+
+/*
+ * Return the index of the first word from START up to (not including)
+ * LIMIT that has a clear bit, or LIMIT if there isn't one.
+ *
+ * The bits are kept in bytes (see above) but we can still look at
+ * them 32 at a time; whether all the bits are set doesn't depend on
+ * byte order. The word array comes from kmalloc and is aligned.
+ */
+static
+unsigned
+bitmap_scan(struct bitmap *b, unsigned start, unsigned limit)
+{
+        const unsigned chunk = sizeof(uint32_t) / sizeof(WORD_TYPE);
+        unsigned ix = start;
+
+        while (ix < limit && ix % chunk != 0) {
+                if (b->v[ix] != WORD_ALLBITS) {
+                        return ix;
                 }
+                ix++;
+        }
+        while (ix + chunk <= limit &&
+               *(const uint32_t *)&b->v[ix] == 0xffffffff) {
+                ix += chunk;
+        }
+        while (ix < limit && b->v[ix] == WORD_ALLBITS) {
+                ix++;
         }
-        return ENOSPC;
+        return ix;
 }
 
 static
@@ -131,6 +164,67 @@ bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
         *mask = ((WORD_TYPE)1) << offset;
 }
 
+/*
+ * Find the first clear bit at or after GOAL, going around to the
+ * beginning if there are none past it. Set it and up to MAXLEN-1
+ * clear bits directly after it, and hand back the first one and how
+ * many were set.
+ */
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned maxlen,
+                  unsigned *index, unsigned *len)
+{
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned goalix, ix, bit, n;
+        WORD_TYPE w, mask;
+
+        KASSERT(goal < b->nbits);
+        KASSERT(maxlen > 0);
+
+        /* In the goal's own word, only bits from the goal up count */
+        goalix = goal / BITS_PER_WORD;
+        mask = ((WORD_TYPE)1 << (goal % BITS_PER_WORD)) - 1;
+        w = b->v[goalix] | mask;
+        if (w != WORD_ALLBITS) {
+                ix = goalix;
+        }
+        else {
+                ix = bitmap_scan(b, goalix + 1, maxix);
+                if (ix == maxix) {
+                        /* Wrap around (to the low bits of goalix too) */
+                        ix = bitmap_scan(b, 0, goalix + 1);
+                        if (ix == goalix + 1) {
+                                return ENOSPC;
+                        }
+                }
+                w = b->v[ix];
+        }
+
+        bit = ix*BITS_PER_WORD + bitmap_ffz(w);
+        KASSERT(bit < b->nbits);
+
+        for (n = 0; n < maxlen && bit + n < b->nbits; n++) {
+                bitmap_translate(bit + n, &ix, &mask);
+                if (b->v[ix] & mask) {
+                        break;
+                }
+                b->v[ix] |= mask;
+        }
+        KASSERT(n > 0);
+
+        *index = bit;
+        *len = n;
+        return 0;
+}
+
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        unsigned len;
+
+        return bitmap_alloc_near(b, 0, 1, index, &len);
+}
+
 void
 bitmap_mark(struct bitmap *b, unsigned index)
 {
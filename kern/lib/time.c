@@ -67,3 +67,25 @@ timespec_sub(const struct timespec *ts1,
 	r.tv_sec -= ts2->tv_sec;
 	*ret = r;
 }
+
+/*
+ * Interval -> hardclocks, rounding up. Negative intervals are 0;
+ * anything that doesn't fit is clamped, which also keeps the
+ * arithmetic in 32 bits.
+ */
+unsigned
+timespec_to_ticks(const struct timespec *ts)
+{
+	const uint32_t nsecpertick = 1000000000 / HZ;
+	uint32_t ticks;
+
+	if (ts->tv_sec < 0) {
+		return 0;
+	}
+	if (ts->tv_sec >= (__time_t)(0x7fffffff / HZ)) {
+		return 0x7fffffff;
+	}
+	ticks = (uint32_t)ts->tv_sec * HZ;
+	ticks += ((uint32_t)ts->tv_nsec + nsecpertick - 1) / nsecpertick;
+	return ticks;
+}
@@ -46,7 +46,9 @@
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <pid.h>
+#include <openfile.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -109,11 +111,14 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	synch_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	pid_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	buffer_bootstrap();
+	openfile_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -131,6 +136,7 @@ boot(void)
 	kprintf_bootstrap();
 	exec_bootstrap();
 	thread_start_cpus();
+	buffer_syncer_bootstrap();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
@@ -38,6 +38,9 @@
 #include <clock.h>
 #include <mainbus.h>
 #include <synch.h>
+#include <diskstats.h>
+#include <lamebus/lhd.h> // for lhd_setsched()
+#include <kcache.h>
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
@@ -467,6 +470,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kcache_printstats();
 
 	return 0;
 }
@@ -500,6 +504,69 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lock_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "clear")) {
+		lock_clearstats();
+	}
+	else {
+		kprintf("Usage: lkstats [clear]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_diskstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		diskstats_printall();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "clear")) {
+		diskstats_clearall();
+	}
+	else {
+		kprintf("Usage: dkstats [clear]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_dksched(int nargs, char **args)
+{
+	struct lhd_softc *lh;
+	int result;
+
+	if (nargs < 2 || nargs > 3) {
+		kprintf("Usage: dksched lhdN [policy]\n");
+		return EINVAL;
+	}
+
+	lh = lhd_byname(args[1]);
+	if (lh == NULL) {
+		kprintf("dksched: %s: No such disk\n", args[1]);
+		return ENODEV;
+	}
+
+	if (nargs == 3) {
+		result = lhd_setsched(lh, args[2]);
+		if (result) {
+			kprintf("dksched: %s: %s\n", args[2], strerror(result));
+			return result;
+		}
+	}
+	kprintf("%s: %s\n", args[1], lhd_getsched(lh));
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -566,6 +633,9 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[spb] Spinlock benchmark            ",
+	"[tmt] Timeout re-add test           ",
+	"[lhdt] lhd request test             ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -576,6 +646,8 @@ static const char *testmenu[] = {
 	"[sy2] Lock test                     ",
 	"[sy3] CV test                       ",
 	"[sy4] CV test #2                    ",
+	"[sy5] RW lock test                  ",
+	"[sy6] RW lock writer preference     ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[wt]  waitpid test                  ",
 	"[fs1] Filesystem test               ",
@@ -606,6 +678,8 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[lkstats] Lock contention stats     ",
+	"[dkstats] Disk I/O stats            ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +731,9 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "lkstats",    cmd_lockstats },
+	{ "dkstats",    cmd_diskstats },
+	{ "dksched",    cmd_dksched },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -667,6 +744,9 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "spb",	spinbench },
+	{ "tmt",	timertest },
+	{ "lhdt",	lhdtest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -679,6 +759,8 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
+	{ "sy6",	rwtest2 },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
@@ -427,3 +427,27 @@ sys_ftruncate(int fd, off_t len)
 	filetable_put(curproc->p_filetable, fd, file);
 	return err;
 }
+
+/*
+ * ioctl - call VOP_IOCTL
+ */
+int
+sys_ioctl(int fd, int code, userptr_t data)
+{
+	struct openfile *file;
+	int err;
+
+	err = filetable_get(curproc->p_filetable, fd, &file);
+	if (err) {
+		return err;
+	}
+
+	/*
+	 * No need to lock the openfile - it cannot disappear under us,
+	 * and we're not using any of its non-constant fields.
+	 */
+
+	err = VOP_IOCTL(file->of_vnode, code, data);
+	filetable_put(curproc->p_filetable, fd, file);
+	return err;
+}
@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -39,7 +40,7 @@ bitmaptest(int nargs, char **args)
 {
 	struct bitmap *b;
 	char data[TESTSIZE];
-	uint32_t x;
+	uint32_t x, len;
 	int i;
 
 	(void)nargs;
@@ -101,6 +102,30 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/*
+	 * Now free two runs and get them back with goals.
+	 */
+	for (i=10; i<15; i++) {
+		bitmap_unmark(b, i);
+	}
+	for (i=100; i<120; i++) {
+		bitmap_unmark(b, i);
+	}
+	KASSERT(bitmap_alloc_near(b, 105, 10, &x, &len)==0);
+	KASSERT(x == 105 && len == 10);
+	KASSERT(bitmap_alloc_near(b, 105, 10, &x, &len)==0);
+	KASSERT(x == 115 && len == 5);
+	/* nothing past 200, so these wrap around */
+	KASSERT(bitmap_alloc_near(b, 200, 10, &x, &len)==0);
+	KASSERT(x == 10 && len == 5);
+	KASSERT(bitmap_alloc_near(b, TESTSIZE-1, 10, &x, &len)==0);
+	KASSERT(x == 100 && len == 5);
+	KASSERT(bitmap_alloc_near(b, 0, 1, &x, &len)==ENOSPC);
+
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT(bitmap_isset(b, i));
+	}
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * lhd request test.
+ *
+ * Runs threads that read with lhd_submit and lhd_wait alongside a
+ * thread that keeps a batch of reads with completion callbacks in
+ * flight, all on the same disk, and checks that every request
+ * finishes exactly once with the same data a plain read gets. It does
+ * this once under each scheduling policy, switching to it while the
+ * threads' requests are in flight.
+ *
+ * Only reads are done, so it's safe on a disk with a filesystem on
+ * it, but the data check assumes nothing writes to the disk during
+ * the test.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+#include <lamebus/lhd.h>
+
+#define LHT_WAITERS	4	/* threads using lhd_wait */
+#define LHT_WAITLOOPS	16	/* requests per waiter */
+#define LHT_BATCH	8	/* callback requests in flight at once */
+#define LHT_BATCHES	4	/* batches per callback thread */
+#define LHT_MAXSECTS	4	/* most sectors per request */
+
+struct lht_req {
+	struct lhd_req r_req;
+	char r_buf[LHT_MAXSECTS * LHD_SECTSIZE];
+	volatile unsigned r_calls;	/* times the callback ran */
+};
+
+static struct lhd_softc *lht_disk;
+static struct semaphore *lht_cbsem;	/* callbacks to the callback thread */
+static struct semaphore *lht_donesem;	/* threads finishing */
+static struct spinlock lht_lock = SPINLOCK_INITIALIZER;
+static unsigned lht_errors;		/* protected by lht_lock */
+
+static
+void
+lht_fail(void)
+{
+	spinlock_acquire(&lht_lock);
+	lht_errors++;
+	spinlock_release(&lht_lock);
+}
+
+/*
+ * Set up REQ to read a random few sectors.
+ */
+static
+void
+lht_setup(struct lhd_req *req, void *buf)
+{
+	uint32_t nblocks = lht_disk->lh_dev.d_blocks;
+
+	req->lr_nsects = 1 + random() % LHT_MAXSECTS;
+	if (req->lr_nsects > nblocks) {
+		req->lr_nsects = nblocks;
+	}
+	req->lr_sector = random() % (nblocks - req->lr_nsects + 1);
+	req->lr_buf = buf;
+	req->lr_write = false;
+	req->lr_callback = NULL;
+	req->lr_data = NULL;
+}
+
+/*
+ * Read REQ's sectors again with a plain request and compare.
+ */
+static
+bool
+lht_check(const struct lhd_req *req)
+{
+	struct lhd_req check;
+	const char *orig = req->lr_buf;
+	char *buf;
+	size_t i, len;
+	bool ok;
+
+	len = req->lr_nsects * LHD_SECTSIZE;
+	buf = kmalloc(len);
+	if (buf == NULL) {
+		kprintf("lhdtest: Out of memory\n");
+		return false;
+	}
+	check.lr_sector = req->lr_sector;
+	check.lr_nsects = req->lr_nsects;
+	check.lr_buf = buf;
+	check.lr_write = false;
+	check.lr_callback = NULL;
+	check.lr_data = NULL;
+
+	ok = lhd_submit(lht_disk, &check) == 0 &&
+		lhd_wait(lht_disk, &check) == 0;
+	for (i=0; ok && i<len; i++) {
+		ok = (buf[i] == orig[i]);
+	}
+	kfree(buf);
+	return ok;
+}
+
+static
+void
+lht_callback(struct lhd_req *req)
+{
+	struct lht_req *lr = req->lr_data;
+
+	/* Interrupt context; just note it and wake the thread */
+	lr->r_calls++;
+	V(lht_cbsem);
+}
+
+static
+void
+lht_cbthread(void *junk, unsigned long num)
+{
+	struct lht_req *reqs;
+	unsigned i, j;
+
+	(void)junk;
+	(void)num;
+
+	reqs = kmalloc(LHT_BATCH * sizeof(*reqs));
+	if (reqs == NULL) {
+		kprintf("lhdtest: Out of memory\n");
+		lht_fail();
+		V(lht_donesem);
+		return;
+	}
+
+	for (i=0; i<LHT_BATCHES; i++) {
+		for (j=0; j<LHT_BATCH; j++) {
+			lht_setup(&reqs[j].r_req, reqs[j].r_buf);
+			reqs[j].r_req.lr_callback = lht_callback;
+			reqs[j].r_req.lr_data = &reqs[j];
+			reqs[j].r_calls = 0;
+			if (lhd_submit(lht_disk, &reqs[j].r_req)) {
+				kprintf("lhdtest: submit failed\n");
+				lht_fail();
+				reqs[j].r_calls = 1;
+				V(lht_cbsem);
+			}
+		}
+		for (j=0; j<LHT_BATCH; j++) {
+			P(lht_cbsem);
+		}
+		for (j=0; j<LHT_BATCH; j++) {
+			if (reqs[j].r_calls != 1 ||
+			    reqs[j].r_req.lr_result != 0 ||
+			    !lht_check(&reqs[j].r_req)) {
+				kprintf("lhdtest: callback request %u/%u "
+					"bad (%u calls, result %d)\n",
+					i, j, reqs[j].r_calls,
+					reqs[j].r_req.lr_result);
+				lht_fail();
+			}
+		}
+	}
+
+	kfree(reqs);
+	V(lht_donesem);
+}
+
+static
+void
+lht_waitthread(void *junk, unsigned long num)
+{
+	struct lhd_req req;
+	char *buf;
+	unsigned i;
+	int result;
+
+	(void)junk;
+
+	buf = kmalloc(LHT_MAXSECTS * LHD_SECTSIZE);
+	if (buf == NULL) {
+		kprintf("lhdtest: Out of memory\n");
+		lht_fail();
+		V(lht_donesem);
+		return;
+	}
+
+	for (i=0; i<LHT_WAITLOOPS; i++) {
+		lht_setup(&req, buf);
+		result = lhd_submit(lht_disk, &req);
+		if (result == 0) {
+			result = lhd_wait(lht_disk, &req);
+		}
+		if (result || !lht_check(&req)) {
+			kprintf("lhdtest: thread %lu request %u bad "
+				"(result %d)\n", num, i, result);
+			lht_fail();
+		}
+	}
+
+	kfree(buf);
+	V(lht_donesem);
+}
+
+/*
+ * One round of the test under scheduling policy SCHED. The policy is
+ * switched once the threads are going, so it changes under load.
+ */
+static
+void
+lht_round(const char *sched)
+{
+	unsigned i;
+	int result;
+
+	kprintf("lhdtest: %s...\n", sched);
+	for (i=0; i<LHT_WAITERS; i++) {
+		result = thread_fork("lhdtest", NULL, lht_waitthread, NULL, i);
+		if (result) {
+			panic("lhdtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork("lhdtest-cb", NULL, lht_cbthread, NULL, 0);
+	if (result) {
+		panic("lhdtest: thread_fork failed: %s\n", strerror(result));
+	}
+
+	result = lhd_setsched(lht_disk, sched);
+	KASSERT(result == 0);
+
+	for (i=0; i<LHT_WAITERS + 1; i++) {
+		P(lht_donesem);
+	}
+}
+
+int
+lhdtest(int nargs, char **args)
+{
+	const char *name, *oldsched;
+
+	if (nargs > 2) {
+		kprintf("Usage: lhdt [lhdN]\n");
+		return EINVAL;
+	}
+	name = nargs == 2 ? args[1] : "lhd0";
+
+	lht_disk = lhd_byname(name);
+	if (lht_disk == NULL) {
+		kprintf("lhdtest: %s: No such disk\n", name);
+		return ENODEV;
+	}
+
+	lht_cbsem = sem_create("lht_cbsem", 0);
+	lht_donesem = sem_create("lht_donesem", 0);
+	if (lht_cbsem == NULL || lht_donesem == NULL) {
+		panic("lhdtest: sem_create failed\n");
+	}
+	lht_errors = 0;
+
+	kprintf("Starting lhd request test on %s...\n", name);
+	oldsched = lhd_getsched(lht_disk);
+	lht_round("fifo");
+	lht_round("clook");
+	lhd_setsched(lht_disk, oldsched);
+	kprintf("lhd request test %s (%u errors)\n",
+		lht_errors == 0 ? "done" : "FAILED", lht_errors);
+
+	sem_destroy(lht_cbsem);
+	sem_destroy(lht_donesem);
+	lht_disk = NULL;
+	return 0;
+}
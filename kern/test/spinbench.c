@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Spinlock microbenchmark.
+ *
+ * Starts a number of threads (by default, one per cpu) that all hammer
+ * on one spinlock for a fixed time, doing a little work both inside
+ * and outside the critical section. Reports the total throughput and
+ * how evenly the acquisitions were spread among the threads.
+ *
+ * To compare implementations, run it with different numbers of cpus
+ * (set in sys161.conf; 1 to 32) and with and without "options
+ * ticketlock" in the kernel config.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <test.h>
+
+#define SPB_MAXTHREADS	64
+#define SPB_MAXCPUS	32	/* for the per-cpu summary */
+#define SPB_SECONDS	5	/* default run time */
+#define SPB_HOLDLOOPS	20	/* work done while holding the lock */
+#define SPB_THINKLOOPS	100	/* work done between acquisitions */
+
+static struct spinlock spb_lock = SPINLOCK_INITIALIZER;
+static volatile bool spb_go;
+static volatile bool spb_stop;
+
+/* Protected by spb_lock */
+static unsigned spb_lastcpu;
+static unsigned spb_reacquires;
+
+static struct {
+	unsigned count;		/* acquisitions by this thread */
+	unsigned cpu;		/* cpu it finished on */
+} spb_results[SPB_MAXTHREADS];
+
+static struct semaphore *spb_donesem;
+
+static
+void
+spinbenchthread(void *junk, unsigned long num)
+{
+	unsigned count = 0;
+	volatile unsigned j;
+
+	(void)junk;
+
+	/* Yield until told to go, to give threads time to spread out. */
+	while (!spb_go) {
+		thread_yield();
+	}
+
+	while (!spb_stop) {
+		spinlock_acquire(&spb_lock);
+		if (spb_lastcpu == curcpu->c_number) {
+			spb_reacquires++;
+		}
+		spb_lastcpu = curcpu->c_number;
+		for (j=0; j<SPB_HOLDLOOPS; j++);
+		spinlock_release(&spb_lock);
+
+		count++;
+		for (j=0; j<SPB_THINKLOOPS; j++);
+	}
+
+	spb_results[num].count = count;
+	spb_results[num].cpu = curcpu->c_number;
+	V(spb_donesem);
+}
+
+int
+spinbench(int nargs, char **args)
+{
+	unsigned nthreads, seconds, i;
+	unsigned total, min, max, mean, ms;
+	unsigned percpu[SPB_MAXCPUS], ncpus;
+	struct timespec before, after, duration;
+	int result;
+
+	nthreads = cpu_count();
+	seconds = SPB_SECONDS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		seconds = atoi(args[2]);
+	}
+	if (nargs > 3 || nthreads < 1 || nthreads > SPB_MAXTHREADS ||
+	    seconds < 1) {
+		kprintf("Usage: spb [threads [seconds]]\n");
+		kprintf("    threads is 1-%u (default: number of cpus)\n",
+			SPB_MAXTHREADS);
+		return EINVAL;
+	}
+
+	spb_donesem = sem_create("spb_done", 0);
+	if (spb_donesem == NULL) {
+		panic("spinbench: sem_create failed\n");
+	}
+	spb_go = spb_stop = false;
+	spb_lastcpu = 0;
+	spb_reacquires = 0;
+
+	kprintf("Spinlock benchmark: %u threads, %u cpus, %u seconds, %s\n",
+		nthreads, cpu_count(), seconds,
+		OPT_TICKETLOCK ? "ticket locks" : "test-and-set locks");
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("spinbench", NULL, spinbenchthread,
+				     NULL, i);
+		if (result) {
+			panic("spinbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	/* Let migration spread the threads over the cpus. */
+	clocksleep(1);
+
+	gettime(&before);
+	spb_go = true;
+	clocksleep(seconds);
+	spb_stop = true;
+	for (i=0; i<nthreads; i++) {
+		P(spb_donesem);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+	sem_destroy(spb_donesem);
+	spb_donesem = NULL;
+
+	total = 0;
+	min = max = spb_results[0].count;
+	ncpus = cpu_count() < SPB_MAXCPUS ? cpu_count() : SPB_MAXCPUS;
+	for (i=0; i<ncpus; i++) {
+		percpu[i] = 0;
+	}
+	for (i=0; i<nthreads; i++) {
+		total += spb_results[i].count;
+		if (spb_results[i].count < min) {
+			min = spb_results[i].count;
+		}
+		if (spb_results[i].count > max) {
+			max = spb_results[i].count;
+		}
+		if (spb_results[i].cpu < ncpus) {
+			percpu[spb_results[i].cpu]++;
+		}
+	}
+	mean = total / nthreads;
+	ms = duration.tv_sec * 1000 + duration.tv_nsec / 1000000;
+
+	kprintf("Threads finished on cpus:");
+	for (i=0; i<ncpus; i++) {
+		kprintf(" %u", percpu[i]);
+	}
+	kprintf("\n");
+	kprintf("Acquisitions: %u total, %u per ms\n",
+		total, ms > 0 ? total / ms : total);
+	kprintf("Per thread: min %u, mean %u, max %u (spread %u%% of mean)\n",
+		min, mean, max, mean > 0 ? (max - min) * 100 / mean : 0);
+	kprintf("Reacquired by the same cpu: %u%%\n",
+		total >= 100 ? spb_reacquires / (total / 100) : 0);
+	kprintf("Spinlock benchmark done.\n");
+	return 0;
+}
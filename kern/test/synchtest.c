@@ -400,3 +400,203 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader-writer lock tests.
+ *
+ * rwtest: a mix of readers and writers. Writers update the test
+ * values the same way locktest does; readers check that they are
+ * consistent and that no writer is active while they read.
+ *
+ * rwtest2: check writer preference. With a reader holding the lock,
+ * start a writer (which must wait) and then another reader (which
+ * must wait behind the writer even though only readers hold the lock).
+ */
+
+#define NRWLOOPS 60
+
+static struct rwlock *testrwlock;
+static volatile unsigned rwtest_readers;
+static volatile unsigned rwtest_writers;
+static volatile unsigned rwtest_maxreaders;
+static volatile bool rwtest_failed;
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	unsigned long v1;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if ((num + i) % 4 == 0) {
+			rwlock_acquire_write(testrwlock);
+			rwtest_writers++;
+			if (rwtest_writers != 1 || rwtest_readers != 0) {
+				kprintf("thread %lu: writer not alone\n", num);
+				rwtest_failed = true;
+			}
+			testval1 = num;
+			testval2 = num*num;
+			testval3 = num%3;
+			rwtest_writers--;
+			rwlock_release_write(testrwlock);
+		}
+		else {
+			rwlock_acquire_read(testrwlock);
+			lock_acquire(testlock);
+			rwtest_readers++;
+			if (rwtest_readers > rwtest_maxreaders) {
+				rwtest_maxreaders = rwtest_readers;
+			}
+			lock_release(testlock);
+			v1 = testval1;
+			/* Hang around a bit so readers overlap */
+			for (j=0; j<200; j++);
+			if (rwtest_writers != 0) {
+				kprintf("thread %lu: writer during read\n",
+					num);
+				rwtest_failed = true;
+			}
+			if (testval1 != v1 || testval2 != v1*v1 ||
+			    testval3 != v1%3) {
+				kprintf("thread %lu: inconsistent values\n",
+					num);
+				rwtest_failed = true;
+			}
+			lock_acquire(testlock);
+			rwtest_readers--;
+			lock_release(testlock);
+			rwlock_release_read(testrwlock);
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrwlock = rwlock_create("testrwlock");
+	if (testrwlock == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	rwtest_readers = rwtest_writers = rwtest_maxreaders = 0;
+	rwtest_failed = false;
+	testval1 = testval2 = testval3 = 0;
+
+	kprintf("Starting rwlock test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	rwlock_destroy(testrwlock);
+	testrwlock = NULL;
+
+	kprintf("Most concurrent readers: %u\n", rwtest_maxreaders);
+	kprintf("rwlock test %s\n", rwtest_failed ? "FAILED" : "done");
+	return 0;
+}
+
+/* Order in which the rwtest2 threads got the lock */
+static volatile unsigned rwtest2_seq;
+static volatile unsigned rwtest2_writerseq;
+static volatile unsigned rwtest2_readerseq;
+
+static
+void
+rwtest2writer(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_write(testrwlock);
+	rwtest2_writerseq = ++rwtest2_seq;
+	rwlock_release_write(testrwlock);
+	V(donesem);
+}
+
+static
+void
+rwtest2reader(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_read(testrwlock);
+	rwtest2_readerseq = ++rwtest2_seq;
+	rwlock_release_read(testrwlock);
+	V(donesem);
+}
+
+int
+rwtest2(int nargs, char **args)
+{
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrwlock = rwlock_create("testrwlock");
+	if (testrwlock == NULL) {
+		panic("rwtest2: rwlock_create failed\n");
+	}
+	rwtest2_seq = rwtest2_writerseq = rwtest2_readerseq = 0;
+	rwtest_failed = false;
+
+	kprintf("Starting rwlock writer preference test...\n");
+
+	rwlock_acquire_read(testrwlock);
+
+	result = thread_fork("rwtest2", NULL, rwtest2writer, NULL, 0);
+	if (result) {
+		panic("rwtest2: thread_fork failed: %s\n", strerror(result));
+	}
+	/* Give the writer time to start waiting */
+	clocksleep(1);
+
+	result = thread_fork("rwtest2", NULL, rwtest2reader, NULL, 0);
+	if (result) {
+		panic("rwtest2: thread_fork failed: %s\n", strerror(result));
+	}
+	clocksleep(1);
+
+	if (rwtest2_seq != 0) {
+		kprintf("Somebody got in while a reader held the lock\n");
+		rwtest_failed = true;
+	}
+	rwlock_release_read(testrwlock);
+
+	P(donesem);
+	P(donesem);
+
+	rwlock_destroy(testrwlock);
+	testrwlock = NULL;
+
+	if (rwtest2_writerseq != 1 || rwtest2_readerseq != 2) {
+		kprintf("Order: writer %u, reader %u (expected 1, 2)\n",
+			rwtest2_writerseq, rwtest2_readerseq);
+		rwtest_failed = true;
+	}
+	kprintf("rwlock writer preference test %s\n",
+		rwtest_failed ? "FAILED" : "done");
+	return 0;
+}
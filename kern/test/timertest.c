@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Timeout test.
+ *
+ * Adds a timeout whose function adds it again, for 1 hardclock and
+ * for 0, a number of times, and checks that each firing happens on a
+ * later hardclock than the one before. If a re-added timeout were run
+ * again in the same hardclock, this would hang the cpu.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <synch.h>
+#include <test.h>
+
+#define TMT_REARMS	8
+
+static struct timeout tmt_timeout;
+static struct semaphore *tmt_donesem;
+static unsigned tmt_ticks;		/* ticks to re-add for */
+static unsigned tmt_count;		/* firings so far */
+static unsigned tmt_bad;		/* firings in the same hardclock */
+static unsigned tmt_last;		/* c_hardclocks at the last firing */
+
+static
+void
+tmt_fire(void *junk)
+{
+	(void)junk;
+
+	if (tmt_count > 0 && curcpu->c_hardclocks <= tmt_last) {
+		tmt_bad++;
+	}
+	tmt_last = curcpu->c_hardclocks;
+	tmt_count++;
+
+	if (tmt_count < TMT_REARMS) {
+		timeout_add(&tmt_timeout, tmt_ticks);
+	}
+	else {
+		V(tmt_donesem);
+	}
+}
+
+static
+bool
+tmt_run(unsigned ticks)
+{
+	tmt_ticks = ticks;
+	tmt_count = 0;
+	tmt_bad = 0;
+
+	timeout_init(&tmt_timeout, tmt_fire, NULL);
+	timeout_add(&tmt_timeout, ticks);
+	P(tmt_donesem);
+
+	/* It fired for the last time; make sure it's gone */
+	timeout_del(&tmt_timeout);
+
+	kprintf("%u-tick timeout: %u firings, %u in the same hardclock\n",
+		ticks, tmt_count, tmt_bad);
+	return tmt_count == TMT_REARMS && tmt_bad == 0;
+}
+
+int
+timertest(int nargs, char **args)
+{
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	tmt_donesem = sem_create("tmt_donesem", 0);
+	if (tmt_donesem == NULL) {
+		panic("timertest: sem_create failed\n");
+	}
+
+	kprintf("Starting timeout test...\n");
+	ok = tmt_run(1);
+	ok = tmt_run(0) && ok;
+	kprintf("Timeout test %s\n", ok ? "done" : "FAILED");
+
+	sem_destroy(tmt_donesem);
+	return 0;
+}
@@ -31,6 +31,7 @@
 #include <lib.h>
 #include <cpu.h>
 #include <wchan.h>
+#include <spinlock.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
@@ -38,9 +39,10 @@
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * Timed operations are scheduled as timeouts on per-cpu timer wheels
+ * that are advanced by hardclock. The resolution is therefore one
+ * hardclock (1/HZ seconds); clocksleep_timespec uses gettime() to
+ * make sure it sleeps at least as long as asked.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -54,10 +56,11 @@
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Threads in clocksleep wait here. Nobody wakes this channel; each
+ * sleeper is woken by its own timeout.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+static struct wchan *sleep_wchan;
+static struct spinlock sleep_lock;
 
 /*
  * Setup.
@@ -65,24 +68,23 @@ static struct spinlock lbolt_lock;
 void
 hardclock_bootstrap(void)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	spinlock_init(&sleep_lock);
+	sleep_wchan = wchan_create("clocksleep");
+	if (sleep_wchan == NULL) {
+		panic("Couldn't create clocksleep wchan\n");
 	}
 }
 
 /*
  * This is called once per second, on one processor, by the timer
  * code.
+ *
+ * It used to wake everything sleeping in clocksleep once a second;
+ * sleeps are now handled by timeouts, so there is nothing to do.
  */
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
 }
 
 /*
@@ -97,6 +99,7 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	timerwheel_tick(&curcpu->c_timerwheel);
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
@@ -106,16 +109,278 @@ hardclock(void)
 	thread_yield();
 }
 
+/*
+ * Suspend execution for at least the given interval.
+ *
+ * The timeout can fire up to a hardclock early relative to the
+ * realtime clock (we might be partway through the current tick), so
+ * check the clock and go back to sleep for the remainder if needed.
+ */
+void
+clocksleep_timespec(const struct timespec *interval)
+{
+	struct timespec now, deadline, left;
+
+	gettime(&now);
+	timespec_add(&now, interval, &deadline);
+
+	spinlock_acquire(&sleep_lock);
+	while (1) {
+		gettime(&now);
+		timespec_sub(&deadline, &now, &left);
+		if (left.tv_sec < 0 || (left.tv_sec == 0 && left.tv_nsec == 0)) {
+			break;
+		}
+		wchan_sleep_timeout(sleep_wchan, &sleep_lock,
+				    timespec_to_ticks(&left));
+	}
+	spinlock_release(&sleep_lock);
+}
+
 /*
  * Suspend execution for n seconds.
  */
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	struct timespec ts;
+
+	if (num_secs <= 0) {
+		return;
+	}
+	ts.tv_sec = num_secs;
+	ts.tv_nsec = 0;
+	clocksleep_timespec(&ts);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Timer wheel.
+
+/*
+ * Pick the slot for TO based on how far in the future it is. The
+ * wheel must be locked.
+ */
+static
+void
+timerwheel_insert(struct timerwheel *tw, struct timeout *to)
+{
+	uint32_t expires, delta;
+	struct timeout **slot;
+	unsigned level;
+
+	KASSERT(spinlock_do_i_hold(&tw->tw_lock));
+
+	expires = to->to_expires;
+	delta = expires - tw->tw_ticks;
+	if ((int32_t)delta < 0) {
+		/* Already due (we're cascading late); run next tick. */
+		expires = tw->tw_ticks;
+		delta = 0;
+	}
+	else if (delta > TW_MAXTICKS) {
+		/* Park it as far out as we can; it gets re-sorted later. */
+		expires = tw->tw_ticks + TW_MAXTICKS;
+		delta = TW_MAXTICKS;
+	}
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < (1U << ((level + 1) * TW_SLOTBITS))) {
+			break;
+		}
+	}
+	slot = &tw->tw_slots[level][(expires >> (level * TW_SLOTBITS))
+				    & TW_SLOTMASK];
+
+	to->to_next = *slot;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = &to->to_next;
+	}
+	to->to_prevp = slot;
+	*slot = to;
+}
+
+/*
+ * Take TO off whatever slot it's in. The wheel must be locked.
+ */
+static
+void
+timerwheel_unlink(struct timeout *to)
+{
+	KASSERT(to->to_prevp != NULL);
+
+	*to->to_prevp = to->to_next;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = to->to_prevp;
+	}
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+}
+
+/*
+ * Move everything in the current slot of LEVEL down to the lower
+ * levels. Returns the slot index, so the caller knows whether the
+ * next level up has wrapped too.
+ */
+static
+unsigned
+timerwheel_cascade(struct timerwheel *tw, unsigned level)
+{
+	struct timeout *list, *to;
+	unsigned index;
+
+	index = (tw->tw_ticks >> (level * TW_SLOTBITS)) & TW_SLOTMASK;
+
+	list = tw->tw_slots[level][index];
+	tw->tw_slots[level][index] = NULL;
+	while (list != NULL) {
+		to = list;
+		list = to->to_next;
+		to->to_next = NULL;
+		to->to_prevp = NULL;
+		timerwheel_insert(tw, to);
+	}
+	return index;
+}
+
+void
+timerwheel_init(struct timerwheel *tw)
+{
+	unsigned i, j;
+
+	spinlock_init(&tw->tw_lock);
+	tw->tw_ticks = 0;
+	tw->tw_running = NULL;
+	tw->tw_due = NULL;
+	for (i = 0; i < TW_LEVELS; i++) {
+		for (j = 0; j < TW_SLOTS; j++) {
+			tw->tw_slots[i][j] = NULL;
+		}
+	}
+}
+
+/*
+ * Advance the wheel by one hardclock and run whatever came due.
+ * Called from hardclock on the cpu that owns the wheel.
+ */
+void
+timerwheel_tick(struct timerwheel *tw)
+{
+	struct timeout *to;
+	unsigned index, level;
+
+	spinlock_acquire(&tw->tw_lock);
+
+	index = tw->tw_ticks & TW_SLOTMASK;
+	if (index == 0) {
+		for (level = 1; level < TW_LEVELS; level++) {
+			if (timerwheel_cascade(tw, level) != 0) {
+				break;
+			}
+		}
+	}
+
+	/*
+	 * Take the due slot off the wheel and move on to the next tick
+	 * before running anything, so a timeout that adds itself again
+	 * lands in a later slot instead of the list we're working
+	 * through. (Anything still on tw_due can be deleted as usual.)
+	 */
+	tw->tw_due = tw->tw_slots[0][index];
+	tw->tw_slots[0][index] = NULL;
+	if (tw->tw_due != NULL) {
+		tw->tw_due->to_prevp = &tw->tw_due;
+	}
+	tw->tw_ticks++;
+
+	/*
+	 * Run the due timeouts one at a time, dropping the wheel lock
+	 * around each function so it can take other locks and add
+	 * more timeouts.
+	 */
+	while ((to = tw->tw_due) != NULL) {
+		timerwheel_unlink(to);
+		tw->tw_running = to;
+		spinlock_release(&tw->tw_lock);
+
+		to->to_func(to->to_data);
+
+		spinlock_acquire(&tw->tw_lock);
+		if (to->to_wheel == tw && to->to_prevp == NULL) {
+			/* Not re-added by its function */
+			to->to_wheel = NULL;
+		}
+		tw->tw_running = NULL;
+	}
+
+	spinlock_release(&tw->tw_lock);
+}
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *data)
+{
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	to->to_wheel = NULL;
+	to->to_expires = 0;
+	to->to_func = func;
+	to->to_data = data;
+}
+
+void
+timeout_add(struct timeout *to, unsigned ticks)
+{
+	struct timerwheel *tw;
+
+	tw = &curcpu->c_timerwheel;
+
+	spinlock_acquire(&tw->tw_lock);
+	KASSERT(to->to_prevp == NULL);
+	KASSERT(to->to_wheel == NULL ||
+		(to->to_wheel == tw && tw->tw_running == to));
+	to->to_wheel = tw;
+	/*
+	 * A timeout added for 0 ticks goes off at the next hardclock,
+	 * the same as 1; otherwise count whole ticks from the next one.
+	 */
+	to->to_expires = tw->tw_ticks + (ticks > 0 ? ticks - 1 : 0);
+	timerwheel_insert(tw, to);
+	spinlock_release(&tw->tw_lock);
+}
+
+bool
+timeout_del(struct timeout *to)
+{
+	struct timerwheel *tw;
+
+	while (1) {
+		tw = to->to_wheel;
+		if (tw == NULL) {
+			return false;
+		}
+
+		spinlock_acquire(&tw->tw_lock);
+		if (to->to_wheel != tw) {
+			/* Fired and went somewhere else meanwhile; retry */
+			spinlock_release(&tw->tw_lock);
+			continue;
+		}
+		if (to->to_prevp != NULL) {
+			timerwheel_unlink(to);
+			to->to_wheel = NULL;
+			spinlock_release(&tw->tw_lock);
+			return true;
+		}
+		if (tw->tw_running != to) {
+			to->to_wheel = NULL;
+			spinlock_release(&tw->tw_lock);
+			return false;
+		}
+		spinlock_release(&tw->tw_lock);
+
+		/* The function is running on the owning cpu; wait. */
+		while (tw->tw_running == to) {
+			/* spin */
+		}
 	}
-	spinlock_release(&lbolt_lock);
 }
@@ -180,3 +180,32 @@ hangman_release(struct hangman_actor *a,
 
 	spinlock_release(&hangman_lock);
 }
+
+/*
+ * Note that a is done waiting for l but did not become its holder.
+ * This is for shared (read) acquisition of an rwlock: readers can
+ * wait for a writer, but since there can be many of them at once
+ * they are not recorded as holding the lock. (So cycles that go
+ * through a reader are not detected.)
+ */
+void
+hangman_stopwait(struct hangman_actor *a,
+		 struct hangman_lockable *l)
+{
+	if (l == &hangman_lock.splk_hangman) {
+		/* don't recurse */
+		return;
+	}
+
+	spinlock_acquire(&hangman_lock);
+
+	if (a->a_waiting != l) {
+		spinlock_release(&hangman_lock);
+		panic("hangman_stopwait: not waiting for lock %s (%p)\n",
+		      l->l_name, l);
+	}
+
+	a->a_waiting = NULL;
+
+	spinlock_release(&hangman_lock);
+}
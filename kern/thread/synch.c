@@ -33,12 +33,39 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kcache.h>
+
+/*
+ * Locks and CVs are created and destroyed often enough (every
+ * process, open file, and pid has some) that it's worth keeping
+ * them around with their wait channels already attached.
+ */
+static struct kcache *lock_cache;
+static struct kcache *cv_cache;
+
+static int lock_ctor(void *obj);
+static void lock_dtor(void *obj);
+static int cv_ctor(void *obj);
+static void cv_dtor(void *obj);
+
+void
+synch_bootstrap(void)
+{
+	lock_cache = kcache_create("lock", sizeof(struct lock),
+				   lock_ctor, lock_dtor);
+	cv_cache = kcache_create("cv", sizeof(struct cv), cv_ctor, cv_dtor);
+	if (lock_cache == NULL || cv_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
 
 ////////////////////////////////////////////////////////////
 //
@@ -138,32 +165,52 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Constructed state of a lock: unheld, with a wait channel.
+ */
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_wchan = wchan_create("lock");
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_lock);
+	lock->lk_holder = NULL;
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+	wchan_destroy(lock->lk_wchan);
+}
+
 struct lock *
 lock_create(const char *name)
 {
 	struct lock *lock;
 
-	lock = kmalloc(sizeof(*lock));
+	lock = kcache_alloc(lock_cache);
 	if (lock == NULL) {
 		return NULL;
 	}
 
 	lock->lk_name = kstrdup(name);
 	if (lock->lk_name == NULL) {
-		kfree(lock);
+		kcache_free(lock_cache, lock);
 		return NULL;
 	}
 
 	HANGMAN_LOCKABLEINIT(&lock->lk_hangman, lock->lk_name);
-
-	lock->lk_wchan = wchan_create(lock->lk_name);
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-	spinlock_init(&lock->lk_lock);
-	lock->lk_holder = NULL;
+	wchan_setname(lock->lk_wchan, lock->lk_name);
 
 	return lock;
 }
@@ -174,16 +221,38 @@ lock_destroy(struct lock *lock)
 	KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
-	spinlock_cleanup(&lock->lk_lock);
-	wchan_destroy(lock->lk_wchan);
+	wchan_setname(lock->lk_wchan, "lock");
 
 	kfree(lock->lk_name);
-	kfree(lock);
+	kcache_free(lock_cache, lock);
+}
+
+/*
+ * Check if the lock holder is running on some other cpu, in which
+ * case it's worth spinning. Must be called with lk_lock held; this
+ * guarantees the holder can't release the lock, and thus can't exit
+ * and be freed, while we look at it. The answer is only a hint.
+ */
+static
+bool
+lock_holder_running(struct lock *lock)
+{
+	struct thread *holder = lock->lk_holder;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+	return holder != NULL &&
+		holder->t_state == S_RUN &&
+		holder->t_cpu != curcpu->c_self;
 }
 
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	struct lockstats *ls;
+	unsigned spins = 0;
+	bool contended = false, slept = false;
+
 	DEBUGASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
 
@@ -193,12 +262,40 @@ lock_acquire(struct lock *lock)
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
 	KASSERT(lock->lk_holder != curthread);
-	while (lock->lk_holder != NULL) {
+	while ((holder = lock->lk_holder) != NULL) {
+		contended = true;
+		if (spins < LOCK_SPIN_MAX && lock_holder_running(lock)) {
+			/*
+			 * Spin without the spinlock (so the holder can
+			 * release) until the holder changes or we run
+			 * out of budget, then look again.
+			 */
+			spinlock_release(&lock->lk_lock);
+			while (lock->lk_holder == holder &&
+			       spins < LOCK_SPIN_MAX) {
+				spins++;
+			}
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
 		/* As in the semaphore. */
+		slept = true;
+		curcpu->c_lockstats.ls_sleeps++;
 		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
 	}
 	lock->lk_holder = curthread;
 
+	/* We hold lk_lock, so we can't migrate while updating these. */
+	ls = &curcpu->c_lockstats;
+	ls->ls_acquires++;
+	ls->ls_spins += spins;
+	if (contended) {
+		ls->ls_contended++;
+		if (!slept) {
+			ls->ls_spinwins++;
+		}
+	}
+
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
 
@@ -236,35 +333,96 @@ lock_do_i_hold(struct lock *lock)
 	return ret;
 }
 
+/*
+ * Lock statistics. Each cpu's counters are only updated by that cpu;
+ * reading them from here without locking may be slightly stale,
+ * which is fine for statistics.
+ */
+void
+lock_printstats(void)
+{
+	struct lockstats total, *ls;
+	unsigned i, n;
+
+	bzero(&total, sizeof(total));
+	n = cpu_count();
+	for (i=0; i<n; i++) {
+		ls = &cpu_get(i)->c_lockstats;
+		total.ls_acquires += ls->ls_acquires;
+		total.ls_contended += ls->ls_contended;
+		total.ls_spinwins += ls->ls_spinwins;
+		total.ls_sleeps += ls->ls_sleeps;
+		total.ls_spins += ls->ls_spins;
+	}
+
+	kprintf("Lock acquires:   %u\n", total.ls_acquires);
+	kprintf("  contended:     %u\n", total.ls_contended);
+	kprintf("  won spinning:  %u\n", total.ls_spinwins);
+	kprintf("  sleeps:        %u\n", total.ls_sleeps);
+	kprintf("  spin loops:    %u (budget %u per acquire)\n",
+		total.ls_spins, LOCK_SPIN_MAX);
+}
+
+void
+lock_clearstats(void)
+{
+	unsigned i, n;
+
+	n = cpu_count();
+	for (i=0; i<n; i++) {
+		bzero(&cpu_get(i)->c_lockstats, sizeof(struct lockstats));
+	}
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
 
 
+/*
+ * Constructed state of a CV: a wait channel and its spinlock.
+ */
+static
+int
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	cv->cv_wchan = wchan_create("cv");
+	if (cv->cv_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&cv->cv_wchanlock);
+	return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+	struct cv *cv = obj;
+
+	spinlock_cleanup(&cv->cv_wchanlock);
+	wchan_destroy(cv->cv_wchan);
+}
+
 struct cv *
 cv_create(const char *name)
 {
 	struct cv *cv;
 
-	cv = kmalloc(sizeof(*cv));
+	cv = kcache_alloc(cv_cache);
 	if (cv == NULL) {
 		return NULL;
 	}
 
 	cv->cv_name = kstrdup(name);
 	if (cv->cv_name==NULL) {
-		kfree(cv);
+		kcache_free(cv_cache, cv);
 		return NULL;
 	}
+	wchan_setname(cv->cv_wchan, cv->cv_name);
 
-	cv->cv_wchan = wchan_create(cv->cv_name);
-	if (cv->cv_wchan == NULL) {
-		kfree(cv->cv_name);
-		kfree(cv);
-		return NULL;
-	}
-
-	spinlock_init(&cv->cv_wchanlock);
 	return cv;
 }
 
@@ -273,11 +431,10 @@ cv_destroy(struct cv *cv)
 {
 	KASSERT(cv != NULL);
 
-	spinlock_cleanup(&cv->cv_wchanlock);
-	wchan_destroy(cv->cv_wchan);
+	wchan_setname(cv->cv_wchan, "cv");
 
 	kfree(cv->cv_name);
-	kfree(cv);
+	kcache_free(cv_cache, cv);
 }
 
 void
@@ -298,6 +455,19 @@ cv_wait(struct cv *cv, struct lock *lock)
 	lock_acquire(lock);
 }
 
+int
+cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks)
+{
+	int result;
+
+	spinlock_acquire(&cv->cv_wchanlock);
+	lock_release(lock);
+	result = wchan_sleep_timeout(cv->cv_wchan, &cv->cv_wchanlock, ticks);
+	spinlock_release(&cv->cv_wchanlock);
+	lock_acquire(lock);
+	return result;
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
@@ -315,3 +485,167 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rwlock;
+
+	rwlock = kmalloc(sizeof(*rwlock));
+	if (rwlock == NULL) {
+		return NULL;
+	}
+
+	rwlock->rwlk_name = kstrdup(name);
+	if (rwlock->rwlk_name == NULL) {
+		kfree(rwlock);
+		return NULL;
+	}
+
+	HANGMAN_LOCKABLEINIT(&rwlock->rwlk_hangman, rwlock->rwlk_name);
+
+	rwlock->rwlk_readwchan = wchan_create(rwlock->rwlk_name);
+	if (rwlock->rwlk_readwchan == NULL) {
+		kfree(rwlock->rwlk_name);
+		kfree(rwlock);
+		return NULL;
+	}
+	rwlock->rwlk_writewchan = wchan_create(rwlock->rwlk_name);
+	if (rwlock->rwlk_writewchan == NULL) {
+		wchan_destroy(rwlock->rwlk_readwchan);
+		kfree(rwlock->rwlk_name);
+		kfree(rwlock);
+		return NULL;
+	}
+
+	spinlock_init(&rwlock->rwlk_lock);
+	rwlock->rwlk_readers = 0;
+	rwlock->rwlk_waitingwriters = 0;
+	rwlock->rwlk_writer = NULL;
+
+	return rwlock;
+}
+
+void
+rwlock_destroy(struct rwlock *rwlock)
+{
+	KASSERT(rwlock != NULL);
+
+	KASSERT(rwlock->rwlk_readers == 0);
+	KASSERT(rwlock->rwlk_waitingwriters == 0);
+	KASSERT(rwlock->rwlk_writer == NULL);
+	spinlock_cleanup(&rwlock->rwlk_lock);
+	wchan_destroy(rwlock->rwlk_writewchan);
+	wchan_destroy(rwlock->rwlk_readwchan);
+
+	kfree(rwlock->rwlk_name);
+	kfree(rwlock);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rwlock)
+{
+	DEBUGASSERT(rwlock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rwlock->rwlk_lock);
+
+	HANGMAN_WAIT(&curthread->t_hangman, &rwlock->rwlk_hangman);
+
+	KASSERT(rwlock->rwlk_writer != curthread);
+	/* Wait for the writer, and also defer to waiting writers. */
+	while (rwlock->rwlk_writer != NULL ||
+	       rwlock->rwlk_waitingwriters > 0) {
+		wchan_sleep(rwlock->rwlk_readwchan, &rwlock->rwlk_lock);
+	}
+	rwlock->rwlk_readers++;
+
+	HANGMAN_STOPWAIT(&curthread->t_hangman, &rwlock->rwlk_hangman);
+
+	spinlock_release(&rwlock->rwlk_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rwlock)
+{
+	DEBUGASSERT(rwlock != NULL);
+
+	spinlock_acquire(&rwlock->rwlk_lock);
+
+	KASSERT(rwlock->rwlk_readers > 0);
+	KASSERT(rwlock->rwlk_writer == NULL);
+	rwlock->rwlk_readers--;
+	if (rwlock->rwlk_readers == 0 && rwlock->rwlk_waitingwriters > 0) {
+		wchan_wakeone(rwlock->rwlk_writewchan, &rwlock->rwlk_lock);
+	}
+
+	spinlock_release(&rwlock->rwlk_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rwlock)
+{
+	DEBUGASSERT(rwlock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rwlock->rwlk_lock);
+
+	HANGMAN_WAIT(&curthread->t_hangman, &rwlock->rwlk_hangman);
+
+	KASSERT(rwlock->rwlk_writer != curthread);
+	rwlock->rwlk_waitingwriters++;
+	while (rwlock->rwlk_writer != NULL || rwlock->rwlk_readers > 0) {
+		wchan_sleep(rwlock->rwlk_writewchan, &rwlock->rwlk_lock);
+	}
+	rwlock->rwlk_waitingwriters--;
+	rwlock->rwlk_writer = curthread;
+
+	HANGMAN_ACQUIRE(&curthread->t_hangman, &rwlock->rwlk_hangman);
+
+	spinlock_release(&rwlock->rwlk_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rwlock)
+{
+	DEBUGASSERT(rwlock != NULL);
+
+	spinlock_acquire(&rwlock->rwlk_lock);
+
+	KASSERT(rwlock->rwlk_writer == curthread);
+	KASSERT(rwlock->rwlk_readers == 0);
+	rwlock->rwlk_writer = NULL;
+
+	/*
+	 * Hand off to the next writer if there is one; otherwise let
+	 * in all the readers that piled up behind us.
+	 */
+	if (rwlock->rwlk_waitingwriters > 0) {
+		wchan_wakeone(rwlock->rwlk_writewchan, &rwlock->rwlk_lock);
+	}
+	else {
+		wchan_wakeall(rwlock->rwlk_readwchan, &rwlock->rwlk_lock);
+	}
+
+	HANGMAN_RELEASE(&curthread->t_hangman, &rwlock->rwlk_hangman);
+
+	spinlock_release(&rwlock->rwlk_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rwlock)
+{
+	bool ret;
+
+	DEBUGASSERT(rwlock != NULL);
+
+	spinlock_acquire(&rwlock->rwlk_lock);
+	ret = (rwlock->rwlk_writer == curthread);
+	spinlock_release(&rwlock->rwlk_lock);
+
+	return ret;
+}
@@ -53,6 +53,7 @@
 #include <mainbus.h>
 #include <vnode.h>
 #include <pid.h>
+#include <clock.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -134,6 +135,7 @@ thread_create(const char *name)
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
+	thread->t_wchan = NULL;
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
@@ -182,6 +184,8 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	timerwheel_init(&c->c_timerwheel);
+	bzero(&c->c_lockstats, sizeof(c->c_lockstats));
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -255,6 +259,21 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Cpu lookup for code outside the thread system.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned n)
+{
+	return cpuarray_get(&allcpus, n);
+}
+
 /*
  * Destroy a thread.
  *
@@ -614,6 +633,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		 * caller of wchan_sleep locked it until the thread is
 		 * on the list.
 		 */
+		cur->t_wchan = wc;
 		threadlist_addtail(&wc->wc_threads, cur);
 		spinlock_release(lk);
 		break;
@@ -996,6 +1016,17 @@ wchan_destroy(struct wchan *wc)
 	kfree(wc);
 }
 
+/*
+ * Rename a wait channel. Nobody may be sleeping on it, as sleepers
+ * have a copy of the old name in t_wchan_name.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	wc->wc_name = name;
+}
+
 /*
  * Yield the cpu to another process, and go to sleep, on the specified
  * wait channel WC, whose associated spinlock is LK. Calling wakeup on
@@ -1019,6 +1050,83 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(lk);
 }
 
+/*
+ * State shared between wchan_sleep_timeout and its timeout function.
+ * Lives on the sleeping thread's stack.
+ */
+struct wchan_timeout {
+	struct thread *wt_thread;
+	struct wchan *wt_wchan;
+	struct spinlock *wt_lock;
+	bool wt_expired;
+};
+
+/*
+ * Timeout function for wchan_sleep_timeout. If the thread is still on
+ * the channel, pull it off and wake it; otherwise somebody else got
+ * there first.
+ */
+static
+void
+wchan_timeout_expire(void *data)
+{
+	struct wchan_timeout *wt = data;
+	struct thread *target = wt->wt_thread;
+
+	spinlock_acquire(wt->wt_lock);
+	if (target->t_wchan == wt->wt_wchan) {
+		threadlist_remove(&wt->wt_wchan->wc_threads, target);
+		target->t_wchan = NULL;
+		wt->wt_expired = true;
+		thread_make_runnable(target, false);
+	}
+	spinlock_release(wt->wt_lock);
+}
+
+/*
+ * Like wchan_sleep, but give up after TICKS hardclocks.
+ */
+int
+wchan_sleep_timeout(struct wchan *wc, struct spinlock *lk, unsigned ticks)
+{
+	struct wchan_timeout wt;
+	struct timeout to;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+
+	/* must hold the spinlock */
+	KASSERT(spinlock_do_i_hold(lk));
+
+	/* must not hold other spinlocks */
+	KASSERT(curcpu->c_spinlocks == 1);
+
+	wt.wt_thread = curthread;
+	wt.wt_wchan = wc;
+	wt.wt_lock = lk;
+	wt.wt_expired = false;
+
+	/*
+	 * Holding LK keeps the timeout from running until we're on
+	 * the channel: it runs on this cpu, where interrupts are off,
+	 * and it takes LK anyway.
+	 */
+	timeout_init(&to, wchan_timeout_expire, &wt);
+	timeout_add(&to, ticks);
+
+	thread_switch(S_SLEEP, wc, lk);
+
+	/*
+	 * Cancel the timeout (or wait for it to finish running) before
+	 * retaking LK; the timeout function needs LK, and both WT and
+	 * TO are about to go out of scope.
+	 */
+	timeout_del(&to);
+
+	spinlock_acquire(lk);
+	return wt.wt_expired ? ETIMEDOUT : 0;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1036,6 +1144,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 		/* Nobody was sleeping. */
 		return;
 	}
+	target->t_wchan = NULL;
 
 	/*
 	 * Note that thread_make_runnable acquires a runqueue lock
@@ -1066,6 +1175,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * private list.
 	 */
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+		target->t_wchan = NULL;
 		threadlist_addtail(&list, target);
 	}
 
@@ -0,0 +1,1246 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Buffer cache.
+ *
+ * Every buffer in existence is on the LRU list, least recently used
+ * first; buffers attached to a block are also on a hash chain keyed
+ * by (device, block). Detached buffers (ones whose contents were
+ * discarded) go to the front of the LRU list so they get reused
+ * first.
+ *
+ * All of this is protected by buffer_lock. A buffer is held by at
+ * most one thread at a time (b_holder); threads that want a held
+ * buffer wait on buffer_cv. Device I/O is done with the buffer held
+ * but without buffer_lock, so one slow disk doesn't stall lookups
+ * on everything else. That means the world can change while a
+ * thread is doing I/O, and lookups have to be rechecked afterwards.
+ *
+ * Read-ahead requests are queued for a kernel thread that reads them
+ * into the cache in the background, so the disk can be working on
+ * the next blocks while the caller consumes the current ones.
+ *
+ * Another thread, the syncer, runs vfs_sync every BUFFER_SYNCINTERVAL
+ * seconds, and in between writes back old dirty buffers whenever
+ * too many pile up. Dirty buffers are always written in ascending
+ * block order, so a flush is one sweep across the disk rather than a
+ * seek per buffer.
+ *
+ * Both the flush and the read-ahead thread gather buffers for
+ * consecutive blocks into runs and move each run with a single
+ * device request, so the driver sees fewer, larger transfers.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <current.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
+#include <thread.h>
+#include <vfs.h>
+#include <device.h>
+#include <buf.h>
+
+/*
+ * Limits on the size of the cache: this and BUFFER_MAXBYTES (in
+ * buf.h). Buffers are created on demand until either limit is
+ * reached; after that the least recently used buffer that isn't held
+ * or pinned is recycled.
+ */
+#define BUFFER_MAXBUFS		256
+
+/* Number of hash chains. (Prime.) */
+#define BUFFER_HASHSIZE		127
+
+/* Maximum number of outstanding read-ahead requests. */
+#define BUFFER_RAQUEUESIZE	64
+
+/* Most buffers, and most bytes, moved in one device request. */
+#define BUFFER_MAXRUN		16
+#define BUFFER_MAXRUNBYTES	(32*1024)
+
+/*
+ * Syncer parameters: how often (in seconds) it syncs everything, and
+ * the amounts of dirty data, in bytes, at which it starts and stops
+ * flushing early. (Bytes rather than buffers, as with big blocks the
+ * cache holds few buffers.)
+ */
+#define BUFFER_SYNCINTERVAL	10
+#define BUFFER_DIRTYHIGH	(BUFFER_MAXBYTES / 2)
+#define BUFFER_DIRTYLOW		(BUFFER_MAXBYTES / 4)
+
+struct buf {
+	/* What we hold; b_dev is NULL when not attached to a block */
+	struct device *b_dev;
+	daddr_t b_block;
+	size_t b_size;
+	void *b_data;
+
+	/* State */
+	bool b_valid;			/* data is good */
+	bool b_dirty;			/* data needs writing back */
+	struct thread *b_holder;	/* who has it, or NULL */
+	unsigned b_pincount;		/* don't evict if nonzero */
+	bool b_nowriteback;		/* don't write back or evict */
+
+	/* Linkage */
+	struct buf *b_hashnext;
+	struct buf *b_lruprev;
+	struct buf *b_lrunext;
+};
+
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;
+
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf *buffer_lruhead;	/* least recently used */
+static struct buf *buffer_lrutail;	/* most recently used */
+
+static unsigned buffer_nbufs;
+static size_t buffer_nbytes;
+static size_t buffer_dirtybytes;
+
+static void buffer_syncer_kick(void);
+
+/*
+ * Read-ahead queue (a ring). buffer_racv wakes the read-ahead thread;
+ * buffer_radev is the device it's working on, if any.
+ */
+struct buf_rareq {
+	struct device *rr_dev;
+	daddr_t rr_block;
+	size_t rr_size;
+};
+static struct buf_rareq buffer_raqueue[BUFFER_RAQUEUESIZE];
+static unsigned buffer_rahead, buffer_racount;
+static struct device *buffer_radev;
+static struct cv *buffer_racv;
+static bool buffer_rastarted, buffer_rarunning;
+
+/*
+ * The syncer sleeps on buffer_syncer_wchan; buffer_syncer_kicked says
+ * it was woken because there are too many dirty buffers.
+ */
+static struct spinlock buffer_syncer_lock;
+static struct wchan *buffer_syncer_wchan;
+static bool buffer_syncer_kicked;
+
+////////////////////////////////////////////////////////////
+// List handling
+
+static
+unsigned
+buffer_hashfn(struct device *dev, daddr_t block)
+{
+	return (((uintptr_t)dev >> 4) + block) % BUFFER_HASHSIZE;
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buffer_hash[buffer_hashfn(dev, block)];
+	     b != NULL; b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buffer_hashinsert(struct buf *b)
+{
+	unsigned ix = buffer_hashfn(b->b_dev, b->b_block);
+
+	b->b_hashnext = buffer_hash[ix];
+	buffer_hash[ix] = b;
+}
+
+static
+void
+buffer_hashremove(struct buf *b)
+{
+	struct buf **p;
+
+	for (p = &buffer_hash[buffer_hashfn(b->b_dev, b->b_block)];
+	     *p != NULL; p = &(*p)->b_hashnext) {
+		if (*p == b) {
+			*p = b->b_hashnext;
+			b->b_hashnext = NULL;
+			return;
+		}
+	}
+	panic("buffer: %p not on its hash chain\n", b);
+}
+
+static
+void
+buffer_lruremove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		KASSERT(buffer_lruhead == b);
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		KASSERT(buffer_lrutail == b);
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+buffer_lruaddhead(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buffer_lruhead;
+	if (buffer_lruhead != NULL) {
+		buffer_lruhead->b_lruprev = b;
+	}
+	else {
+		buffer_lrutail = b;
+	}
+	buffer_lruhead = b;
+}
+
+static
+void
+buffer_lruaddtail(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buffer_lrutail;
+	if (buffer_lrutail != NULL) {
+		buffer_lrutail->b_lrunext = b;
+	}
+	else {
+		buffer_lruhead = b;
+	}
+	buffer_lrutail = b;
+}
+
+/*
+ * Throw away a buffer's identity and contents and queue it for reuse.
+ */
+static
+void
+buffer_detach(struct buf *b)
+{
+	KASSERT(b->b_pincount == 0);
+
+	if (b->b_dev != NULL) {
+		buffer_hashremove(b);
+		b->b_dev = NULL;
+	}
+	if (b->b_dirty) {
+		KASSERT(buffer_dirtybytes >= b->b_size);
+		buffer_dirtybytes -= b->b_size;
+		b->b_dirty = false;
+	}
+	b->b_valid = false;
+	b->b_nowriteback = false;
+	buffer_lruremove(b);
+	buffer_lruaddhead(b);
+}
+
+/*
+ * Let go of a held buffer and wake anyone waiting for it.
+ */
+static
+void
+buffer_unhold(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+	b->b_holder = NULL;
+	cv_broadcast(buffer_cv, buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// I/O
+
+/*
+ * Read or write a run of N held buffers for consecutive blocks of one
+ * device as a single request, retrying I/O errors. Called without
+ * buffer_lock.
+ */
+static
+int
+buffer_iorun(struct buf *const *run, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[BUFFER_MAXRUN];
+	struct uio ku;
+	struct buf *b = run[0];
+	daddr_t last = b->b_block + n - 1;
+	size_t len;
+	unsigned i;
+	int result;
+	int tries = 0;
+
+	KASSERT(n > 0 && n <= BUFFER_MAXRUN);
+	KASSERT(b->b_dev != NULL);
+	for (i=0; i<n; i++) {
+		KASSERT(run[i]->b_holder == curthread);
+		KASSERT(run[i]->b_dev == b->b_dev);
+		KASSERT(run[i]->b_block == b->b_block + i);
+		KASSERT(run[i]->b_size == b->b_size);
+	}
+
+	DEBUG(DB_VFS, "buffer: %s %u-%u\n",
+	      rw == UIO_READ ? "read" : "write", b->b_block, last);
+
+ retry:
+	len = 0;
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = run[i]->b_data;
+		iov[i].iov_len = run[i]->b_size;
+		len += run[i]->b_size;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = ((off_t)b->b_block) * b->b_size;
+	ku.uio_resid = len;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+	result = DEVOP_IO(b->b_dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * The block was out of range, or misaligned, or
+		 * something else that's the caller's fault.
+		 */
+		panic("buffer: device %u blocks %u-%u: "
+		      "DEVOP_IO returned EINVAL\n",
+		      (unsigned)b->b_dev->d_devnumber, b->b_block, last);
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buffer: device %u blocks %u-%u: I/O error, "
+				"retrying\n",
+				(unsigned)b->b_dev->d_devnumber, b->b_block,
+				last);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buffer: device %u blocks %u-%u: I/O error, "
+				"giving up after %d retries\n",
+				(unsigned)b->b_dev->d_devnumber, b->b_block,
+				last, tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Read or write a single held buffer.
+ */
+static
+int
+buffer_io(struct buf *b, enum uio_rw rw)
+{
+	return buffer_iorun(&b, 1, rw);
+}
+
+/*
+ * Write out a run of N held dirty buffers (as for buffer_iorun).
+ * Drops buffer_lock during the I/O.
+ */
+static
+int
+buffer_writerun(struct buf *const *run, unsigned n)
+{
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	for (i=0; i<n; i++) {
+		KASSERT(run[i]->b_dirty);
+	}
+
+	lock_release(buffer_lock);
+	result = buffer_iorun(run, n, UIO_WRITE);
+	lock_acquire(buffer_lock);
+
+	if (result == 0) {
+		for (i=0; i<n; i++) {
+			KASSERT(buffer_dirtybytes >= run[i]->b_size);
+			buffer_dirtybytes -= run[i]->b_size;
+			run[i]->b_dirty = false;
+		}
+	}
+	return result;
+}
+
+/*
+ * Write out a held dirty buffer. Drops buffer_lock during the I/O.
+ */
+static
+int
+buffer_writeout(struct buf *b)
+{
+	return buffer_writerun(&b, 1);
+}
+
+/*
+ * Write out dirty buffers for DEV (or all devices, if DEV is NULL) in
+ * ascending (device, block) order, until there are no more than
+ * LOWWATER bytes of dirty buffers in the cache. Dirty buffers for the blocks
+ * right after the one chosen go along with it in one run.
+ *
+ * If WAIT is set, wait for held buffers and stop at the first error;
+ * otherwise skip held buffers and ones that fail to write.
+ */
+static
+int
+buffer_sweep(struct device *dev, size_t lowwater, bool wait)
+{
+	struct buf *b, *best;
+	struct buf *run[BUFFER_MAXRUN];
+	struct device *curdev;
+	daddr_t cursor;
+	size_t runbytes;
+	unsigned i, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	/* Sort key: device, then block; (curdev, cursor) is the next */
+#define BUFFER_BEFORE(d1, b1, d2, b2) \
+	((uintptr_t)(d1) < (uintptr_t)(d2) || ((d1) == (d2) && (b1) < (b2)))
+
+	curdev = NULL;
+	cursor = 0;
+	while (buffer_dirtybytes > lowwater) {
+		best = NULL;
+		for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+			if (!b->b_dirty || b->b_nowriteback) {
+				continue;
+			}
+			if (dev != NULL && b->b_dev != dev) {
+				continue;
+			}
+			if (BUFFER_BEFORE(b->b_dev, b->b_block,
+					  curdev, cursor)) {
+				continue;
+			}
+			if (best == NULL ||
+			    BUFFER_BEFORE(b->b_dev, b->b_block,
+					  best->b_dev, best->b_block)) {
+				best = b;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+
+		if (best->b_holder != NULL && wait) {
+			/* Someone's using it; wait, then look again */
+			KASSERT(best->b_holder != curthread);
+			cv_wait(buffer_cv, buffer_lock);
+			continue;
+		}
+
+		curdev = best->b_dev;
+		cursor = best->b_block + 1;
+		if (best->b_holder != NULL) {
+			continue;
+		}
+
+		best->b_holder = curthread;
+		run[0] = best;
+		runbytes = best->b_size;
+		for (n = 1; n < BUFFER_MAXRUN; n++) {
+			if (runbytes + best->b_size > BUFFER_MAXRUNBYTES) {
+				break;
+			}
+			b = buffer_find(best->b_dev, best->b_block + n);
+			if (b == NULL || !b->b_dirty || b->b_nowriteback ||
+			    b->b_holder != NULL) {
+				break;
+			}
+			KASSERT(b->b_size == best->b_size);
+			b->b_holder = curthread;
+			run[n] = b;
+			runbytes += b->b_size;
+		}
+		cursor = best->b_block + n;
+
+		result = buffer_writerun(run, n);
+		for (i=0; i<n; i++) {
+			buffer_unhold(run[i]);
+		}
+		if (result && wait) {
+			return result;
+		}
+	}
+#undef BUFFER_BEFORE
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Getting buffers
+
+/*
+ * Make a new buffer of SIZE bytes. It comes back detached and held.
+ */
+static
+int
+buffer_create(size_t size, struct buf **ret)
+{
+	struct buf *b;
+
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return ENOMEM;
+	}
+	b->b_data = kmalloc(size);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return ENOMEM;
+	}
+	b->b_dev = NULL;
+	b->b_block = 0;
+	b->b_size = size;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_holder = curthread;
+	b->b_pincount = 0;
+	b->b_nowriteback = false;
+	b->b_hashnext = NULL;
+	buffer_lruaddhead(b);
+
+	buffer_nbufs++;
+	buffer_nbytes += size;
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Free a detached, held buffer.
+ */
+static
+void
+buffer_destroy(struct buf *b)
+{
+	KASSERT(b->b_dev == NULL);
+	KASSERT(b->b_holder == curthread);
+
+	buffer_lruremove(b);
+	buffer_nbufs--;
+	buffer_nbytes -= b->b_size;
+	kfree(b->b_data);
+	kfree(b);
+}
+
+/*
+ * Find a buffer of SIZE bytes to use for a block that isn't in the
+ * cache: a new one if we're under the limits, otherwise the least
+ * recently used one we're allowed to evict, written back first if
+ * it's dirty. It comes back detached and held.
+ *
+ * If everything is held, pinned, or held back, go over the limit
+ * rather than wait; the holders might be waiting for us.
+ */
+static
+int
+buffer_reclaim(size_t size, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	if (buffer_nbufs < BUFFER_MAXBUFS &&
+	    buffer_nbytes + size <= BUFFER_MAXBYTES) {
+		return buffer_create(size, ret);
+	}
+
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_holder == NULL && b->b_pincount == 0 &&
+		    !b->b_nowriteback) {
+			break;
+		}
+	}
+	if (b == NULL) {
+		return buffer_create(size, ret);
+	}
+
+	b->b_holder = curthread;
+	if (b->b_dirty) {
+		result = buffer_writeout(b);
+		if (result) {
+			buffer_unhold(b);
+			return result;
+		}
+	}
+	buffer_detach(b);
+
+	if (b->b_size != size) {
+		buffer_destroy(b);
+		cv_broadcast(buffer_cv, buffer_lock);
+		return buffer_create(size, ret);
+	}
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Common code for buffer_read and buffer_get: find or make the
+ * buffer for (DEV, BLOCK) and hold it.
+ */
+static
+int
+buffer_acquire(struct device *dev, daddr_t block, size_t size,
+	       struct buf **ret)
+{
+	struct buf *b, *nb;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+ again:
+	b = buffer_find(dev, block);
+	if (b != NULL) {
+		if (b->b_holder != NULL) {
+			/* Asking twice for the same block would deadlock */
+			KASSERT(b->b_holder != curthread);
+			cv_wait(buffer_cv, buffer_lock);
+			goto again;
+		}
+		KASSERT(b->b_size == size);
+		b->b_holder = curthread;
+		*ret = b;
+		return 0;
+	}
+
+	result = buffer_reclaim(size, &nb);
+	if (result) {
+		return result;
+	}
+
+	/* We may have slept; someone else may have loaded the block. */
+	if (buffer_find(dev, block) != NULL) {
+		buffer_unhold(nb);
+		goto again;
+	}
+
+	nb->b_dev = dev;
+	nb->b_block = block;
+	buffer_hashinsert(nb);
+	*ret = nb;
+	return 0;
+}
+
+int
+buffer_read(struct device *dev, daddr_t block, size_t size,
+	    struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buffer_lock);
+	result = buffer_acquire(dev, block, size, &b);
+	if (result) {
+		lock_release(buffer_lock);
+		return result;
+	}
+
+	if (!b->b_valid) {
+		lock_release(buffer_lock);
+		result = buffer_io(b, UIO_READ);
+		lock_acquire(buffer_lock);
+		if (result) {
+			buffer_detach(b);
+			buffer_unhold(b);
+			lock_release(buffer_lock);
+			return result;
+		}
+		b->b_valid = true;
+	}
+	lock_release(buffer_lock);
+
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, size_t size,
+	   struct buf **ret)
+{
+	int result;
+
+	lock_acquire(buffer_lock);
+	result = buffer_acquire(dev, block, size, ret);
+	lock_release(buffer_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Using buffers
+
+/*
+ * These only touch fields that belong to the holder, so they don't
+ * need buffer_lock.
+ */
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+	return b->b_data;
+}
+
+daddr_t
+buffer_blocknum(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+	KASSERT(b->b_dev != NULL);
+	return b->b_block;
+}
+
+bool
+buffer_is_valid(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+	return b->b_valid;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+	b->b_valid = true;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	bool kick = false;
+
+	KASSERT(b->b_holder == curthread);
+	b->b_valid = true;
+	if (!b->b_dirty) {
+		lock_acquire(buffer_lock);
+		b->b_dirty = true;
+		buffer_dirtybytes += b->b_size;
+		kick = (buffer_dirtybytes >= BUFFER_DIRTYHIGH);
+		lock_release(buffer_lock);
+	}
+	if (kick) {
+		buffer_syncer_kick();
+	}
+}
+
+void
+buffer_pin(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+	b->b_pincount++;
+}
+
+void
+buffer_unpin(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+	KASSERT(b->b_pincount > 0);
+	b->b_pincount--;
+}
+
+bool
+buffer_hold_writeback(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+	KASSERT(b->b_dev != NULL);
+	if (b->b_nowriteback) {
+		return false;
+	}
+	b->b_nowriteback = true;
+	return true;
+}
+
+void
+buffer_allow_writeback(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+	KASSERT(b->b_nowriteback);
+	b->b_nowriteback = false;
+}
+
+/*
+ * Release with buffer_lock held.
+ */
+static
+void
+buffer_release_locked(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_holder == curthread);
+
+	if (b->b_valid) {
+		buffer_lruremove(b);
+		buffer_lruaddtail(b);
+	}
+	else {
+		/* Never filled in (or discarded); don't keep it */
+		KASSERT(!b->b_dirty);
+		buffer_detach(b);
+	}
+	buffer_unhold(b);
+}
+
+void
+buffer_release(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+
+	lock_acquire(buffer_lock);
+	buffer_release_locked(b);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_release_and_invalidate(struct buf *b)
+{
+	KASSERT(b->b_holder == curthread);
+
+	lock_acquire(buffer_lock);
+	buffer_detach(b);
+	buffer_unhold(b);
+	lock_release(buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Whole-cache operations
+
+void
+buffer_drop(struct device *dev, daddr_t block, size_t size)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+ again:
+	b = buffer_find(dev, block);
+	if (b != NULL) {
+		if (b->b_holder != NULL) {
+			KASSERT(b->b_holder != curthread);
+			cv_wait(buffer_cv, buffer_lock);
+			goto again;
+		}
+		KASSERT(b->b_size == size);
+		buffer_detach(b);
+	}
+	lock_release(buffer_lock);
+}
+
+int
+buffer_sync(struct device *dev)
+{
+	int result;
+
+	lock_acquire(buffer_lock);
+	result = buffer_sweep(dev, 0, true);
+	lock_release(buffer_lock);
+	return result;
+}
+
+/*
+ * Write back whichever of the NBLOCKS blocks in BLOCKS are cached and
+ * dirty, in block order. Sorts BLOCKS in place. This is for fsync,
+ * which only needs one file's blocks on disk.
+ */
+int
+buffer_syncblocks(struct device *dev, daddr_t *blocks, unsigned nblocks,
+		  size_t size)
+{
+	struct buf *b;
+	daddr_t tmp;
+	unsigned i, j;
+	int result;
+
+	/* Insertion sort; there aren't many */
+	for (i=1; i<nblocks; i++) {
+		tmp = blocks[i];
+		for (j=i; j>0 && blocks[j-1] > tmp; j--) {
+			blocks[j] = blocks[j-1];
+		}
+		blocks[j] = tmp;
+	}
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<nblocks; i++) {
+ again:
+		b = buffer_find(dev, blocks[i]);
+		if (b == NULL || !b->b_dirty || b->b_nowriteback) {
+			continue;
+		}
+		if (b->b_holder != NULL) {
+			KASSERT(b->b_holder != curthread);
+			cv_wait(buffer_cv, buffer_lock);
+			goto again;
+		}
+		KASSERT(b->b_size == size);
+		b->b_holder = curthread;
+		result = buffer_writeout(b);
+		buffer_unhold(b);
+		if (result) {
+			lock_release(buffer_lock);
+			return result;
+		}
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+void
+buffer_drop_device(struct device *dev)
+{
+	struct buf *b, *next;
+	unsigned i, n, ix;
+
+	lock_acquire(buffer_lock);
+
+	/* Cancel queued read-ahead for the device... */
+	n = buffer_racount;
+	buffer_racount = 0;
+	for (i=0; i<n; i++) {
+		ix = (buffer_rahead + i) % BUFFER_RAQUEUESIZE;
+		if (buffer_raqueue[ix].rr_dev != dev) {
+			buffer_raqueue[(buffer_rahead + buffer_racount) %
+				       BUFFER_RAQUEUESIZE] = buffer_raqueue[ix];
+			buffer_racount++;
+		}
+	}
+	/* ...and wait for any that's in progress. */
+	while (buffer_radev == dev) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+
+	for (b = buffer_lruhead; b != NULL; b = next) {
+		next = b->b_lrunext;
+		if (b->b_dev != dev) {
+			continue;
+		}
+		KASSERT(b->b_holder == NULL);
+		KASSERT(!b->b_dirty);
+		KASSERT(!b->b_nowriteback);
+		buffer_detach(b);
+	}
+	lock_release(buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Read-ahead
+
+/*
+ * Check if the next queued read-ahead request is for block NEXT of
+ * the same device and size as buffer FIRST, and that block isn't
+ * cached.
+ */
+static
+bool
+buffer_ranext(struct buf *first, daddr_t next)
+{
+	struct buf_rareq *req;
+
+	if (buffer_racount == 0) {
+		return false;
+	}
+	req = &buffer_raqueue[buffer_rahead];
+	return req->rr_dev == first->b_dev && req->rr_block == next &&
+		req->rr_size == first->b_size &&
+		buffer_find(req->rr_dev, next) == NULL;
+}
+
+/*
+ * Extend a read-ahead run of N buffers, starting with RUN[0], with
+ * the next queued request if that's for the following block. Returns
+ * the new length of the run.
+ */
+static
+unsigned
+buffer_raextend(struct buf **run, unsigned n)
+{
+	daddr_t next = run[0]->b_block + n;
+	struct buf *nb;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	if (n >= BUFFER_MAXRUN ||
+	    (n + 1) * run[0]->b_size > BUFFER_MAXRUNBYTES) {
+		return n;
+	}
+	if (!buffer_ranext(run[0], next)) {
+		return n;
+	}
+	if (buffer_reclaim(run[0]->b_size, &nb)) {
+		return n;
+	}
+	/* Reclaiming may have slept; check again */
+	if (!buffer_ranext(run[0], next)) {
+		buffer_unhold(nb);
+		return n;
+	}
+
+	buffer_rahead = (buffer_rahead + 1) % BUFFER_RAQUEUESIZE;
+	buffer_racount--;
+
+	nb->b_dev = run[0]->b_dev;
+	nb->b_block = next;
+	buffer_hashinsert(nb);
+	run[n] = nb;
+	return n + 1;
+}
+
+/*
+ * The read-ahead thread. Requests for consecutive blocks that aren't
+ * cached yet are read together as one run.
+ */
+static
+void
+buffer_rathread(void *unused1, unsigned long unused2)
+{
+	struct buf_rareq req;
+	struct buf *run[BUFFER_MAXRUN];
+	unsigned i, n, m;
+	int result;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		while (buffer_racount == 0) {
+			cv_wait(buffer_racv, buffer_lock);
+		}
+		req = buffer_raqueue[buffer_rahead];
+		buffer_rahead = (buffer_rahead + 1) % BUFFER_RAQUEUESIZE;
+		buffer_racount--;
+		buffer_radev = req.rr_dev;
+
+		result = buffer_acquire(req.rr_dev, req.rr_block,
+					req.rr_size, &run[0]);
+		if (result == 0) {
+			n = 1;
+			if (!run[0]->b_valid) {
+				while ((m = buffer_raextend(run, n)) > n) {
+					n = m;
+				}
+				lock_release(buffer_lock);
+				result = buffer_iorun(run, n, UIO_READ);
+				lock_acquire(buffer_lock);
+				for (i=0; result == 0 && i<n; i++) {
+					run[i]->b_valid = true;
+				}
+			}
+			for (i=0; i<n; i++) {
+				buffer_release_locked(run[i]);
+			}
+		}
+
+		buffer_radev = NULL;
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+}
+
+/*
+ * Ask for BLOCK to be read into the cache in the background. This is
+ * only a hint; it's dropped if the block is already cached or the
+ * queue is full.
+ */
+void
+buffer_readahead(struct device *dev, daddr_t block, size_t size)
+{
+	struct buf_rareq *req;
+	int result;
+
+	lock_acquire(buffer_lock);
+
+	if (!buffer_rastarted) {
+		/* Only try once; if we can't, just go without. */
+		buffer_rastarted = true;
+		result = thread_fork("readahead", NULL, buffer_rathread,
+				     NULL, 0);
+		if (result) {
+			kprintf("buffer: cannot start read-ahead thread: %s\n",
+				strerror(result));
+		}
+		else {
+			buffer_rarunning = true;
+		}
+	}
+
+	if (buffer_rarunning && buffer_racount < BUFFER_RAQUEUESIZE &&
+	    buffer_find(dev, block) == NULL) {
+		req = &buffer_raqueue[(buffer_rahead + buffer_racount) %
+				      BUFFER_RAQUEUESIZE];
+		req->rr_dev = dev;
+		req->rr_block = block;
+		req->rr_size = size;
+		buffer_racount++;
+		cv_signal(buffer_racv, buffer_lock);
+	}
+
+	lock_release(buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Syncer
+
+/*
+ * Wake the syncer early because dirty buffers are piling up.
+ */
+static
+void
+buffer_syncer_kick(void)
+{
+	spinlock_acquire(&buffer_syncer_lock);
+	if (!buffer_syncer_kicked) {
+		buffer_syncer_kicked = true;
+		wchan_wakeone(buffer_syncer_wchan, &buffer_syncer_lock);
+	}
+	spinlock_release(&buffer_syncer_lock);
+}
+
+/*
+ * The syncer thread.
+ */
+static
+void
+buffer_syncer(void *unused1, unsigned long unused2)
+{
+	struct timespec now, deadline, left, interval;
+	bool kicked;
+
+	(void)unused1;
+	(void)unused2;
+
+	interval.tv_sec = BUFFER_SYNCINTERVAL;
+	interval.tv_nsec = 0;
+	gettime(&now);
+	timespec_add(&now, &interval, &deadline);
+
+	while (1) {
+		spinlock_acquire(&buffer_syncer_lock);
+		if (!buffer_syncer_kicked) {
+			gettime(&now);
+			timespec_sub(&deadline, &now, &left);
+			if (left.tv_sec > 0 ||
+			    (left.tv_sec == 0 && left.tv_nsec > 0)) {
+				wchan_sleep_timeout(buffer_syncer_wchan,
+						    &buffer_syncer_lock,
+						    timespec_to_ticks(&left));
+			}
+		}
+		kicked = buffer_syncer_kicked;
+		buffer_syncer_kicked = false;
+		spinlock_release(&buffer_syncer_lock);
+
+		if (kicked) {
+			/* Just get the amount dirty back down */
+			lock_acquire(buffer_lock);
+			buffer_sweep(NULL, BUFFER_DIRTYLOW, false);
+			lock_release(buffer_lock);
+		}
+
+		gettime(&now);
+		timespec_sub(&deadline, &now, &left);
+		if (left.tv_sec < 0 || (left.tv_sec == 0 && left.tv_nsec == 0)) {
+			/*
+			 * Time for the regular sync. First write what's
+			 * already in the cache, without holding up the
+			 * file systems; then go through them, so inodes
+			 * and freemaps get written too. That second pass
+			 * should leave little to write.
+			 */
+			lock_acquire(buffer_lock);
+			buffer_sweep(NULL, 0, false);
+			lock_release(buffer_lock);
+			vfs_sync();
+			gettime(&now);
+			timespec_add(&now, &interval, &deadline);
+		}
+	}
+}
+
+/*
+ * Start the syncer. This is separate from buffer_bootstrap because
+ * it has to wait until threads can run.
+ */
+void
+buffer_syncer_bootstrap(void)
+{
+	int result;
+
+	result = thread_fork("syncer", NULL, buffer_syncer, NULL, 0);
+	if (result) {
+		panic("buffer_syncer_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+void
+buffer_bootstrap(void)
+{
+	buffer_lock = lock_create("buffer cache");
+	if (buffer_lock == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buffer_cv = cv_create("buffer cache");
+	if (buffer_cv == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buffer_racv = cv_create("readahead");
+	if (buffer_racv == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	spinlock_init(&buffer_syncer_lock);
+	buffer_syncer_wchan = wchan_create("syncer");
+	if (buffer_syncer_wchan == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+}
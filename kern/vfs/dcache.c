@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Directory name cache.
+ *
+ * Entries are on hash chains keyed by (directory, name) and on an LRU
+ * list, least recently used first. The cache grows to DCACHE_MAXENTRIES
+ * and after that recycles the least recently used entry. All of it is
+ * protected by dcache_lock.
+ *
+ * Entries hold references to their vnodes, and dropping a reference
+ * can call into the file system to reclaim the vnode, so references
+ * are never dropped while holding dcache_lock; entries are unhooked
+ * under the lock and their references dropped after it is released.
+ * File systems call in here with their directory locks held, so
+ * dcache_lock comes after those in the lock order.
+ */
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <dcache.h>
+
+#define DCACHE_MAXENTRIES	512
+#define DCACHE_HASHSIZE		127
+
+struct dcache_entry {
+	struct vnode *de_dir;		/* directory the name is in */
+	struct vnode *de_vn;		/* what it names; NULL if nothing */
+	char de_name[DCACHE_NAMELEN];
+	unsigned de_hash;		/* hash chain index */
+	struct dcache_entry *de_hashnext;
+	struct dcache_entry *de_lruprev;
+	struct dcache_entry *de_lrunext;
+};
+
+static struct lock *dcache_lock;
+static struct dcache_entry *dcache_hash[DCACHE_HASHSIZE];
+static struct dcache_entry *dcache_lruhead;
+static struct dcache_entry *dcache_lrutail;
+static unsigned dcache_count;
+
+////////////////////////////////////////////////////////////
+// List handling
+
+static
+unsigned
+dcache_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h;
+
+	h = (uintptr_t)dir >> 4;
+	while (*name) {
+		h = h*31 + (unsigned char)*name++;
+	}
+	return h % DCACHE_HASHSIZE;
+}
+
+static
+struct dcache_entry *
+dcache_find(struct vnode *dir, const char *name, unsigned hash)
+{
+	struct dcache_entry *de;
+
+	for (de = dcache_hash[hash]; de != NULL; de = de->de_hashnext) {
+		if (de->de_dir == dir && !strcmp(de->de_name, name)) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+dcache_lruremove(struct dcache_entry *de)
+{
+	if (de->de_lruprev != NULL) {
+		de->de_lruprev->de_lrunext = de->de_lrunext;
+	}
+	else {
+		KASSERT(dcache_lruhead == de);
+		dcache_lruhead = de->de_lrunext;
+	}
+	if (de->de_lrunext != NULL) {
+		de->de_lrunext->de_lruprev = de->de_lruprev;
+	}
+	else {
+		KASSERT(dcache_lrutail == de);
+		dcache_lrutail = de->de_lruprev;
+	}
+	de->de_lruprev = de->de_lrunext = NULL;
+}
+
+static
+void
+dcache_lruaddtail(struct dcache_entry *de)
+{
+	de->de_lrunext = NULL;
+	de->de_lruprev = dcache_lrutail;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->de_lrunext = de;
+	}
+	else {
+		dcache_lruhead = de;
+	}
+	dcache_lrutail = de;
+}
+
+static
+void
+dcache_hook(struct dcache_entry *de)
+{
+	KASSERT(lock_do_i_hold(dcache_lock));
+
+	de->de_hashnext = dcache_hash[de->de_hash];
+	dcache_hash[de->de_hash] = de;
+	dcache_lruaddtail(de);
+	dcache_count++;
+}
+
+/*
+ * Take an entry out of the cache. It still holds its references.
+ */
+static
+void
+dcache_unhook(struct dcache_entry *de)
+{
+	struct dcache_entry **p;
+
+	KASSERT(lock_do_i_hold(dcache_lock));
+
+	for (p = &dcache_hash[de->de_hash]; *p != de; p = &(*p)->de_hashnext) {
+		KASSERT(*p != NULL);
+	}
+	*p = de->de_hashnext;
+	de->de_hashnext = NULL;
+	dcache_lruremove(de);
+	KASSERT(dcache_count > 0);
+	dcache_count--;
+}
+
+/*
+ * Drop the references held by an entry that's been unhooked.
+ */
+static
+void
+dcache_putrefs(struct vnode *dir, struct vnode *vn)
+{
+	KASSERT(!lock_do_i_hold(dcache_lock));
+
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	VOP_DECREF(dir);
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+bool
+dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct dcache_entry *de;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return false;
+	}
+
+	lock_acquire(dcache_lock);
+	de = dcache_find(dir, name, dcache_hashfn(dir, name));
+	if (de == NULL) {
+		lock_release(dcache_lock);
+		return false;
+	}
+	dcache_lruremove(de);
+	dcache_lruaddtail(de);
+	if (de->de_vn != NULL) {
+		VOP_INCREF(de->de_vn);
+	}
+	*ret = de->de_vn;
+	lock_release(dcache_lock);
+	return true;
+}
+
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct dcache_entry *de;
+	struct vnode *olddir, *oldvn;
+	unsigned hash;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return;
+	}
+	hash = dcache_hashfn(dir, name);
+
+	lock_acquire(dcache_lock);
+
+	if (dcache_find(dir, name, hash) != NULL) {
+		/*
+		 * Someone else looked it up at the same time. The
+		 * directory can't have changed in between, so it's the
+		 * same answer.
+		 */
+		lock_release(dcache_lock);
+		return;
+	}
+
+	if (dcache_count >= DCACHE_MAXENTRIES) {
+		/* Recycle the least recently used entry */
+		de = dcache_lruhead;
+		dcache_unhook(de);
+		olddir = de->de_dir;
+		oldvn = de->de_vn;
+	}
+	else {
+		de = kmalloc(sizeof(*de));
+		if (de == NULL) {
+			/* It's only a cache */
+			lock_release(dcache_lock);
+			return;
+		}
+		olddir = oldvn = NULL;
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	de->de_dir = dir;
+	de->de_vn = vn;
+	strcpy(de->de_name, name);
+	de->de_hash = hash;
+	dcache_hook(de);
+
+	lock_release(dcache_lock);
+
+	if (olddir != NULL) {
+		dcache_putrefs(olddir, oldvn);
+	}
+}
+
+void
+dcache_invalidate(struct vnode *dir, const char *name)
+{
+	struct dcache_entry *de;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return;
+	}
+
+	lock_acquire(dcache_lock);
+	de = dcache_find(dir, name, dcache_hashfn(dir, name));
+	if (de == NULL) {
+		lock_release(dcache_lock);
+		return;
+	}
+	dcache_unhook(de);
+	lock_release(dcache_lock);
+
+	dcache_putrefs(de->de_dir, de->de_vn);
+	kfree(de);
+}
+
+void
+dcache_purge(struct fs *fs)
+{
+	struct dcache_entry *de, *next, *list;
+	unsigned i;
+
+	/* Collect the entries on a private list, then release them */
+	list = NULL;
+	lock_acquire(dcache_lock);
+	for (i=0; i<DCACHE_HASHSIZE; i++) {
+		for (de = dcache_hash[i]; de != NULL; de = next) {
+			next = de->de_hashnext;
+			if (de->de_dir->vn_fs == fs) {
+				dcache_unhook(de);
+				de->de_hashnext = list;
+				list = de;
+			}
+		}
+	}
+	lock_release(dcache_lock);
+
+	for (de = list; de != NULL; de = next) {
+		next = de->de_hashnext;
+		dcache_putrefs(de->de_dir, de->de_vn);
+		kfree(de);
+	}
+}
+
+void
+dcache_bootstrap(void)
+{
+	unsigned i;
+
+	dcache_lock = lock_create("dcache");
+	if (dcache_lock == NULL) {
+		panic("dcache_bootstrap: Out of memory\n");
+	}
+	for (i=0; i<DCACHE_HASHSIZE; i++) {
+		dcache_hash[i] = NULL;
+	}
+	dcache_lruhead = dcache_lrutail = NULL;
+	dcache_count = 0;
+}
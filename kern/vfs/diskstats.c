@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Disk I/O statistics.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <diskstats.h>
+
+/* How many disks can register */
+#define DISKSTATS_MAXDISKS	8
+
+struct diskstats_entry {
+	const char *de_name;
+	struct diskstats *de_stats;
+	struct spinlock *de_lock;
+};
+
+static struct spinlock diskstats_reglock = SPINLOCK_INITIALIZER;
+static struct diskstats_entry diskstats_disks[DISKSTATS_MAXDISKS];
+static unsigned diskstats_ndisks;
+
+/*
+ * Microseconds from T1 to T2; zero if T2 isn't later.
+ */
+static
+uint64_t
+diskstats_usecs(const struct timespec *t1, const struct timespec *t2)
+{
+	int64_t usecs;
+
+	usecs = (t2->tv_sec - t1->tv_sec) * (int64_t)1000000;
+	usecs += ((int64_t)t2->tv_nsec - t1->tv_nsec) / 1000;
+	return usecs > 0 ? usecs : 0;
+}
+
+/*
+ * Histogram bucket for a latency: the bucket i with
+ * 2^i <= USECS < 2^(i+1), with the ends clamped.
+ */
+static
+unsigned
+diskstats_bucket(uint64_t usecs)
+{
+	unsigned b;
+
+	b = 0;
+	while (usecs > 1 && b < DISKSTATS_NBUCKETS - 1) {
+		usecs >>= 1;
+		b++;
+	}
+	return b;
+}
+
+void
+diskstats_init(struct diskstats *ds, uint32_t nsects, uint32_t rpm)
+{
+	bzero(ds, sizeof(*ds));
+	ds->ds_nsects = nsects;
+	ds->ds_rpm = rpm;
+}
+
+void
+diskstats_submit(struct diskstats *ds)
+{
+	ds->ds_submits++;
+	ds->ds_depth++;
+	if (ds->ds_depth > ds->ds_maxdepth) {
+		ds->ds_maxdepth = ds->ds_depth;
+	}
+	ds->ds_depthsum += ds->ds_depth;
+}
+
+void
+diskstats_done(struct diskstats *ds, bool write, uint32_t bytes, int err,
+	       const struct timespec *submitted,
+	       const struct timespec *started,
+	       const struct timespec *done)
+{
+	struct diskstats_rw *dr;
+
+	KASSERT(ds->ds_depth > 0);
+	ds->ds_depth--;
+
+	dr = write ? &ds->ds_write : &ds->ds_read;
+	dr->dr_requests++;
+	if (err) {
+		dr->dr_errors++;
+	}
+	dr->dr_bytes += bytes;
+	dr->dr_waitusecs += diskstats_usecs(submitted, started);
+	dr->dr_svcusecs += diskstats_usecs(started, done);
+	dr->dr_hist[diskstats_bucket(diskstats_usecs(submitted, done))]++;
+}
+
+void
+diskstats_clear(struct diskstats *ds)
+{
+	uint32_t nsects, rpm, depth;
+
+	nsects = ds->ds_nsects;
+	rpm = ds->ds_rpm;
+	depth = ds->ds_depth;
+	bzero(ds, sizeof(*ds));
+	ds->ds_nsects = nsects;
+	ds->ds_rpm = rpm;
+	ds->ds_depth = depth;
+	ds->ds_maxdepth = depth;
+}
+
+////////////////////////////////////////////////////////////
+// registry
+
+int
+diskstats_register(const char *name, struct diskstats *ds,
+		   struct spinlock *lk)
+{
+	struct diskstats_entry *de;
+
+	spinlock_acquire(&diskstats_reglock);
+	if (diskstats_ndisks >= DISKSTATS_MAXDISKS) {
+		spinlock_release(&diskstats_reglock);
+		return ENOSPC;
+	}
+	de = &diskstats_disks[diskstats_ndisks];
+	de->de_name = name;
+	de->de_stats = ds;
+	de->de_lock = lk;
+	/* entries are never removed, so readers needn't lock past here */
+	diskstats_ndisks++;
+	spinlock_release(&diskstats_reglock);
+	return 0;
+}
+
+static
+unsigned
+diskstats_count(void)
+{
+	unsigned n;
+
+	spinlock_acquire(&diskstats_reglock);
+	n = diskstats_ndisks;
+	spinlock_release(&diskstats_reglock);
+	return n;
+}
+
+static
+void
+diskstats_printrw(const char *what, const struct diskstats_rw *dr)
+{
+	uint64_t lat;
+	unsigned i;
+
+	kprintf("  %s: %u requests, %u errors, %u merged, %llu bytes\n",
+		what, dr->dr_requests, dr->dr_errors, dr->dr_merged,
+		(unsigned long long)dr->dr_bytes);
+	if (dr->dr_requests == 0) {
+		return;
+	}
+	kprintf("    avg wait %llu usec, avg service %llu usec\n",
+		(unsigned long long)(dr->dr_waitusecs / dr->dr_requests),
+		(unsigned long long)(dr->dr_svcusecs / dr->dr_requests));
+	for (i=0; i<DISKSTATS_NBUCKETS; i++) {
+		if (dr->dr_hist[i] == 0) {
+			continue;
+		}
+		lat = (uint64_t)1 << i;
+		if (i == DISKSTATS_NBUCKETS - 1) {
+			kprintf("    >= %8llu usec: %u\n",
+				(unsigned long long)lat, dr->dr_hist[i]);
+		}
+		else {
+			kprintf("    <  %8llu usec: %u\n",
+				(unsigned long long)(lat * 2), dr->dr_hist[i]);
+		}
+	}
+}
+
+void
+diskstats_printall(void)
+{
+	struct diskstats snap;
+	struct diskstats_entry *de;
+	unsigned i, n;
+
+	n = diskstats_count();
+	if (n == 0) {
+		kprintf("No disks.\n");
+		return;
+	}
+	for (i=0; i<n; i++) {
+		de = &diskstats_disks[i];
+
+		/* copy out, since kprintf can't be called under a spinlock */
+		spinlock_acquire(de->de_lock);
+		snap = *de->de_stats;
+		spinlock_release(de->de_lock);
+
+		kprintf("%s: %u sectors, %u rpm\n", de->de_name,
+			snap.ds_nsects, snap.ds_rpm);
+		kprintf("  %u submitted in %u runs; depth %u, max %u",
+			snap.ds_submits, snap.ds_runs, snap.ds_depth,
+			snap.ds_maxdepth);
+		if (snap.ds_submits > 0) {
+			kprintf(", avg %llu",
+				(unsigned long long)
+				(snap.ds_depthsum / snap.ds_submits));
+		}
+		kprintf("\n");
+		diskstats_printrw("read ", &snap.ds_read);
+		diskstats_printrw("write", &snap.ds_write);
+	}
+}
+
+void
+diskstats_clearall(void)
+{
+	struct diskstats_entry *de;
+	unsigned i, n;
+
+	n = diskstats_count();
+	for (i=0; i<n; i++) {
+		de = &diskstats_disks[i];
+		spinlock_acquire(de->de_lock);
+		diskstats_clear(de->de_stats);
+		spinlock_release(de->de_lock);
+	}
+}
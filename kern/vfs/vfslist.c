@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <dcache.h>
 
 /*
  * Structure for a single named device.
@@ -90,9 +91,14 @@ DEFARRAY(knowndev, static __UNUSED inline);
 
 static struct knowndevarray *knowndevs;
 
-/* The big lock for all FS ops. Remove for filesystem assignment. */
-static struct lock *vfs_biglock;
-static unsigned vfs_biglock_depth;
+/*
+ * Lock for the knowndevs table and the mounted-or-not state of its
+ * entries. Filesystems do their own locking; this only keeps mount
+ * and unmount from happening under anyone who is using the table.
+ * It is held across FSOP_SYNC, FSOP_UNMOUNT, FSOP_GETROOT, and the
+ * mount function, so filesystems must never take it themselves.
+ */
+static struct lock *vfs_listlock;
 
 
 /*
@@ -106,66 +112,17 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
-	vfs_biglock = lock_create("vfs_biglock");
-	if (vfs_biglock==NULL) {
-		panic("vfs: Could not create vfs big lock\n");
+	vfs_listlock = lock_create("vfs_listlock");
+	if (vfs_listlock==NULL) {
+		panic("vfs: Could not create vfs list lock\n");
 	}
-	vfs_biglock_depth = 0;
+
+	dcache_bootstrap();
 
 	devnull_create();
 	semfs_bootstrap();
 }
 
-/*
- * Operations on vfs_biglock. We make it recursive to avoid having to
- * think about where we do and don't already hold it. This is an
- * undesirable hack that's frequently necessary when a lock covers too
- * much material. Your solution scheme for FS and VFS locking should
- * not require recursive locks.
- */
-void
-vfs_biglock_acquire(void)
-{
-	if (!lock_do_i_hold(vfs_biglock)) {
-		lock_acquire(vfs_biglock);
-	}
-	else if (vfs_biglock_depth == 0) {
-		/*
-		 * Supposedly we hold it, but the depth is 0. This may
-		 * mean: (1) the count is messed up, or (2)
-		 * lock_do_i_hold is lying. Since OS/161 ships out of
-		 * the box with unimplemented locks (students
-		 * implement them) that always return true, assume
-		 * situation (2). In this case acquire the lock
-		 * anyway.
-		 *
-		 * Once you have working locks, this won't be the
-		 * case, and if you get here it should be situation
-		 * (1), in which case the count is messed up and one
-		 * can panic.
-		 */
-		lock_acquire(vfs_biglock);
-	}
-	vfs_biglock_depth++;
-}
-
-void
-vfs_biglock_release(void)
-{
-	KASSERT(lock_do_i_hold(vfs_biglock));
-	KASSERT(vfs_biglock_depth > 0);
-	vfs_biglock_depth--;
-	if (vfs_biglock_depth == 0) {
-		lock_release(vfs_biglock);
-	}
-}
-
-bool
-vfs_biglock_do_i_hold(void)
-{
-	return lock_do_i_hold(vfs_biglock);
-}
-
 /*
  * Global sync function - call FSOP_SYNC on all devices.
  */
@@ -175,7 +132,7 @@ vfs_sync(void)
 	struct knowndev *dev;
 	unsigned i, num;
 
-	vfs_biglock_acquire();
+	lock_acquire(vfs_listlock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -185,7 +142,7 @@ vfs_sync(void)
 		}
 	}
 
-	vfs_biglock_release();
+	lock_release(vfs_listlock);
 
 	return 0;
 }
@@ -194,13 +151,14 @@ vfs_sync(void)
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
  */
+static
 int
-vfs_getroot(const char *devname, struct vnode **ret)
+vfs_getroot_locked(const char *devname, struct vnode **ret)
 {
 	struct knowndev *kd;
 	unsigned i, num;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(vfs_listlock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -270,6 +228,17 @@ vfs_getroot(const char *devname, struct vnode **ret)
 	return ENODEV;
 }
 
+int
+vfs_getroot(const char *devname, struct vnode **ret)
+{
+	int result;
+
+	lock_acquire(vfs_listlock);
+	result = vfs_getroot_locked(devname, ret);
+	lock_release(vfs_listlock);
+	return result;
+}
+
 /*
  * Given a filesystem, hand back the name of the device it's mounted on.
  */
@@ -277,11 +246,13 @@ const char *
 vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
+	const char *name;
 	unsigned i, num;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	name = NULL;
+	lock_acquire(vfs_listlock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -292,13 +263,16 @@ vfs_getdevname(struct fs *fs)
 			 * This is not a race condition: as long as the
 			 * guy calling us holds a reference to the fs,
 			 * the fs cannot go away, and the device can't
-			 * go away until the fs goes away.
+			 * go away until the fs goes away. So the name
+			 * stays valid after we drop the lock.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
 
-	return NULL;
+	lock_release(vfs_listlock);
+	return name;
 }
 
 /*
@@ -358,7 +332,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(vfs_listlock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -401,7 +375,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	/* Silence warning with gcc 4.8 -Og (but not -O2) */
 	index = 0;
 
-	vfs_biglock_acquire();
+	lock_acquire(vfs_listlock);
 
 	name = kstrdup(dname);
 	if (name==NULL) {
@@ -453,7 +427,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
-	vfs_biglock_release();
+	lock_release(vfs_listlock);
 	return 0;
 
  fail:
@@ -470,7 +444,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		kfree(kd);
 	}
 
-	vfs_biglock_release();
+	lock_release(vfs_listlock);
 	return result;
 }
 
@@ -499,7 +473,7 @@ vfs_addfs(const char *devname, struct fs *fs)
 
 /*
  * Look for a mountable device named DEVNAME.
- * Should already hold knowndevs_lock.
+ * Should already hold vfs_listlock.
  */
 static
 int
@@ -509,7 +483,7 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(vfs_listlock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -543,16 +517,16 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(vfs_listlock);
 
 	result = findmount(devname, &kd);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(vfs_listlock);
 		return result;
 	}
 
 	if (kd->kd_fs != NULL) {
-		vfs_biglock_release();
+		lock_release(vfs_listlock);
 		return EBUSY;
 	}
 	KASSERT(kd->kd_rawname != NULL);
@@ -560,7 +534,7 @@ vfs_mount(const char *devname, void *data,
 
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(vfs_listlock);
 		return result;
 	}
 
@@ -573,7 +547,7 @@ vfs_mount(const char *devname, void *data,
 	kprintf("vfs: Mounted %s: on %s\n",
 		volname ? volname : kd->kd_name, kd->kd_name);
 
-	vfs_biglock_release();
+	lock_release(vfs_listlock);
 	return 0;
 }
 
@@ -601,7 +575,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 		devname = myname;
 	}
 
-	vfs_biglock_acquire();
+	lock_acquire(vfs_listlock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -622,7 +596,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 	*ret = kd->kd_vnode;
 
  out:
-	vfs_biglock_release();
+	lock_release(vfs_listlock);
 	if (myname != NULL) {
 		kfree(myname);
 	}
@@ -640,7 +614,7 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(vfs_listlock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -654,6 +628,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* drop the name cache's references into the fs */
+	dcache_purge(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -673,7 +650,7 @@ vfs_unmount(const char *devname)
 	KASSERT(result==0);
 
  fail:
-	vfs_biglock_release();
+	lock_release(vfs_listlock);
 	return result;
 }
 
@@ -690,7 +667,7 @@ vfs_swapoff(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(vfs_listlock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -710,7 +687,7 @@ vfs_swapoff(const char *devname)
 	KASSERT(result==0);
 
  fail:
-	vfs_biglock_release();
+	lock_release(vfs_listlock);
 	return result;
 }
 
@@ -724,7 +701,7 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(vfs_listlock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -745,6 +722,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		dcache_purge(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -780,7 +759,7 @@ vfs_unmountall(void)
 		dev->kd_fs = NULL;
 	}
 
-	vfs_biglock_release();
+	lock_release(vfs_listlock);
 
 	return 0;
 }
@@ -129,9 +129,6 @@ vnode_decref(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
-	/* not safe, and not really needed to check constant fields */
-	/*vfs_biglock_acquire();*/
-
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
 	}
@@ -174,5 +171,4 @@ vnode_check(struct vnode *v, const char *opstr)
 	}
 
 	spinlock_release(&v->vn_countlock);
-	/*vfs_biglock_release();*/
 }
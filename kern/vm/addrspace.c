@@ -36,6 +36,7 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <kcache.h>
 #include <proc.h>
 
 
@@ -75,7 +76,10 @@ static bool insert_page_table_entry(struct addrspace *as,
         uint32_t vpn = entry_hi & PAGE_FRAME;
         int index = hpt_hash(as, vpn);
 
-        struct hpt_entry * new = kmalloc(sizeof(struct hpt_entry));
+        struct hpt_entry * new = kcache_alloc(hpt_cache);
+        if (new == NULL) {
+                return false;
+        }
         new->pid = (uint32_t) as;
         new->entry_hi = vpn;
         new->entry_lo = entry_lo;
@@ -270,7 +274,7 @@ void as_destroy(struct addrspace *as) {
                         } else {
                                 prev_ptr->next = temp;
                         }
-                        kfree(ptr);
+                        kcache_free(hpt_cache, ptr);
                         ptr = temp;
                 }
         }
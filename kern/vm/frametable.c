@@ -27,6 +27,8 @@ struct ft_entry {
 
 /* next free frame index within the ft */
 static int ft_next_free;
+/* number of entries in the ft */
+static int ft_num_frames;
 static struct ft_entry *ft = NULL;
 
 struct hpt_entry **hpt = NULL;
@@ -52,6 +54,7 @@ void init_ft_hpt() {
 
         /* initialize frame table location (mem_top - ft_mem_size) */
         int total_num_frames = (total_mem_size + (PAGE_SIZE - 1)) / PAGE_SIZE;
+        ft_num_frames = total_num_frames;
         paddr_t ft_mem_size = total_num_frames * sizeof(struct ft_entry);
         paddr_t ft_bot_location = total_mem_size - ft_mem_size;
         ft = (struct ft_entry *) PADDR_TO_KVADDR(ft_bot_location);
@@ -92,6 +95,53 @@ void init_ft_hpt() {
 
 
 
+/* finds a run of npages free frames, takes them all off the free
+ * frame list and marks them used. returns the physical address of the
+ * first one, or 0 if there is no such run. ft_lock must be held. */
+static paddr_t alloc_frame_run(unsigned int npages) {
+        int start = 0;
+        unsigned int run = 0;
+
+        KASSERT(spinlock_do_i_hold(&ft_lock));
+
+        for (int i = 0; i < ft_num_frames && run < npages; i++) {
+                if (ft[i].inuse != FRAME_UNUSED) {
+                        run = 0;
+                        continue;
+                }
+                if (run == 0) {
+                        start = i;
+                }
+                run++;
+        }
+        if (run < npages) {
+                return 0;
+        }
+
+        /* unlink the run from the free frame list */
+        int end = start + npages;
+        int *prevp = &ft_next_free;
+        while (*prevp != NO_NEXT_FRAME) {
+                int curr_index = *prevp;
+                if (curr_index >= start && curr_index < end) {
+                        *prevp = ft[curr_index].next;
+                } else {
+                        prevp = &ft[curr_index].next;
+                }
+        }
+
+        for (int i = start; i < end; i++) {
+                set_ft_entry(i, NO_NEXT_FRAME, FRAME_USED);
+        }
+
+        /* zero out the pages */
+        paddr_t paddr = start * PAGE_SIZE;
+        memset((void *)PADDR_TO_KVADDR(paddr), 0, npages * PAGE_SIZE);
+        return paddr;
+}
+
+
+
 vaddr_t alloc_kpages(unsigned int npages) {
         paddr_t paddr;
 
@@ -102,7 +152,12 @@ vaddr_t alloc_kpages(unsigned int npages) {
                 paddr = ram_stealmem(npages);
                 spinlock_release(&stealmem_lock);
 
-        } else if (npages != 1 || ft_next_free == NO_NEXT_FRAME) {
+        } else if (npages != 1) {
+                /* multi-page allocations need physically contiguous
+                 * frames, since the kernel reaches them through kseg0 */
+                paddr = alloc_frame_run(npages);
+
+        } else if (ft_next_free == NO_NEXT_FRAME) {
                 spinlock_release(&ft_lock);
                 return 0;
 
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches. See <kcache.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <kcache.h>
+#include <platform/maxcpus.h>
+
+/*
+ * Each cpu keeps up to KCACHE_CPUOBJS free objects, which it uses
+ * with interrupts off and no lock. When its list runs empty or full
+ * it moves KCACHE_BATCH objects from or to the shared depot, which
+ * holds up to KCACHE_DEPOTOBJS more. Beyond that objects are
+ * destroyed.
+ */
+#define KCACHE_CPUOBJS		8
+#define KCACHE_BATCH		(KCACHE_CPUOBJS / 2)
+#define KCACHE_DEPOTOBJS	32
+
+struct kcache_cpu {
+	void *kcc_objs[KCACHE_CPUOBJS];
+	unsigned kcc_nobjs;
+	unsigned kcc_hits;		/* allocs that reused an object */
+	unsigned kcc_misses;		/* allocs that built a new one */
+};
+
+struct kcache {
+	char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct kcache *kc_next;		/* on kcache_list */
+
+	struct spinlock kc_lock;	/* protects the depot */
+	void *kc_depot[KCACHE_DEPOTOBJS];
+	unsigned kc_ndepot;
+
+	struct kcache_cpu kc_cpus[MAXCPUS];
+};
+
+/* All caches, for kcache_printstats. */
+static struct spinlock kcache_listlock = SPINLOCK_INITIALIZER;
+static struct kcache *kcache_list;
+
+/*
+ * Make a new object from scratch.
+ */
+static
+void *
+kcache_construct(struct kcache *kc)
+{
+	void *obj;
+
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL && kc->kc_ctor(obj) != 0) {
+		kfree(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+/*
+ * Give an object's memory back.
+ */
+static
+void
+kcache_destruct(struct kcache *kc, void *obj)
+{
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * Create a cache.
+ */
+struct kcache *
+kcache_create(const char *name, size_t size,
+	      int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kcache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	bzero(kc, sizeof(*kc));
+
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+
+	spinlock_acquire(&kcache_listlock);
+	kc->kc_next = kcache_list;
+	kcache_list = kc;
+	spinlock_release(&kcache_listlock);
+
+	return kc;
+}
+
+/*
+ * Destroy a cache.
+ */
+void
+kcache_destroy(struct kcache *kc)
+{
+	struct kcache **p;
+	struct kcache_cpu *kcc;
+	unsigned i;
+
+	spinlock_acquire(&kcache_listlock);
+	for (p = &kcache_list; *p != NULL; p = &(*p)->kc_next) {
+		if (*p == kc) {
+			*p = kc->kc_next;
+			break;
+		}
+	}
+	spinlock_release(&kcache_listlock);
+
+	for (i=0; i<MAXCPUS; i++) {
+		kcc = &kc->kc_cpus[i];
+		while (kcc->kcc_nobjs > 0) {
+			kcache_destruct(kc, kcc->kcc_objs[--kcc->kcc_nobjs]);
+		}
+	}
+	while (kc->kc_ndepot > 0) {
+		kcache_destruct(kc, kc->kc_depot[--kc->kc_ndepot]);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_name);
+	kfree(kc);
+}
+
+/*
+ * Get an object.
+ */
+void *
+kcache_alloc(struct kcache *kc)
+{
+	struct kcache_cpu *kcc;
+	void *obj;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		/* Too early in boot for the per-cpu lists. */
+		obj = NULL;
+		spinlock_acquire(&kc->kc_lock);
+		if (kc->kc_ndepot > 0) {
+			obj = kc->kc_depot[--kc->kc_ndepot];
+		}
+		spinlock_release(&kc->kc_lock);
+		return obj != NULL ? obj : kcache_construct(kc);
+	}
+
+	/* Interrupts off so we stay on this cpu. */
+	spl = splhigh();
+	KASSERT(curcpu->c_number < MAXCPUS);
+	kcc = &kc->kc_cpus[curcpu->c_number];
+
+	if (kcc->kcc_nobjs == 0) {
+		/* Refill from the depot. */
+		spinlock_acquire(&kc->kc_lock);
+		while (kc->kc_ndepot > 0 && kcc->kcc_nobjs < KCACHE_BATCH) {
+			kcc->kcc_objs[kcc->kcc_nobjs++] =
+				kc->kc_depot[--kc->kc_ndepot];
+		}
+		spinlock_release(&kc->kc_lock);
+	}
+
+	if (kcc->kcc_nobjs > 0) {
+		kcc->kcc_hits++;
+		obj = kcc->kcc_objs[--kcc->kcc_nobjs];
+		splx(spl);
+		return obj;
+	}
+
+	kcc->kcc_misses++;
+	splx(spl);
+
+	/* Nothing cached anywhere; build one (with interrupts on). */
+	return kcache_construct(kc);
+}
+
+/*
+ * Return an object.
+ */
+void
+kcache_free(struct kcache *kc, void *obj)
+{
+	struct kcache_cpu *kcc;
+	void *extra[KCACHE_BATCH];
+	unsigned nextra, i;
+	int spl;
+
+	KASSERT(obj != NULL);
+
+	if (!CURCPU_EXISTS()) {
+		spinlock_acquire(&kc->kc_lock);
+		if (kc->kc_ndepot < KCACHE_DEPOTOBJS) {
+			kc->kc_depot[kc->kc_ndepot++] = obj;
+			obj = NULL;
+		}
+		spinlock_release(&kc->kc_lock);
+		if (obj != NULL) {
+			kcache_destruct(kc, obj);
+		}
+		return;
+	}
+
+	nextra = 0;
+
+	spl = splhigh();
+	KASSERT(curcpu->c_number < MAXCPUS);
+	kcc = &kc->kc_cpus[curcpu->c_number];
+
+	if (kcc->kcc_nobjs == KCACHE_CPUOBJS) {
+		/*
+		 * Full; move the oldest batch to the depot. Whatever
+		 * doesn't fit there gets destroyed below.
+		 */
+		spinlock_acquire(&kc->kc_lock);
+		for (i=0; i<KCACHE_BATCH; i++) {
+			if (kc->kc_ndepot < KCACHE_DEPOTOBJS) {
+				kc->kc_depot[kc->kc_ndepot++] =
+					kcc->kcc_objs[i];
+			}
+			else {
+				extra[nextra++] = kcc->kcc_objs[i];
+			}
+		}
+		spinlock_release(&kc->kc_lock);
+
+		for (i=KCACHE_BATCH; i<KCACHE_CPUOBJS; i++) {
+			kcc->kcc_objs[i - KCACHE_BATCH] = kcc->kcc_objs[i];
+		}
+		kcc->kcc_nobjs -= KCACHE_BATCH;
+	}
+
+	kcc->kcc_objs[kcc->kcc_nobjs++] = obj;
+	splx(spl);
+
+	for (i=0; i<nextra; i++) {
+		kcache_destruct(kc, extra[i]);
+	}
+}
+
+/*
+ * Print statistics. The per-cpu counters are read without locking,
+ * so they may be slightly off while the system is busy.
+ */
+void
+kcache_printstats(void)
+{
+	struct kcache *kc;
+	unsigned i, ncpus, cached, hits, misses;
+
+	ncpus = cpu_count();
+	if (ncpus > MAXCPUS) {
+		ncpus = MAXCPUS;
+	}
+
+	kprintf("Object caches:\n");
+
+	spinlock_acquire(&kcache_listlock);
+	for (kc = kcache_list; kc != NULL; kc = kc->kc_next) {
+		cached = kc->kc_ndepot;
+		hits = misses = 0;
+		for (i=0; i<ncpus; i++) {
+			cached += kc->kc_cpus[i].kcc_nobjs;
+			hits += kc->kc_cpus[i].kcc_hits;
+			misses += kc->kc_cpus[i].kcc_misses;
+		}
+		kprintf("%-16s size %-5lu %4u cached  %u reused, %u built\n",
+			kc->kc_name, (unsigned long) kc->kc_size, cached,
+			hits, misses);
+	}
+	spinlock_release(&kcache_listlock);
+}
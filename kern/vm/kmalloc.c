@@ -30,7 +30,11 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -121,6 +125,16 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * MAGAZINES enables the per-cpu block caches described below. They
+ * hand out blocks without passing through the code that sets up and
+ * checks guard bands and labels, so they're turned off when either
+ * of those is in use.
+ */
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -160,16 +174,185 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for all the shared state: the page lists and the
+ * pagerefs. Most allocations and frees don't get this far, though;
+ * they're satisfied from the per-cpu magazines below.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
 ////////////////////////////////////////
 
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps, for each block size, a small stack of free blocks
+ * (a "magazine"). kmalloc pops from it and kfree pushes onto it, with
+ * interrupts off but without taking kmalloc_spinlock. When the
+ * magazine runs empty it is refilled with a batch of blocks taken
+ * from the pages on sizebases[]; when it fills up, a batch is handed
+ * back. Only these batch transfers take the shared lock.
+ *
+ * As far as the pages are concerned, blocks sitting in a magazine are
+ * allocated. This means a page can't be released while any of its
+ * blocks are cached, which is why the magazines for the big block
+ * sizes are kept short: no magazine holds more than a page's worth.
+ *
+ * The counters are updated only by the owning cpu and read, without
+ * locking, only for kheap_printstats.
+ */
+
+#ifdef MAGAZINES
+
+#define MAG_MAXROUNDS 16
+
+struct magazine {
+	void *mag_blocks[MAG_MAXROUNDS];
+	unsigned mag_rounds;		/* number of blocks in mag_blocks */
+	unsigned mag_allochits;		/* allocs served from the magazine */
+	unsigned mag_allocmisses;	/* allocs that found it empty */
+	unsigned mag_freehits;		/* frees that went into it */
+	unsigned mag_freemisses;	/* frees that found it full */
+};
+
+static struct magazine magazines[MAXCPUS][NSIZES];
+
+/*
+ * Number of blocks a magazine of the given block type may hold.
+ */
+static
+unsigned
+magazine_capacity(unsigned blktype)
+{
+	unsigned n;
+
+	n = PAGE_SIZE / sizes[blktype];
+	return n < MAG_MAXROUNDS ? n : MAG_MAXROUNDS;
+}
+
+/*
+ * Number of blocks moved by a refill or a drain. Half the capacity,
+ * so a cpu that alternates between allocating and freeing doesn't
+ * bounce off the shared lock on every call.
+ */
+static
+unsigned
+magazine_batch(unsigned blktype)
+{
+	unsigned n;
+
+	n = magazine_capacity(blktype) / 2;
+	return n > 0 ? n : 1;
+}
+
+#endif /* MAGAZINES */
+
+////////////////////////////////////////
+
+/*
+ * Page map.
+ *
+ * For each physical page, the owner of the page if it's part of the
+ * heap: the pageref if it's a subpage allocator page, or the span
+ * (see below) if it's part of a span, with PM_SPAN set in the low
+ * bit to tell them apart. This lets kfree find the owner of a
+ * pointer in constant time.
+ *
+ * As with the pagerefs, we rely on System/161 having at most 16M of
+ * RAM to size the map statically.
+ *
+ * Entries for subpage pages are set and cleared under
+ * kmalloc_spinlock, and entries for spans under span_spinlock. kfree
+ * reads them without either: the entry for a page holding a live
+ * block can't change until that block is freed.
+ */
+
+#define PAGEMAP_PAGES ((16*1024*1024) / PAGE_SIZE)
+#define PM_SPAN 1
+
+struct span;
+
+static uintptr_t pagemap[PAGEMAP_PAGES];
+
+/*
+ * Return the pagemap[] index for a heap address, or PAGEMAP_PAGES if
+ * it can't be one.
+ */
+static
+unsigned
+pagemap_index(vaddr_t addr)
+{
+	paddr_t pa;
+
+	if (addr < MIPS_KSEG0) {
+		return PAGEMAP_PAGES;
+	}
+	pa = KVADDR_TO_PADDR(addr);
+	if (pa / PAGE_SIZE >= PAGEMAP_PAGES) {
+		return PAGEMAP_PAGES;
+	}
+	return pa / PAGE_SIZE;
+}
+
+static
+void
+pagemap_set(unsigned index, uintptr_t val)
+{
+	KASSERT(index < PAGEMAP_PAGES);
+	KASSERT(pagemap[index] == 0);
+	pagemap[index] = val;
+}
+
+static
+void
+pagemap_clear(unsigned index)
+{
+	KASSERT(index < PAGEMAP_PAGES);
+	KASSERT(pagemap[index] != 0);
+	pagemap[index] = 0;
+}
+
+/*
+ * Return the pageref for the page at INDEX, or NULL if it isn't a
+ * subpage allocator page.
+ */
+static
+struct pageref *
+pagemap_pageref(unsigned index)
+{
+	uintptr_t val;
+
+	if (index >= PAGEMAP_PAGES) {
+		return NULL;
+	}
+	val = pagemap[index];
+	if (val & PM_SPAN) {
+		return NULL;
+	}
+	return (struct pageref *)val;
+}
+
+/*
+ * Return the span owning the page at INDEX, or NULL if none does.
+ */
+static
+struct span *
+pagemap_span(unsigned index)
+{
+	uintptr_t val;
+
+	if (index >= PAGEMAP_PAGES) {
+		return NULL;
+	}
+	val = pagemap[index];
+	if ((val & PM_SPAN) == 0) {
+		return NULL;
+	}
+	return (struct span *)(val & ~(uintptr_t)PM_SPAN);
+}
+
+////////////////////////////////////////
+
 /*
  * We can only allocate whole pages of pageref structure at a time.
  * This is a struct type for such a page.
@@ -508,6 +691,7 @@ checksubpage(struct pageref *pr)
 #endif
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pagemap_pageref(pagemap_index(PR_PAGEADDR(pr))) == pr);
 
 	if (pr->freelist_offset == INVALID_OFFSET) {
 		KASSERT(pr->nfree==0);
@@ -794,6 +978,65 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+#ifdef MAGAZINES
+/*
+ * Percentage of HITS out of HITS+MISSES, avoiding 64-bit arithmetic.
+ */
+static
+unsigned
+magazine_pct(unsigned hits, unsigned misses)
+{
+	unsigned total;
+
+	total = hits + misses;
+	if (total == 0) {
+		return 0;
+	}
+	if (total < 0x1000000) {
+		return hits * 100 / total;
+	}
+	return hits / (total / 100);
+}
+
+/*
+ * Print the magazine counters for each block size, summed over cpus.
+ */
+static
+void
+magazine_stats(void)
+{
+	struct magazine *mag;
+	unsigned blktype, i, ncpus;
+	unsigned rounds, ahits, amisses, fhits, fmisses;
+
+	ncpus = cpu_count();
+	if (ncpus > MAXCPUS) {
+		ncpus = MAXCPUS;
+	}
+
+	kprintf("Per-cpu magazines (%u cpus):\n", ncpus);
+	for (blktype = 0; blktype < NSIZES; blktype++) {
+		rounds = ahits = amisses = fhits = fmisses = 0;
+		for (i=0; i<ncpus; i++) {
+			mag = &magazines[i][blktype];
+			rounds += mag->mag_rounds;
+			ahits += mag->mag_allochits;
+			amisses += mag->mag_allocmisses;
+			fhits += mag->mag_freehits;
+			fmisses += mag->mag_freemisses;
+		}
+		kprintf("size %-4lu  %3u cached  "
+			"alloc %u/%u hits (%u%%)  free %u/%u hits (%u%%)\n",
+			(unsigned long) sizes[blktype], rounds,
+			ahits, ahits + amisses, magazine_pct(ahits, amisses),
+			fhits, fhits + fmisses, magazine_pct(fhits, fmisses));
+	}
+}
+#endif /* MAGAZINES */
+
+/* in the span allocator, below */
+static void span_stats(void);
+
 /*
  * Print the whole heap.
  */
@@ -812,6 +1055,11 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	magazine_stats();
+#endif
+	span_stats();
 }
 
 ////////////////////////////////////////
@@ -866,6 +1114,277 @@ int blocktype(size_t clientsz)
 	return 0;
 }
 
+/*
+ * Take a block off the freelist of the page PR, which must have at
+ * least one free block.
+ */
+static
+void *
+subpage_popblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+
+	return retptr;
+}
+
+/*
+ * Put the block at OFFSET back on the freelist of the page PR. If
+ * that makes the whole page free, take the page off the lists, release
+ * the pageref, and return true; the caller should then free the page
+ * itself once it has let go of kmalloc_spinlock.
+ */
+static
+bool
+subpage_pushblock(struct pageref *pr, vaddr_t offset)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	int blktype;		// PR_BLOCKTYPE(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		remove_lists(pr, blktype);
+		pagemap_clear(pagemap_index(prpage));
+		freepageref(pr);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Find the pageref for the heap page containing PTRADDR, or return
+ * NULL if it isn't on any of our pages. This doesn't need the lock;
+ * see the comments on pagemap[].
+ */
+static
+struct pageref *
+subpage_findpage(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+
+	pr = pagemap_pageref(pagemap_index(ptraddr));
+	if (pr != NULL) {
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+		KASSERT(PR_PAGEADDR(pr) == (ptraddr & PAGE_FRAME));
+	}
+	return pr;
+}
+
+#ifdef MAGAZINES
+
+/*
+ * Refill an empty magazine with a batch of blocks from the pages we
+ * already have. This doesn't allocate new pages; if there are no free
+ * blocks at all the magazine stays empty and the caller goes the slow
+ * way, which does.
+ */
+static
+void
+magazine_refill(struct magazine *mag, unsigned blktype)
+{
+	struct pageref *pr;
+	unsigned want;
+
+	KASSERT(mag->mag_rounds == 0);
+	want = magazine_batch(blktype);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+
+	for (pr = sizebases[blktype];
+	     pr != NULL && mag->mag_rounds < want;
+	     pr = pr->next_samesize) {
+
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+
+		while (pr->nfree > 0 && mag->mag_rounds < want) {
+			mag->mag_blocks[mag->mag_rounds++] =
+				subpage_popblock(pr);
+		}
+	}
+
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Return the oldest batch of blocks in a full magazine to their
+ * pages. Pages that become entirely free are released after the
+ * lock is dropped.
+ */
+static
+void
+magazine_drain(struct magazine *mag, unsigned blktype)
+{
+	vaddr_t freepages[MAG_MAXROUNDS];
+	unsigned i, batch, nfreepages;
+	struct pageref *pr;
+	vaddr_t ptraddr, prpage;
+
+	batch = magazine_batch(blktype);
+	KASSERT(batch <= mag->mag_rounds);
+	nfreepages = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+
+	for (i=0; i<batch; i++) {
+		ptraddr = (vaddr_t)mag->mag_blocks[i];
+		pr = subpage_findpage(ptraddr);
+		KASSERT(pr != NULL);
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		prpage = PR_PAGEADDR(pr);
+		if (subpage_pushblock(pr, ptraddr - prpage)) {
+			freepages[nfreepages++] = prpage;
+		}
+	}
+
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+
+	for (i=batch; i<mag->mag_rounds; i++) {
+		mag->mag_blocks[i - batch] = mag->mag_blocks[i];
+	}
+	mag->mag_rounds -= batch;
+}
+
+/*
+ * Get a block of type BLKTYPE from this cpu's magazine, refilling it
+ * if it's empty. Returns NULL if that didn't work; the caller should
+ * then fall back to subpage_kmalloc's own path.
+ */
+static
+void *
+magazine_alloc(unsigned blktype)
+{
+	struct magazine *mag;
+	void *ret;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	/* Interrupts off, so we stay on this cpu and nothing else here
+	 * touches the magazine. */
+	spl = splhigh();
+	KASSERT(curcpu->c_number < MAXCPUS);
+	mag = &magazines[curcpu->c_number][blktype];
+
+	if (mag->mag_rounds > 0) {
+		mag->mag_allochits++;
+	}
+	else {
+		mag->mag_allocmisses++;
+		magazine_refill(mag, blktype);
+		if (mag->mag_rounds == 0) {
+			splx(spl);
+			return NULL;
+		}
+	}
+
+	ret = mag->mag_blocks[--mag->mag_rounds];
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Put a block of type BLKTYPE, already filled with deadbeef, into
+ * this cpu's magazine, draining the magazine first if it's full.
+ */
+static
+void
+magazine_free(void *ptr, unsigned blktype)
+{
+	struct magazine *mag;
+	int spl;
+
+	spl = splhigh();
+	KASSERT(curcpu->c_number < MAXCPUS);
+	mag = &magazines[curcpu->c_number][blktype];
+
+	if (mag->mag_rounds < magazine_capacity(blktype)) {
+		mag->mag_freehits++;
+	}
+	else {
+		mag->mag_freemisses++;
+		magazine_drain(mag, blktype);
+	}
+
+	mag->mag_blocks[mag->mag_rounds++] = ptr;
+	splx(spl);
+}
+
+#endif /* MAGAZINES */
+
 /*
  * Allocate a block of size SZ, where SZ is not large enough to
  * warrant a whole-page allocation.
@@ -907,6 +1426,13 @@ subpage_kmalloc(size_t sz
 	sz = sizes[blktype];
 #endif
 
+#ifdef MAGAZINES
+	retptr = magazine_alloc(blktype);
+	if (retptr != NULL) {
+		return retptr;
+	}
+#endif
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
@@ -921,25 +1447,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_popblock(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -1013,6 +1521,8 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+	pagemap_set(pagemap_index(prpage), (uintptr_t)pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -1029,8 +1539,6 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
@@ -1061,34 +1569,14 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_findpage(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1102,46 +1590,31 @@ subpage_kfree(void *ptr)
 	checkguardband(ptraddr, smallerblocksize, blocksize);
 #endif
 
+#ifdef MAGAZINES
+	if (CURCPU_EXISTS()) {
+		/*
+		 * Stash it in this cpu's magazine. That doesn't need
+		 * the lock; it only goes back to its page when the
+		 * magazine overflows.
+		 */
+		fill_deadbeef((void *)ptraddr, sizes[blktype]);
+		magazine_free((void *)ptraddr, blktype);
+		return 0;
+	}
+#endif
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
-
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+	if (subpage_pushblock(pr, offset)) {
 		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1159,12 +1632,254 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+//
+////////////////////////////////////////////////////////////
+//
+// Span allocator for large blocks.
+//
+//    Blocks too big for the subpage allocator are carved out of
+//    spans: runs of physically contiguous pages from alloc_kpages.
+//    Each size class in spansizes[] has its own span size, picked so
+//    the class's blocks fill the span exactly; the sizes that aren't
+//    whole pages (3K, 6K, 10K) put several blocks in one span, so a
+//    request just over 2K no longer costs a whole page. Blocks larger
+//    than the biggest class get a span of their own, rounded up to
+//    whole pages.
+//
+//    Every page of a span is entered in pagemap[], so kfree can tell
+//    in constant time whether a pointer is in a span and which one.
+//
+//    Spans are released as soon as all their blocks are free.
+//
+
+static const struct spansize {
+	size_t ss_size;		/* block size */
+	unsigned ss_npages;	/* pages per span */
+} spansizes[] = {
+	{  3072,  3 },
+	{  4096,  1 },
+	{  6144,  3 },
+	{  8192,  2 },
+	{ 10240,  5 },
+	{ 12288,  3 },
+	{ 16384,  4 },
+	{ 20480,  5 },
+	{ 24576,  6 },
+	{ 28672,  7 },
+	{ 32768,  8 },
+	{ 36864,  9 },
+	{ 40960, 10 },
+	{ 45056, 11 },
+	{ 49152, 12 },
+	{ 53248, 13 },
+	{ 57344, 14 },
+	{ 61440, 15 },
+	{ 65536, 16 },
+};
+#define NSPANSIZES ARRAYCOUNT(spansizes)
+
+/* Span class for blocks bigger than the largest size class. */
+#define SPAN_ONEOFF NSPANSIZES
+
+struct span {
+	struct span *sp_next;		/* on spanbases[sp_class] */
+	vaddr_t sp_addr;		/* first page */
+	unsigned sp_npages;
+	unsigned sp_class;		/* index into spansizes[] or ONEOFF */
+	unsigned sp_nblocks;		/* blocks in this span */
+	unsigned sp_nfree;		/* free blocks */
+	uint32_t sp_freemap;		/* bit i set: block i is free */
+};
+
+/* Protects the span lists and the span entries in pagemap[]. */
+static struct spinlock span_spinlock = SPINLOCK_INITIALIZER;
+static struct span *spanbases[NSPANSIZES + 1];
+
+/*
+ * Block size of the blocks in span SP.
+ */
+static
+size_t
+span_blocksize(struct span *sp)
+{
+	if (sp->sp_class == SPAN_ONEOFF) {
+		return sp->sp_npages * PAGE_SIZE;
+	}
+	return spansizes[sp->sp_class].ss_size;
+}
+
+/*
+ * Allocate a block of size SZ from a span.
+ */
+static
+void *
+span_kmalloc(size_t sz)
+{
+	unsigned spclass, npages, index, i;
+	struct span *sp;
+	vaddr_t addr;
+
+	for (spclass = 0; spclass < NSPANSIZES; spclass++) {
+		if (sz <= spansizes[spclass].ss_size) {
+			break;
+		}
+	}
+
+	if (spclass < NSPANSIZES) {
+		/* Try the spans we already have. */
+		spinlock_acquire(&span_spinlock);
+		for (sp = spanbases[spclass]; sp != NULL; sp = sp->sp_next) {
+			KASSERT(sp->sp_class == spclass);
+			if (sp->sp_nfree == 0) {
+				continue;
+			}
+			for (i=0; (sp->sp_freemap & (1U << i)) == 0; i++) {
+				KASSERT(i < sp->sp_nblocks);
+			}
+			sp->sp_freemap &= ~(1U << i);
+			sp->sp_nfree--;
+			addr = sp->sp_addr + i * spansizes[spclass].ss_size;
+			spinlock_release(&span_spinlock);
+			return (void *)addr;
+		}
+		spinlock_release(&span_spinlock);
+		npages = spansizes[spclass].ss_npages;
+	}
+	else {
+		npages = (sz + PAGE_SIZE - 1) / PAGE_SIZE;
+	}
+
+	/*
+	 * Make a new span. Get the bookkeeping and the pages without
+	 * the lock; we put the span on the lists afterwards.
+	 */
+	sp = kmalloc(sizeof(*sp));
+	if (sp == NULL) {
+		return NULL;
+	}
+	addr = alloc_kpages(npages);
+	if (addr == 0) {
+		kfree(sp);
+		return NULL;
+	}
+	KASSERT(addr % PAGE_SIZE == 0);
+
+	sp->sp_addr = addr;
+	sp->sp_npages = npages;
+	sp->sp_class = spclass;
+	sp->sp_nblocks = npages * PAGE_SIZE / span_blocksize(sp);
+	KASSERT(sp->sp_nblocks >= 1 && sp->sp_nblocks < 32);
+	/* all free but block 0, which is ours */
+	sp->sp_freemap = ((1U << sp->sp_nblocks) - 1) & ~1U;
+	sp->sp_nfree = sp->sp_nblocks - 1;
+
+	index = pagemap_index(addr);
+	KASSERT(index + npages <= PAGEMAP_PAGES);
+
+	spinlock_acquire(&span_spinlock);
+	for (i=0; i<npages; i++) {
+		pagemap_set(index + i, (uintptr_t)sp | PM_SPAN);
+	}
+	sp->sp_next = spanbases[spclass];
+	spanbases[spclass] = sp;
+	spinlock_release(&span_spinlock);
+
+	return (void *)addr;
+}
+
+/*
+ * Free a block previously returned from span_kmalloc. If the pointer
+ * is not in any span, return -1.
+ */
+static
+int
+span_kfree(void *ptr)
+{
+	vaddr_t ptraddr, offset;
+	struct span *sp, **spp;
+	unsigned index, i, block;
+	size_t blocksize;
+
+	ptraddr = (vaddr_t)ptr;
+	index = pagemap_index(ptraddr);
+	sp = pagemap_span(index);
+	if (sp == NULL) {
+		return -1;
+	}
+
+	spinlock_acquire(&span_spinlock);
+
+	blocksize = span_blocksize(sp);
+	offset = ptraddr - sp->sp_addr;
+	if (offset >= sp->sp_npages * PAGE_SIZE || offset % blocksize != 0) {
+		panic("kfree: span free of invalid addr %p\n", ptr);
+	}
+	block = offset / blocksize;
+	if (sp->sp_freemap & (1U << block)) {
+		panic("kfree: span free of free block %p\n", ptr);
+	}
+
+	sp->sp_freemap |= 1U << block;
+	sp->sp_nfree++;
+	if (sp->sp_nfree < sp->sp_nblocks) {
+		spinlock_release(&span_spinlock);
+		return 0;
+	}
+
+	/* Whole span is free; take it apart. */
+	for (spp = &spanbases[sp->sp_class]; *spp != sp;
+	     spp = &(*spp)->sp_next) {
+		KASSERT(*spp != NULL);
+	}
+	*spp = sp->sp_next;
+	/* PTR may be on any page of the span; start from the first. */
+	index = pagemap_index(sp->sp_addr);
+	for (i=0; i<sp->sp_npages; i++) {
+		KASSERT(pagemap_span(index + i) == sp);
+		pagemap_clear(index + i);
+	}
+	spinlock_release(&span_spinlock);
+
+	for (i=0; i<sp->sp_npages; i++) {
+		free_kpages(sp->sp_addr + i * PAGE_SIZE);
+	}
+	kfree(sp);
+
+	return 0;
+}
+
+/*
+ * Print the spans.
+ */
+static
+void
+span_stats(void)
+{
+	struct span *sp;
+	unsigned spclass;
+
+	spinlock_acquire(&span_spinlock);
+
+	kprintf("Span allocator status:\n");
+	for (spclass = 0; spclass <= NSPANSIZES; spclass++) {
+		for (sp = spanbases[spclass]; sp != NULL; sp = sp->sp_next) {
+			kprintf("at 0x%08lx: %2u pages  size %-6lu  "
+				"%u/%u free\n",
+				(unsigned long)sp->sp_addr, sp->sp_npages,
+				(unsigned long)span_blocksize(sp),
+				sp->sp_nfree, sp->sp_nblocks);
+		}
+	}
+
+	spinlock_release(&span_spinlock);
+}
+
 //
 ////////////////////////////////////////////////////////////
 
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * span_kmalloc depending on how big SZ is.
  */
 void *
 kmalloc(size_t sz)
@@ -1184,18 +1899,7 @@ kmalloc(size_t sz)
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
-		unsigned long npages;
-		vaddr_t address;
-
-		/* Round up to a whole number of pages. */
-		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
-		}
-		KASSERT(address % PAGE_SIZE == 0);
-
-		return (void *)address;
+		return span_kmalloc(sz);
 	}
 
 #ifdef LABELS
@@ -1212,10 +1916,13 @@ void
 kfree(void *ptr)
 {
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Both allocators find the owner of the block in pagemap[].
+	 * Failing both, assume it's a bare alloc_kpages page.
 	 */
 	if (ptr == NULL) {
 		return;
+	} else if (span_kfree(ptr) == 0) {
+		return;
 	} else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
@@ -4,11 +4,21 @@
 #include <thread.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <kcache.h>
 #include <machine/tlb.h>
 
 
+struct kcache *hpt_cache;
+
 void vm_bootstrap(void) {
         init_ft_hpt();
+
+        /* hpt entries come and go with every page of every process */
+        hpt_cache = kcache_create("hpt_entry", sizeof(struct hpt_entry),
+                                  NULL, NULL);
+        if (hpt_cache == NULL) {
+                panic("vm_bootstrap: Out of memory\n");
+        }
 }
 
 int vm_fault(int faulttype, vaddr_t faultaddress) {
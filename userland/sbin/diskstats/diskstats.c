@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <kern/diskstats.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+/*
+ * diskstats - print disk I/O statistics.
+ * Usage: diskstats [-c] [device...]
+ *    -c   Clear the statistics after printing them.
+ *
+ * With no devices, reports on lhd0raw: and lhd1raw:, skipping any
+ * that don't exist.
+ */
+
+#define ARRAYCOUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static const char *const defaultdevs[] = { "lhd0raw:", "lhd1raw:" };
+
+static
+void
+printrw(const char *what, const struct diskstats_rw *dr)
+{
+	uint64_t lat;
+	unsigned i;
+
+	printf("  %s: %u requests, %u errors, %u merged, %llu bytes\n",
+	       what, dr->dr_requests, dr->dr_errors, dr->dr_merged,
+	       (unsigned long long)dr->dr_bytes);
+	if (dr->dr_requests == 0) {
+		return;
+	}
+	printf("    avg wait %llu usec, avg service %llu usec\n",
+	       (unsigned long long)(dr->dr_waitusecs / dr->dr_requests),
+	       (unsigned long long)(dr->dr_svcusecs / dr->dr_requests));
+	for (i=0; i<DISKSTATS_NBUCKETS; i++) {
+		if (dr->dr_hist[i] == 0) {
+			continue;
+		}
+		lat = (uint64_t)1 << i;
+		if (i == DISKSTATS_NBUCKETS - 1) {
+			printf("    >= %8llu usec: %u\n",
+			       (unsigned long long)lat, dr->dr_hist[i]);
+		}
+		else {
+			printf("    <  %8llu usec: %u\n",
+			       (unsigned long long)(lat * 2), dr->dr_hist[i]);
+		}
+	}
+}
+
+/*
+ * Print (and maybe clear) one device. If QUIET, a device that
+ * can't be opened isn't an error.
+ */
+static
+int
+dodisk(const char *dev, int clear, int quiet)
+{
+	struct diskstats ds;
+	int fd;
+
+	fd = open(dev, O_RDONLY);
+	if (fd < 0) {
+		if (!quiet) {
+			warn("%s", dev);
+		}
+		return quiet ? 0 : 1;
+	}
+	if (ioctl(fd, DIOCGSTATS, &ds) < 0) {
+		warn("%s: DIOCGSTATS", dev);
+		close(fd);
+		return 1;
+	}
+
+	printf("%s %u sectors, %u rpm\n", dev, ds.ds_nsects, ds.ds_rpm);
+	printf("  %u submitted in %u runs; depth %u, max %u",
+	       ds.ds_submits, ds.ds_runs, ds.ds_depth, ds.ds_maxdepth);
+	if (ds.ds_submits > 0) {
+		printf(", avg %llu",
+		       (unsigned long long)(ds.ds_depthsum / ds.ds_submits));
+	}
+	printf("\n");
+	printrw("read ", &ds.ds_read);
+	printrw("write", &ds.ds_write);
+
+	if (clear && ioctl(fd, DIOCCLRSTATS, NULL) < 0) {
+		warn("%s: DIOCCLRSTATS", dev);
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned j;
+	int i, clear = 0, ret = 0;
+
+	for (i=1; i<argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-c")) {
+			clear = 1;
+		}
+		else {
+			errx(1, "Usage: diskstats [-c] [device...]");
+		}
+	}
+
+	if (i == argc) {
+		for (j=0; j<ARRAYCOUNT(defaultdevs); j++) {
+			ret |= dodisk(defaultdevs[j], clear, 1);
+		}
+	}
+	else {
+		for (; i<argc; i++) {
+			ret |= dodisk(argv[i], clear, 0);
+		}
+	}
+	return ret;
+}
@@ -132,16 +132,45 @@ dumplval(const char *desc, const char *lval)
 
 static void dumpinode(uint32_t ino, const char *name);
 
+/* The volume's block size, from the superblock */
+static uint32_t blocksize = SFS_BLOCKSIZE;
+
+/*
+ * Read the first LEN bytes of block BLOCK; for the superblock and
+ * inodes, which are smaller than a block on volumes with big blocks.
+ */
+static
+void
+diskreadpart(void *data, size_t len, uint32_t block)
+{
+	static char buf[SFS_MAXBLOCKSIZE];
+
+	assert(len <= blocksize);
+	diskread(buf, block);
+	memcpy(data, buf, len);
+}
+
 static
 uint32_t
 readsb(void)
 {
 	struct sfs_superblock sb;
+	uint32_t bs;
 
-	diskread(&sb, SFS_SUPER_BLOCK);
+	diskreadpart(&sb, sizeof(sb), SFS_SUPER_BLOCK);
 	if (SWAP32(sb.sb_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	bs = SWAP32(sb.sb_blocksize);
+	if (bs == 0) {
+		bs = SFS_BLOCKSIZE;
+	}
+	if (bs < SFS_BLOCKSIZE || bs > SFS_MAXBLOCKSIZE ||
+	    (bs & (bs - 1)) != 0) {
+		errx(1, "Invalid block size %u in superblock", bs);
+	}
+	blocksize = bs;
+	disksetblocksize(bs);
 	return SWAP32(sb.sb_nblocks);
 }
 
@@ -152,7 +181,7 @@ dumpsb(void)
 	struct sfs_superblock sb;
 	unsigned i;
 
-	diskread(&sb, SFS_SUPER_BLOCK);
+	diskreadpart(&sb, sizeof(sb), SFS_SUPER_BLOCK);
 	sb.sb_volname[sizeof(sb.sb_volname)-1] = 0;
 
 	printf("Superblock\n");
@@ -160,9 +189,19 @@ dumpsb(void)
 	dumpvalf("Magic", "0x%8x", SWAP32(sb.sb_magic));
 	dumpvalf("Size", "%u blocks", SWAP32(sb.sb_nblocks));
 	dumpvalf("Freemap size", "%u blocks",
-		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
-	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
+		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks), blocksize));
+	dumpvalf("Block size", "%u bytes", blocksize);
 	dumplval("Volume name", sb.sb_volname);
+	if (SWAP32(sb.sb_journalblocks) == 0) {
+		dumpval("Journal", "none");
+	}
+	else {
+		dumpvalf("Journal", "%u blocks at %u",
+			 SWAP32(sb.sb_journalblocks),
+			 SWAP32(sb.sb_journalstart));
+		dumpvalf("Journal sequence", "%u",
+			 SWAP32(sb.sb_journalseq));
+	}
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -177,9 +216,10 @@ static
 void
 dumpfreemap(uint32_t fsblocks)
 {
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
+	uint32_t bitsperblock = SFS_BITSPERBLOCK(blocksize);
 	uint32_t i, j, k, bn;
-	uint8_t data[SFS_BLOCKSIZE], mask;
+	uint8_t data[SFS_MAXBLOCKSIZE], mask;
 	char tmp[16];
 
 	printf("Free block bitmap\n");
@@ -189,16 +229,16 @@ dumpfreemap(uint32_t fsblocks)
 		printf("    Freemap block #%u in disk block %u: blocks %u - %u"
 		       " (0x%x - 0x%x)\n",
 		       i, SFS_FREEMAP_START+i,
-		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1,
-		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1);
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		       i*bitsperblock, (i+1)*bitsperblock - 1,
+		       i*bitsperblock, (i+1)*bitsperblock - 1);
+		for (j=0; j<blocksize; j++) {
 			if (j % 8 == 0) {
 				snprintf(tmp, sizeof(tmp), "0x%x",
-					 i*SFS_BITSPERBLOCK + j*8);
+					 i*bitsperblock + j*8);
 				printf("%-7s ", tmp);
 			}
 			for (k=0; k<8; k++) {
-				bn = i*SFS_BITSPERBLOCK + j*8 + k;
+				bn = i*bitsperblock + j*8 + k;
 				mask = 1U << k;
 				if (bn >= fsblocks) {
 					if (data[j] & mask) {
@@ -230,19 +270,21 @@ dumpfreemap(uint32_t fsblocks)
 
 static
 void
-dumpindirect(uint32_t block)
+dumpindirect(uint32_t block, unsigned levels)
 {
-	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	static const char *const names[] = { "", "", "Double ", "Triple " };
+	uint32_t ib[SFS_MAXBLOCKSIZE/sizeof(uint32_t)];
+	unsigned nib = blocksize/sizeof(uint32_t);
 	char tmp[128];
 	unsigned i;
 
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	printf("%sIndirect block %u\n", names[levels], block);
 
 	diskread(ib, block);
-	for (i=0; i<ARRAYCOUNT(ib); i++) {
+	for (i=0; i<nib; i++) {
 		if (i % 4 == 0) {
 			printf("@%-3u   ", i);
 		}
@@ -253,14 +295,20 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+	if (levels > 1) {
+		for (i=0; i<nib; i++) {
+			dumpindirect(SWAP32(ib[i]), levels - 1);
+		}
+	}
 }
 
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned levels, void (*doblock)(uint32_t, uint32_t))
 {
-	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t ib[SFS_MAXBLOCKSIZE/sizeof(uint32_t)];
+	unsigned nib = blocksize/sizeof(uint32_t);
 	unsigned i;
 
 	if (block == 0) {
@@ -269,12 +317,131 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 	else {
 		diskread(ib, block);
 	}
-	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+	for (i=0; i<nib && fileblock < numblocks; i++) {
+		if (levels > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), levels - 1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
 
+static
+void
+dumpextents(const struct sfs_extent *exts, unsigned n, bool isindex)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		if (isindex) {
+			printf("@%-3u   from block %u: extent block %u\n", i,
+			       SWAP32(exts[i].sfe_fileblock),
+			       SWAP32(exts[i].sfe_diskblock));
+		}
+		else {
+			printf("@%-3u   blocks %u-%u: disk blocks %u-%u\n", i,
+			       SWAP32(exts[i].sfe_fileblock),
+			       SWAP32(exts[i].sfe_fileblock) +
+			       SWAP32(exts[i].sfe_len) - 1,
+			       SWAP32(exts[i].sfe_diskblock),
+			       SWAP32(exts[i].sfe_diskblock) +
+			       SWAP32(exts[i].sfe_len) - 1);
+		}
+	}
+}
+
+static
+void
+dumpextblock(uint32_t block)
+{
+	uint32_t buf[SFS_MAXBLOCKSIZE/sizeof(uint32_t)];
+	struct sfs_extblock *eb = (struct sfs_extblock *)buf;
+	unsigned n;
+
+	printf("Extent block %u\n", block);
+
+	diskread(buf, block);
+	n = SWAP32(eb->seb_nextents);
+	if (n > SFS_EXTPERBLOCK(blocksize)) {
+		warnx("Warning: extent block claims %u extents", n);
+		n = SFS_EXTPERBLOCK(blocksize);
+	}
+	dumpextents(eb->seb_extents, n, false);
+}
+
+/*
+ * Look up FILEBLOCK in the N extents EXTS.
+ */
+static
+uint32_t
+extbmap(const struct sfs_extent *exts, unsigned n, uint32_t fileblock,
+	bool isindex)
+{
+	uint32_t start, len;
+	unsigned i;
+
+	for (i=n; i-- > 0; ) {
+		start = SWAP32(exts[i].sfe_fileblock);
+		len = SWAP32(exts[i].sfe_len);
+		if (start > fileblock) {
+			continue;
+		}
+		if (isindex) {
+			return SWAP32(exts[i].sfe_diskblock);
+		}
+		if (fileblock - start < len) {
+			return SWAP32(exts[i].sfe_diskblock) +
+				(fileblock - start);
+		}
+		break;
+	}
+	return 0;
+}
+
+static
+void
+traverse_ext(const struct sfs_dinode *sfi, uint32_t numblocks,
+	     void (*doblock)(uint32_t, uint32_t))
+{
+	uint32_t buf[SFS_MAXBLOCKSIZE/sizeof(uint32_t)];
+	struct sfs_extblock *eb = (struct sfs_extblock *)buf;
+	uint32_t fileblock, ebblock, curebblock;
+	unsigned n, ebn = 0;
+
+	n = SWAP16(sfi->sfi_nextents);
+	if (n > SFS_NINOEXTENTS) {
+		n = SFS_NINOEXTENTS;
+	}
+
+	curebblock = 0;
+	for (fileblock = 0; fileblock < numblocks; fileblock++) {
+		if (SWAP16(sfi->sfi_extdepth) == 0) {
+			doblock(fileblock, extbmap(sfi->sfi_extents, n,
+						   fileblock, false));
+			continue;
+		}
+		ebblock = extbmap(sfi->sfi_extents, n, fileblock, true);
+		if (ebblock == 0) {
+			doblock(fileblock, 0);
+			continue;
+		}
+		if (ebblock != curebblock) {
+			diskread(buf, ebblock);
+			curebblock = ebblock;
+			ebn = SWAP32(eb->seb_nextents);
+			if (ebn > SFS_EXTPERBLOCK(blocksize)) {
+				ebn = SFS_EXTPERBLOCK(blocksize);
+			}
+		}
+		doblock(fileblock, extbmap(eb->seb_extents, ebn,
+					   fileblock, false));
+	}
+}
+
 static
 void
 traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
@@ -283,7 +450,12 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	uint32_t numblocks;
 	unsigned i;
 
-	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE);
+	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), blocksize);
+
+	if (SWAP32(sfi->sfi_flags) & SFS_IF_EXTENTS) {
+		traverse_ext(sfi, numblocks, doblock);
+		return;
+	}
 
 	fileblock = 0;
 	for (i=0; i<SFS_NDIRECT && fileblock < numblocks; i++) {
@@ -291,32 +463,70 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1,
+					doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2,
+					doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3,
+					doblock);
 	}
 	assert(fileblock == numblocks);
 }
 
+/* number of buckets if the directory being dumped is hashed, else 0 */
+static uint32_t dirbuckets;
+
+static
+uint32_t
+dirhash(const char *name)
+{
+	uint32_t h;
+	unsigned i;
+
+	h = SFS_DIRHASH_BASIS;
+	for (i=0; i<SFS_NAMELEN && name[i] != 0; i++) {
+		h = (h ^ (unsigned char)name[i]) * SFS_DIRHASH_PRIME;
+	}
+	return h;
+}
+
 static
 void
 dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 {
-	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	struct sfs_direntry sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_direntry)];
+	int nsds = blocksize/sizeof(struct sfs_direntry);
 	int i;
 
-	(void)fileblock;
 	if (diskblock == 0) {
 		printf("    [block %u - empty]\n", diskblock);
 		return;
 	}
 	diskread(&sds, diskblock);
 
-	printf("    [block %u]\n", diskblock);
+	if (dirbuckets > 0) {
+		printf("    [block %u - bucket %u]\n", diskblock, fileblock);
+	}
+	else {
+		printf("    [block %u]\n", diskblock);
+	}
 	for (i=0; i<nsds; i++) {
 		uint32_t ino = SWAP32(sds[i].sfd_ino);
 		if (ino==SFS_NOINO) {
 			printf("        [free entry]\n");
 		}
+		else if (dirbuckets > 0) {
+			sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
+			printf("        %u %s (home bucket %u)\n", ino,
+			       sds[i].sfd_name,
+			       dirhash(sds[i].sfd_name) & (dirbuckets - 1));
+		}
 		else {
 			sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
 			printf("        %u %s\n", ino, sds[i].sfd_name);
@@ -335,6 +545,16 @@ dumpdir(uint32_t ino, const struct sfs_dinode *sfi)
 		warnx("Warning: dir size is not a multiple of dir entry size");
 	}
 	printf("Directory contents for inode %u: %d entries\n", ino, nentries);
+	dirbuckets = 0;
+	if (SWAP32(sfi->sfi_flags) & SFS_IF_HASHDIR) {
+		dirbuckets = SWAP32(sfi->sfi_size) / blocksize;
+		if (SWAP32(sfi->sfi_size) % blocksize != 0 ||
+		    (dirbuckets & (dirbuckets - 1)) != 0) {
+			warnx("Warning: hashed dir size is not a power "
+			      "of two blocks");
+			dirbuckets = 0;
+		}
+	}
 	traverse(sfi, dumpdirblock);
 }
 
@@ -342,8 +562,8 @@ static
 void
 recursedirblock(uint32_t fileblock, uint32_t diskblock)
 {
-	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	struct sfs_direntry sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_direntry)];
+	int nsds = blocksize/sizeof(struct sfs_direntry);
 	int i;
 
 	(void)fileblock;
@@ -377,20 +597,20 @@ recursedir(uint32_t ino, const struct sfs_dinode *sfi)
 static
 void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 {
-	uint8_t data[SFS_BLOCKSIZE];
+	uint8_t data[SFS_MAXBLOCKSIZE];
 	unsigned i, j;
 	char tmp[128];
 
 	if (diskblock == 0) {
-		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
+		printf("    0x%6x  [sparse]\n", fileblock * blocksize);
 		return;
 	}
 
 	diskread(data, diskblock);
-	for (i=0; i<SFS_BLOCKSIZE; i++) {
+	for (i=0; i<blocksize; i++) {
 		if (i % 16 == 0) {
 			snprintf(tmp, sizeof(tmp), "0x%x",
-				 fileblock * SFS_BLOCKSIZE + i);
+				 fileblock * blocksize + i);
 			printf("%8s", tmp);
 		}
 		if (i % 8 == 0) {
@@ -425,32 +645,11 @@ dumpfile(uint32_t ino, const struct sfs_dinode *sfi)
 
 static
 void
-dumpinode(uint32_t ino, const char *name)
+dumpblockptrs(const struct sfs_dinode *sfi)
 {
-	struct sfs_dinode sfi;
-	const char *typename;
 	char tmp[128];
 	unsigned i;
 
-	diskread(&sfi, ino);
-
-	printf("Inode %u", ino);
-	if (name != NULL) {
-		printf(" (%s)", name);
-	}
-	printf("\n");
-	printf("--------------\n");
-
-	switch (SWAP16(sfi.sfi_type)) {
-	    case SFS_TYPE_FILE: typename = "regular file"; break;
-	    case SFS_TYPE_DIR: typename = "directory"; break;
-	    default: typename = "invalid"; break;
-	}
-	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
-	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
-	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
-	printf("\n");
-
         printf("    Direct blocks:\n");
         for (i=0; i<SFS_NDIRECT; i++) {
 		if (i % 4 == 0) {
@@ -465,7 +664,8 @@ dumpinode(uint32_t ino, const char *name)
 		 * number print then needs up to 16 digits.
 		 */
 		snprintf(tmp, sizeof(tmp), "%u (0x%x)",
-			 SWAP32(sfi.sfi_direct[i]), SWAP32(sfi.sfi_direct[i]));
+			 SWAP32(sfi->sfi_direct[i]),
+			 SWAP32(sfi->sfi_direct[i]));
 		printf("  %-16s", tmp);
 		if (i % 4 == 3) {
 			printf("\n");
@@ -475,7 +675,67 @@ dumpinode(uint32_t ino, const char *name)
 		printf("\n");
 	}
 	printf("    Indirect block: %u (0x%x)\n",
-	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
+	       SWAP32(sfi->sfi_indirect), SWAP32(sfi->sfi_indirect));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi->sfi_dindirect), SWAP32(sfi->sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi->sfi_tindirect), SWAP32(sfi->sfi_tindirect));
+}
+
+static
+void
+dumpinoextents(const struct sfs_dinode *sfi)
+{
+	unsigned n = SWAP16(sfi->sfi_nextents);
+	bool isindex = SWAP16(sfi->sfi_extdepth) > 0;
+
+	printf("    %s (depth %u, %u entries):\n",
+	       isindex ? "Extent index" : "Extents",
+	       SWAP16(sfi->sfi_extdepth), n);
+	if (n > SFS_NINOEXTENTS) {
+		n = SFS_NINOEXTENTS;
+	}
+	dumpextents(sfi->sfi_extents, n, isindex);
+}
+
+static
+void
+dumpinode(uint32_t ino, const char *name)
+{
+	struct sfs_dinode sfi;
+	const char *typename;
+	unsigned i;
+
+	diskreadpart(&sfi, sizeof(sfi), ino);
+
+	printf("Inode %u", ino);
+	if (name != NULL) {
+		printf(" (%s)", name);
+	}
+	printf("\n");
+	printf("--------------\n");
+
+	switch (SWAP16(sfi.sfi_type)) {
+	    case SFS_TYPE_FILE: typename = "regular file"; break;
+	    case SFS_TYPE_DIR: typename = "directory"; break;
+	    default: typename = "invalid"; break;
+	}
+	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
+	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
+	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
+	dumpvalf("Flags", "0x%x%s%s", SWAP32(sfi.sfi_flags),
+		 (SWAP32(sfi.sfi_flags) & SFS_IF_HASHDIR) ?
+		 " (hashed directory)" : "",
+		 (SWAP32(sfi.sfi_flags) & SFS_IF_EXTENTS) ?
+		 " (extents)" : "");
+	printf("\n");
+
+	if (SWAP32(sfi.sfi_flags) & SFS_IF_EXTENTS) {
+		dumpinoextents(&sfi);
+	}
+	else {
+		dumpblockptrs(&sfi);
+	}
 	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
 		if (sfi.sfi_waste[i] != 0) {
 			printf("    Word %u in waste area: 0x%x\n",
@@ -484,7 +744,20 @@ dumpinode(uint32_t ino, const char *name)
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		if (SWAP32(sfi.sfi_flags) & SFS_IF_EXTENTS) {
+			if (SWAP16(sfi.sfi_extdepth) > 0) {
+				for (i=0; i<SWAP16(sfi.sfi_nextents) &&
+					    i<SFS_NINOEXTENTS; i++) {
+					dumpextblock(SWAP32(
+					    sfi.sfi_extents[i].sfe_diskblock));
+				}
+			}
+		}
+		else {
+			dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+			dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+			dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
+		}
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
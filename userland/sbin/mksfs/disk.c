@@ -41,14 +41,15 @@
 #include "disk.h"
 
 #define HOSTSTRING "System/161 Disk Image"
-#define BLOCKSIZE  512
+#define SECTORSIZE 512
 
 #ifndef EINTR
 #define EINTR 0
 #endif
 
 static int fd=-1;
-static uint32_t nblocks;
+static uint32_t nsectors;
+static uint32_t blocksize = SECTORSIZE;
 
 /*
  * Open a disk. If we're built for the host OS, check that it's a
@@ -68,10 +69,11 @@ opendisk(const char *path)
 		err(1, "%s: fstat", path);
 	}
 
-	nblocks = statbuf.st_size / BLOCKSIZE;
+	nsectors = statbuf.st_size / SECTORSIZE;
+	blocksize = SECTORSIZE;
 
 #ifdef HOST
-	nblocks--;
+	nsectors--;
 
 	{
 		char buf[64];
@@ -95,13 +97,27 @@ opendisk(const char *path)
 }
 
 /*
- * Return the block size. (This is fixed, but still...)
+ * Return the block size. This is the sector size until it's changed
+ * with disksetblocksize.
  */
 uint32_t
 diskblocksize(void)
 {
 	assert(fd>=0);
-	return BLOCKSIZE;
+	return blocksize;
+}
+
+/*
+ * Set the size of the blocks diskread and diskwrite transfer (and
+ * diskblocks counts) to SIZE, which should be the filesystem's block
+ * size. It must be a multiple of the sector size.
+ */
+void
+disksetblocksize(uint32_t size)
+{
+	assert(fd>=0);
+	assert(size > 0 && size % SECTORSIZE == 0);
+	blocksize = size;
 }
 
 /*
@@ -111,7 +127,27 @@ uint32_t
 diskblocks(void)
 {
 	assert(fd>=0);
-	return nblocks;
+	return nsectors / (blocksize / SECTORSIZE);
+}
+
+/*
+ * Seek to block BLOCK.
+ */
+static
+void
+diskseek(uint32_t block)
+{
+	off_t pos;
+
+	pos = (off_t)block * blocksize;
+#ifdef HOST
+	// skip over disk file header
+	pos += SECTORSIZE;
+#endif
+
+	if (lseek(fd, pos, SEEK_SET)<0) {
+		err(1, "lseek");
+	}
 }
 
 /*
@@ -126,17 +162,10 @@ diskwrite(const void *data, uint32_t block)
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
-	}
+	diskseek(block);
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < blocksize) {
+		len = write(fd, cdata + tot, blocksize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -162,17 +191,10 @@ diskread(void *data, uint32_t block)
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
-	}
+	diskseek(block);
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < blocksize) {
+		len = read(fd, cdata + tot, blocksize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -57,11 +58,25 @@
 
 #include "disk.h"
 
-/* Maximum size of freemap we support */
-#define MAXFREEMAPBLOCKS 32
+/* Maximum size of freemap we support, in bytes */
+#define MAXFREEMAPBYTES (32 * SFS_BLOCKSIZE)
 
 /* Free block bitmap */
-static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
+static char freemapbuf[MAXFREEMAPBYTES];
+
+/* Filesystem block size */
+static uint32_t blocksize = SFS_BLOCKSIZE;
+
+/*
+ * Journal size: 1/JOURNALFRACTION of the volume, within these limits.
+ * Volumes too small for the minimum don't get one.
+ */
+#define JOURNALFRACTION 64
+#define MINJOURNALBLOCKS 16
+#define MAXJOURNALBLOCKS 256
+
+/* Journal location (goes right after the freemap) */
+static uint32_t journalstart, journalblocks;
 
 /*
  * Assert that the on-disk data structures are correctly sized.
@@ -72,7 +87,27 @@ check(void)
 {
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	/* hashed directories use whole blocks as buckets */
+	assert(SFS_DIRENTPERBLOCK(SFS_BLOCKSIZE) *
+	       sizeof(struct sfs_direntry) == SFS_BLOCKSIZE);
+}
+
+/*
+ * Write LEN bytes of DATA at the start of block BLOCK, and zeros in
+ * the rest of it.
+ */
+static
+void
+writeblock(const void *data, size_t len, uint32_t block)
+{
+	static char buf[SFS_MAXBLOCKSIZE];
+
+	assert(len <= blocksize);
+	memcpy(buf, data, len);
+	bzero(buf + len, blocksize - len);
+	diskwrite(buf, block);
 }
 
 /*
@@ -96,13 +131,13 @@ static
 void
 initfreemap(uint32_t fsblocks)
 {
-	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks);
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks, blocksize);
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
 	uint32_t i;
 
-	if (freemapblocks > MAXFREEMAPBLOCKS) {
+	if (freemapblocks * blocksize > MAXFREEMAPBYTES) {
 		errx(1, "Filesystem too large -- "
-		     "increase MAXFREEMAPBLOCKS and recompile");
+		     "increase MAXFREEMAPBYTES and recompile");
 	}
 
 	/* mark the superblock and root inode in use */
@@ -114,12 +149,38 @@ initfreemap(uint32_t fsblocks)
 		allocblock(SFS_FREEMAP_START + i);
 	}
 
+	/* and so must the journal's */
+	for (i=0; i<journalblocks; i++) {
+		allocblock(journalstart + i);
+	}
+
 	/* all blocks in the freemap but past the volume end are "in use" */
 	for (i=fsblocks; i<freemapbits; i++) {
 		allocblock(i);
 	}
 }
 
+/*
+ * Decide where the journal goes and how big it is.
+ */
+static
+void
+placejournal(uint32_t fsblocks)
+{
+	journalstart = SFS_FREEMAP_START +
+		SFS_FREEMAPBLOCKS(fsblocks, blocksize);
+	journalblocks = fsblocks / JOURNALFRACTION;
+	if (journalblocks > MAXJOURNALBLOCKS) {
+		journalblocks = MAXJOURNALBLOCKS;
+	}
+	if (journalblocks < MINJOURNALBLOCKS) {
+		journalblocks = MINJOURNALBLOCKS;
+	}
+	if (journalstart + journalblocks * 2 > fsblocks) {
+		journalstart = journalblocks = 0;
+	}
+}
+
 /*
  * Initialize and write out the superblock.
  */
@@ -140,9 +201,13 @@ writesuper(const char *volname, uint32_t nblocks)
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	sb.sb_journalstart = SWAP32(journalstart);
+	sb.sb_journalblocks = SWAP32(journalblocks);
+	sb.sb_journalseq = SWAP32(1);
+	sb.sb_blocksize = SWAP32(blocksize);
 
 	/* and write it out. */
-	diskwrite(&sb, SFS_SUPER_BLOCK);
+	writeblock(&sb, sizeof(sb), SFS_SUPER_BLOCK);
 }
 
 /*
@@ -157,13 +222,28 @@ writefreemap(uint32_t fsblocks)
 	uint32_t i;
 
 	/* Write out each of the blocks in the free block bitmap. */
-	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
 	for (i=0; i<freemapblocks; i++) {
-		ptr = freemapbuf + i*SFS_BLOCKSIZE;
+		ptr = freemapbuf + i*blocksize;
 		diskwrite(ptr, SFS_FREEMAP_START+i);
 	}
 }
 
+/*
+ * Clear the start of the journal, so there's no transaction in it.
+ */
+static
+void
+writejournal(void)
+{
+	char buf[SFS_BLOCKSIZE];
+
+	if (journalblocks > 0) {
+		bzero(buf, sizeof(buf));
+		writeblock(buf, sizeof(buf), journalstart);
+	}
+}
+
 /*
  * Write out the root directory inode.
  */
@@ -180,7 +260,7 @@ writerootdir(void)
 	sfi.sfi_linkcount = SWAP16(1);
 
 	/* Write it out */
-	diskwrite(&sfi, SFS_ROOTDIR_INO);
+	writeblock(&sfi, sizeof(sfi), SFS_ROOTDIR_INO);
 }
 
 /*
@@ -189,15 +269,27 @@ writerootdir(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, sectorsize;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	if (argc==5 && !strcmp(argv[1], "-b")) {
+		blocksize = strtoul(argv[2], &s, 0);
+		if (*s != 0 || blocksize < SFS_BLOCKSIZE ||
+		    blocksize > SFS_MAXBLOCKSIZE ||
+		    (blocksize & (blocksize - 1)) != 0) {
+			errx(1, "Block size must be a power of 2 "
+			     "from %u to %u", SFS_BLOCKSIZE, SFS_MAXBLOCKSIZE);
+		}
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-b blocksize] device/diskfile "
+		     "volume-name");
 	}
 
 	check();
@@ -220,18 +312,21 @@ main(int argc, char **argv)
 	}
 
 	opendisk(argv[1]);
-	blocksize = diskblocksize();
+	sectorsize = diskblocksize();
 
-	if (blocksize!=SFS_BLOCKSIZE) {
+	if (sectorsize!=SFS_BLOCKSIZE) {
 		errx(1, "Device has wrong blocksize %u (should be %u)\n",
-		     blocksize, SFS_BLOCKSIZE);
+		     sectorsize, SFS_BLOCKSIZE);
 	}
+	disksetblocksize(blocksize);
 	size = diskblocks();
 
 	/* Write out the on-disk structures */
+	placejournal(size);
 	initfreemap(size);
 	writesuper(volname, size);
 	writefreemap(size);
+	writejournal();
 	writerootdir();
 
 	closedisk();
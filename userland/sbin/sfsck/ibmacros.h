@@ -143,17 +143,18 @@
 
 /* region sizes */
 
-#define RANGE_D		1
-#define RANGE_I		(RANGE_D * SFS_DBPERIDB)
-#define RANGE_II	(RANGE_I * SFS_DBPERIDB)
-#define RANGE_III	(RANGE_II * SFS_DBPERIDB)
+/* these depend on the volume's block size, and can exceed 32 bits */
+#define RANGE_D		((uint64_t)1)
+#define RANGE_I		(RANGE_D * SFS_DBPERIDB(sfs_blocksize()))
+#define RANGE_II	(RANGE_I * SFS_DBPERIDB(sfs_blocksize()))
+#define RANGE_III	(RANGE_II * SFS_DBPERIDB(sfs_blocksize()))
 
 /* max blocks */
 
 #define INOMAX_D 	NUM_D
-#define INOMAX_I 	(INOMAX_D + SFS_DBPERIDB * NUM_I)
-#define INOMAX_II	(INOMAX_I + SFS_DBPERIDB * NUM_II)
-#define INOMAX_III	(INOMAX_II + SFS_DBPERIDB * NUM_III)
+#define INOMAX_I 	(INOMAX_D + RANGE_I * NUM_I)
+#define INOMAX_II	(INOMAX_I + RANGE_II * NUM_II)
+#define INOMAX_III	(INOMAX_II + RANGE_III * NUM_III)
 
 
 #endif /* IBMACROS_H */
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2009, 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "disk.h"
+#include "sfs.h"
+#include "sb.h"
+#include "journal.h"
+
+/*
+ * Fold a block into the checksum. The kernel computes it on the
+ * words as they are on disk, in its own byte order.
+ */
+static
+uint32_t
+checksum(uint32_t sum, const uint32_t *words)
+{
+	unsigned i;
+	uint32_t w;
+
+	for (i=0; i<sfs_blocksize() / sizeof(uint32_t); i++) {
+		w = SWAP32(words[i]);
+		sum = ((sum << 1) | (sum >> 31)) ^ w;
+	}
+	return sum;
+}
+
+/*
+ * Go through the transaction in the journal. If REPLAY is 0, return
+ * the number of blocks in it if it's complete and 0 if it isn't; if
+ * REPLAY is 1 (after checking), copy its blocks home.
+ */
+static
+uint32_t
+scan(int replay)
+{
+	uint32_t d[SFS_MAXBLOCKSIZE / sizeof(uint32_t)];
+	uint32_t data[SFS_MAXBLOCKSIZE / sizeof(uint32_t)];
+	struct sfs_jdesc *jd = (struct sfs_jdesc *)d;
+	struct sfs_jcommit *jc = (struct sfs_jcommit *)d;
+	uint32_t seq, jblock, jend, count, sum, n, home, i;
+
+	seq = sb_journalseq();
+	jblock = sb_journalstart();
+	jend = jblock + sb_journalblocks();
+	count = 0;
+	sum = 0;
+
+	while (jblock < jend) {
+		diskread(d, jblock++);
+		if (SWAP32(jd->jd_seq) != seq) {
+			return 0;
+		}
+		if (SWAP32(jc->jc_magic) == SFS_JCOMMIT_MAGIC) {
+			if (count > 0 && SWAP32(jc->jc_nblocks) == count &&
+			    SWAP32(jc->jc_checksum) == sum) {
+				return count;
+			}
+			return 0;
+		}
+		n = SWAP32(jd->jd_nblocks);
+		if (SWAP32(jd->jd_magic) != SFS_JDESC_MAGIC ||
+		    n == 0 || n > SFS_JDESCENTRIES(sfs_blocksize()) || n > jend - jblock) {
+			return 0;
+		}
+		for (i=0; i<n; i++) {
+			home = SWAP32(jd->jd_blocks[i]);
+			if (home >= sb_totalblocks() ||
+			    (home >= sb_journalstart() && home < jend)) {
+				return 0;
+			}
+			diskread(data, jblock++);
+			if (replay) {
+				diskwrite(data, home);
+			}
+			else {
+				sum = checksum(sum, data);
+			}
+			count++;
+		}
+	}
+	return 0;
+}
+
+void
+journal_replay(void)
+{
+	uint32_t n;
+
+	if (sb_journalblocks() == 0) {
+		return;
+	}
+
+	n = scan(0);
+	if (n == 0) {
+		return;
+	}
+	scan(1);
+	printf("Replayed %lu blocks from journal\n", (unsigned long)n);
+
+	/* That included the superblock */
+	sb_load();
+	sb_check();
+}
@@ -81,13 +81,15 @@ void
 check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		     int indirection)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	const uint32_t perib = SFS_DBPERIDB(sfs_blocksize());
+	uint32_t *entries;
 	uint32_t i, ct;
 	uint32_t coveredblocks;
 	int localchanged = 0;
 	int j;
 
 	if (*ientry > 0 && *ientry < ibs->volblocks) {
+		entries = domalloc(sfs_blocksize());
 		sfs_readindirect(*ientry, entries);
 		freemap_blockinuse(*ientry, B_IBLOCK, ibs->ino);
 	}
@@ -105,14 +107,14 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		}
 		coveredblocks = 1;
 		for (j=0; j<indirection; j++) {
-			coveredblocks *= SFS_DBPERIDB;
+			coveredblocks *= perib;
 		}
 		ibs->curfileblock += coveredblocks;
 		return;
 	}
 
 	if (indirection > 1) {
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<perib; i++) {
 			check_indirect_block(ibs, &entries[i], &localchanged,
 					     indirection-1);
 		}
@@ -120,7 +122,7 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	else {
 		assert(indirection==1);
 
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<perib; i++) {
 			if (entries[i] >= ibs->volblocks) {
 				setbadness(EXIT_RECOV);
 				warnx("Inode %lu: direct block pointer for "
@@ -151,7 +153,7 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	}
 
 	ct=0;
-	for (i=ct=0; i<SFS_DBPERIDB; i++) {
+	for (i=ct=0; i<perib; i++) {
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
@@ -170,6 +172,247 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 			sfs_writeindirect(*ientry, entries);
 		}
 	}
+	free(entries);
+}
+
+/*
+ * Check a sorted list of extents EXTS, with *NP entries, recording
+ * the blocks that are in use. LOW and HIGH bound the file blocks the
+ * list may map (HIGH is exclusive). Drops extents that point outside
+ * the volume, are out of order, or are outside the bounds, and frees
+ * blocks past EOF.
+ *
+ * Returns nonzero if anything was changed.
+ */
+static
+int
+check_extents(struct ibstate *ibs, struct sfs_extent *exts, unsigned *np,
+	      uint32_t low, uint32_t high)
+{
+	struct sfs_extent *e;
+	uint32_t prevend, keep, k;
+	unsigned i, j;
+	int changed = 0;
+
+	prevend = low;
+	for (i=0; i<*np; ) {
+		e = &exts[i];
+		if (e->sfe_len == 0) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: empty extent at block %lu (cleared)",
+			      (unsigned long)ibs->ino,
+			      (unsigned long)e->sfe_fileblock);
+		}
+		else if (e->sfe_diskblock == 0 ||
+		    e->sfe_diskblock >= ibs->volblocks ||
+		    e->sfe_len > ibs->volblocks - e->sfe_diskblock) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent for blocks %lu-%lu "
+			      "outside of volume: %lu (cleared)",
+			      (unsigned long)ibs->ino,
+			      (unsigned long)e->sfe_fileblock,
+			      (unsigned long)(e->sfe_fileblock +
+					      e->sfe_len - 1),
+			      (unsigned long)e->sfe_diskblock);
+		}
+		else if (e->sfe_fileblock < prevend ||
+			 e->sfe_fileblock >= high ||
+			 e->sfe_len > high - e->sfe_fileblock) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent for blocks %lu-%lu "
+			      "out of order (cleared)",
+			      (unsigned long)ibs->ino,
+			      (unsigned long)e->sfe_fileblock,
+			      (unsigned long)(e->sfe_fileblock +
+					      e->sfe_len - 1));
+		}
+		else {
+			/* Good one; trim anything past EOF */
+			keep = e->sfe_len;
+			if (e->sfe_fileblock >= ibs->fileblocks) {
+				keep = 0;
+			}
+			else if (keep > ibs->fileblocks - e->sfe_fileblock) {
+				keep = ibs->fileblocks - e->sfe_fileblock;
+			}
+			for (k=0; k<keep; k++) {
+				freemap_blockinuse(e->sfe_diskblock + k,
+						   ibs->usagetype, ibs->ino);
+			}
+			for (k=keep; k<e->sfe_len; k++) {
+				setbadness(EXIT_RECOV);
+				ibs->pasteofcount++;
+				freemap_blockfree(e->sfe_diskblock + k);
+			}
+			if (keep > 0) {
+				if (keep < e->sfe_len) {
+					e->sfe_len = keep;
+					changed = 1;
+				}
+				prevend = e->sfe_fileblock + e->sfe_len;
+				i++;
+				continue;
+			}
+		}
+
+		/* Drop it */
+		for (j=i; j+1<*np; j++) {
+			exts[j] = exts[j+1];
+		}
+		(*np)--;
+		bzero(&exts[*np], sizeof(exts[*np]));
+		changed = 1;
+	}
+	return changed;
+}
+
+/*
+ * Check the extent map of inode INO, which is in SFI, recording the
+ * blocks in use. Returns nonzero if SFI was changed.
+ */
+static
+int
+check_inode_extents(struct ibstate *ibs, struct sfs_dinode *sfi)
+{
+	struct sfs_extblock *eb;
+	struct sfs_extent *ie;
+	uint32_t high;
+	unsigned i, j, n;
+	int changed = 0, ebchanged;
+
+	if (checkzeroed(sfi->sfi_direct, sizeof(sfi->sfi_direct)) ||
+	    sfi->sfi_indirect != 0 || sfi->sfi_dindirect != 0 ||
+	    sfi->sfi_tindirect != 0) {
+		warnx("Inode %lu: block pointers in extent-mapped inode "
+		      "(cleared)", (unsigned long) ibs->ino);
+		setbadness(EXIT_RECOV);
+		bzero(sfi->sfi_direct, sizeof(sfi->sfi_direct));
+		sfi->sfi_indirect = 0;
+		sfi->sfi_dindirect = 0;
+		sfi->sfi_tindirect = 0;
+		changed = 1;
+	}
+
+	if (sfi->sfi_extdepth > 1) {
+		setbadness(EXIT_UNRECOV);
+		warnx("Inode %lu: bad extent tree depth %u (NOT FIXED)",
+		      (unsigned long) ibs->ino, sfi->sfi_extdepth);
+		return changed;
+	}
+	if (sfi->sfi_nextents > SFS_NINOEXTENTS) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: %u extents, more than fit (fixed)",
+		      (unsigned long) ibs->ino, sfi->sfi_nextents);
+		sfi->sfi_nextents = SFS_NINOEXTENTS;
+		changed = 1;
+	}
+
+	if (sfi->sfi_extdepth == 0) {
+		n = sfi->sfi_nextents;
+		if (check_extents(ibs, sfi->sfi_extents, &n, 0,
+				  (uint32_t)-1)) {
+			sfi->sfi_nextents = n;
+			changed = 1;
+		}
+		return changed;
+	}
+
+	/*
+	 * Check each extent block. Each one may only map from its
+	 * index entry's starting block to the next one's.
+	 */
+	eb = domalloc(sfs_blocksize());
+	for (i=0; i<sfi->sfi_nextents; ) {
+		ie = &sfi->sfi_extents[i];
+		if (i == 0 && ie->sfe_fileblock != 0) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: first extent index entry doesn't "
+			      "start at 0 (fixed)", (unsigned long) ibs->ino);
+			ie->sfe_fileblock = 0;
+			changed = 1;
+		}
+		high = (i+1 < sfi->sfi_nextents) ?
+			sfi->sfi_extents[i+1].sfe_fileblock : (uint32_t)-1;
+
+		if (ie->sfe_diskblock == 0 ||
+		    ie->sfe_diskblock >= ibs->volblocks ||
+		    (i > 0 && ie->sfe_fileblock <
+		     sfi->sfi_extents[i-1].sfe_fileblock)) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: bad extent block pointer %lu "
+			      "(cleared)", (unsigned long) ibs->ino,
+			      (unsigned long) ie->sfe_diskblock);
+			goto drop;
+		}
+		if (ie->sfe_len != 0) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent index entry has length "
+			      "(fixed)", (unsigned long) ibs->ino);
+			ie->sfe_len = 0;
+			changed = 1;
+		}
+
+		sfs_readextblock(ie->sfe_diskblock, eb);
+		ebchanged = 0;
+		if (eb->seb_nextents > SFS_EXTPERBLOCK(sfs_blocksize())) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent block %lu has %lu extents, "
+			      "more than fit (fixed)",
+			      (unsigned long) ibs->ino,
+			      (unsigned long) ie->sfe_diskblock,
+			      (unsigned long) eb->seb_nextents);
+			eb->seb_nextents = SFS_EXTPERBLOCK(sfs_blocksize());
+			ebchanged = 1;
+		}
+		if (eb->seb_reserved != 0) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent block %lu reserved field "
+			      "not zeroed (fixed)",
+			      (unsigned long) ibs->ino,
+			      (unsigned long) ie->sfe_diskblock);
+			eb->seb_reserved = 0;
+			ebchanged = 1;
+		}
+		n = eb->seb_nextents;
+		if (check_extents(ibs, eb->seb_extents, &n,
+				  ie->sfe_fileblock, high)) {
+			eb->seb_nextents = n;
+			ebchanged = 1;
+		}
+		if (eb->seb_nextents == 0) {
+			/* Empty; get rid of it */
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: empty extent block %lu (freed)",
+			      (unsigned long) ibs->ino,
+			      (unsigned long) ie->sfe_diskblock);
+			freemap_blockfree(ie->sfe_diskblock);
+			goto drop;
+		}
+		freemap_blockinuse(ie->sfe_diskblock, B_EXTBLOCK, ibs->ino);
+		if (ebchanged) {
+			sfs_writeextblock(ie->sfe_diskblock, eb);
+		}
+		i++;
+		continue;
+
+	drop:
+		for (j=i; j+1<sfi->sfi_nextents; j++) {
+			sfi->sfi_extents[j] = sfi->sfi_extents[j+1];
+		}
+		sfi->sfi_nextents--;
+		bzero(&sfi->sfi_extents[sfi->sfi_nextents],
+		      sizeof(sfi->sfi_extents[0]));
+		changed = 1;
+	}
+	free(eb);
+	if (sfi->sfi_nextents == 0) {
+		sfi->sfi_extdepth = 0;
+	}
+	else if (sfi->sfi_extents[0].sfe_fileblock != 0) {
+		/* Dropped the first one; the new first one starts at 0 */
+		sfi->sfi_extents[0].sfe_fileblock = 0;
+	}
+	return changed;
 }
 
 /*
@@ -189,17 +432,47 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	int changed;
 	int i;
 
-	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
+	size = SFS_ROUNDUP(sfi->sfi_size, sfs_blocksize());
+
+	if (sfi->sfi_flags & SFS_IF_EXTENTS) {
+		ibs.ino = ino;
+		ibs.curfileblock = 0;
+		ibs.fileblocks = size/sfs_blocksize();
+		ibs.volblocks = sb_totalblocks();
+		ibs.pasteofcount = 0;
+		ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
+
+		changed = check_inode_extents(&ibs, sfi);
+
+		if (ibs.pasteofcount > 0) {
+			warnx("Inode %lu: %u blocks after EOF (freed)",
+			      (unsigned long) ibs.ino, ibs.pasteofcount);
+			setbadness(EXIT_RECOV);
+		}
+		return changed;
+	}
+
+	if (sfi->sfi_nextents != 0 || sfi->sfi_extdepth != 0 ||
+	    checkzeroed(sfi->sfi_extents, sizeof(sfi->sfi_extents))) {
+		warnx("Inode %lu: extent map in block-mapped inode "
+		      "(cleared)", (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_nextents = 0;
+		sfi->sfi_extdepth = 0;
+		bzero(sfi->sfi_extents, sizeof(sfi->sfi_extents));
+		changed = 1;
+	}
+	else {
+		changed = 0;
+	}
 
 	ibs.ino = ino;
 	/*ibs.curfileblock = 0;*/
-	ibs.fileblocks = size/SFS_BLOCKSIZE;
+	ibs.fileblocks = size/sfs_blocksize();
 	ibs.volblocks = sb_totalblocks();
 	ibs.pasteofcount = 0;
 	ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
 
-	changed = 0;
-
 	for (ibs.curfileblock=0; ibs.curfileblock<NUM_D; ibs.curfileblock++) {
 		datablock = GET_D(sfi, ibs.curfileblock);
 		if (datablock >= ibs.volblocks) {
@@ -277,6 +550,23 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		changed = 1;
 	}
 
+	if (sfi->sfi_flags & ~(SFS_IF_HASHDIR | SFS_IF_EXTENTS)) {
+		warnx("Inode %lu: unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino,
+		      (unsigned long) (sfi->sfi_flags &
+				       ~(SFS_IF_HASHDIR | SFS_IF_EXTENTS)));
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= SFS_IF_HASHDIR | SFS_IF_EXTENTS;
+		changed = 1;
+	}
+	if (!isdir && (sfi->sfi_flags & SFS_IF_HASHDIR)) {
+		warnx("Inode %lu: hashed directory flag on a file (cleared)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~SFS_IF_HASHDIR;
+		changed = 1;
+	}
+
 	if (check_inode_blocks(ino, sfi, isdir)) {
 		changed = 1;
 	}
@@ -374,6 +664,16 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 					   sizeof(struct sfs_direntry));
 		ichanged = 1;
 	}
+	if ((sfi.sfi_flags & SFS_IF_HASHDIR) &&
+	    !sfsdir_hashsizeok(sfi.sfi_size)) {
+		/* Any directory is a valid flat directory */
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: hashed directory has illegal size %lu "
+		      "(made unhashed)",
+		      pathsofar, (unsigned long) sfi.sfi_size);
+		sfi.sfi_flags &= ~SFS_IF_HASHDIR;
+		ichanged = 1;
+	}
 	count_dirs++;
 
 	if (pass1_inode(ino, &sfi, ichanged)) {
@@ -392,6 +692,14 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 		}
 	}
 
+	if ((sfi.sfi_flags & SFS_IF_HASHDIR) &&
+	    sfsdir_hashcheck(direntries, ndirentries) > 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: entries misplaced in hash table (fixed)",
+		      pathsofar);
+		dchanged = 1;
+	}
+
 	for (i=0; i<ndirentries; i++) {
 		if (direntries[i].sfd_ino == SFS_NOINO) {
 			/* nothing */
@@ -436,6 +744,9 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 	}
 
 	if (dchanged) {
+		if (sfi.sfi_flags & SFS_IF_HASHDIR) {
+			sfsdir_rehash(direntries, ndirentries);
+		}
 		sfs_writedir(&sfi, direntries, ndirentries);
 	}
 
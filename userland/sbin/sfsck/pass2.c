@@ -84,7 +84,7 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	ndirentries = sfi.sfi_size/sizeof(struct sfs_direntry);
 	maxdirentries = SFS_ROUNDUP(ndirentries,
-				    SFS_BLOCKSIZE/sizeof(struct sfs_direntry));
+				    sfs_blocksize()/sizeof(struct sfs_direntry));
 	dirsize = maxdirentries * sizeof(struct sfs_direntry);
 	direntries = domalloc(dirsize);
 
@@ -302,6 +302,10 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	 */
 
 	if (dchanged) {
+		if (sfi.sfi_flags & SFS_IF_HASHDIR) {
+			/* Names may have been added, changed, or removed */
+			sfsdir_rehash(direntries, ndirentries);
+		}
 		sfs_writedir(&sfi, direntries, ndirentries);
 	}
 
@@ -50,13 +50,24 @@ static struct sfs_superblock sb;
 void
 sb_load(void)
 {
+	uint32_t bs;
+
 	sfs_readsb(SFS_SUPER_BLOCK, &sb);
 	if (sb.sb_magic != SFS_MAGIC) {
 		errx(EXIT_FATAL, "Not an sfs filesystem");
 	}
 
+	/* Everything past the superblock depends on the block size */
+	bs = sb.sb_blocksize == 0 ? SFS_BLOCKSIZE : sb.sb_blocksize;
+	if (bs < SFS_BLOCKSIZE || bs > SFS_MAXBLOCKSIZE ||
+	    (bs & (bs - 1)) != 0) {
+		errx(EXIT_FATAL, "Invalid block size %lu in superblock",
+		     (unsigned long) sb.sb_blocksize);
+	}
+	sfs_setblocksize(bs);
+
 	assert(sb.sb_nblocks > 0);
-	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks) > 0);
+	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks, bs) > 0);
 }
 
 /*
@@ -83,6 +94,18 @@ sb_check(void)
 		setbadness(EXIT_RECOV);
 		schanged = 1;
 	}
+	if (sb.sb_journalblocks != 0 &&
+	    (sb.sb_journalblocks < 3 ||
+	     sb.sb_journalstart < SFS_FREEMAP_START + sb_freemapblocks() ||
+	     sb.sb_journalstart + sb.sb_journalblocks < sb.sb_journalstart ||
+	     sb.sb_journalstart + sb.sb_journalblocks > sb.sb_nblocks)) {
+		warnx("Journal location invalid (journal removed)");
+		setbadness(EXIT_RECOV);
+		sb.sb_journalstart = 0;
+		sb.sb_journalblocks = 0;
+		sb.sb_journalseq = 0;
+		schanged = 1;
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
@@ -111,7 +134,34 @@ sb_totalblocks(void)
 uint32_t
 sb_freemapblocks(void)
 {
-	return SFS_FREEMAPBLOCKS(sb.sb_nblocks);
+	return SFS_FREEMAPBLOCKS(sb.sb_nblocks, sfs_blocksize());
+}
+
+/*
+ * Return the first block of the journal.
+ */
+uint32_t
+sb_journalstart(void)
+{
+	return sb.sb_journalstart;
+}
+
+/*
+ * Return the number of journal blocks, or 0 if there's no journal.
+ */
+uint32_t
+sb_journalblocks(void)
+{
+	return sb.sb_journalblocks;
+}
+
+/*
+ * Return the number of the transaction the journal may hold.
+ */
+uint32_t
+sb_journalseq(void)
+{
+	return sb.sb_journalseq;
 }
 
 /*
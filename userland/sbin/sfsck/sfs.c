@@ -45,14 +45,61 @@
 ////////////////////////////////////////////////////////////
 // global setup
 
+/* The volume's block size; SFS_BLOCKSIZE until the superblock is read. */
+static uint32_t blocksize = SFS_BLOCKSIZE;
+
 void
 sfs_setup(void)
 {
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
 }
 
+void
+sfs_setblocksize(uint32_t size)
+{
+	assert(size >= SFS_BLOCKSIZE && size <= SFS_MAXBLOCKSIZE);
+	assert((size & (size - 1)) == 0);
+	blocksize = size;
+	disksetblocksize(size);
+}
+
+uint32_t
+sfs_blocksize(void)
+{
+	return blocksize;
+}
+
+/*
+ * The superblock and inodes are smaller than a block on volumes with
+ * big blocks; they sit at the start of the block and the rest of it
+ * is zero.
+ */
+static
+void
+readpartial(void *data, size_t len, uint32_t block)
+{
+	static char buf[SFS_MAXBLOCKSIZE];
+
+	assert(len <= blocksize);
+	diskread(buf, block);
+	memcpy(data, buf, len);
+}
+
+static
+void
+writepartial(const void *data, size_t len, uint32_t block)
+{
+	static char buf[SFS_MAXBLOCKSIZE];
+
+	assert(len <= blocksize);
+	memcpy(buf, data, len);
+	bzero(buf + len, blocksize - len);
+	diskwrite(buf, block);
+}
+
 ////////////////////////////////////////////////////////////
 // byte-swap functions
 
@@ -62,6 +109,10 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_journalstart = SWAP32(sb->sb_journalstart);
+	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
+	sb->sb_journalseq = SWAP32(sb->sb_journalseq);
+	sb->sb_blocksize = SWAP32(sb->sb_blocksize);
 }
 
 static
@@ -72,6 +123,19 @@ swapbits(uint8_t *bits)
 	(void)bits;
 }
 
+static
+void
+swapextents(struct sfs_extent *exts, unsigned n)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		exts[i].sfe_fileblock = SWAP32(exts[i].sfe_fileblock);
+		exts[i].sfe_diskblock = SWAP32(exts[i].sfe_diskblock);
+		exts[i].sfe_len = SWAP32(exts[i].sfe_len);
+	}
+}
+
 static
 void
 swapinode(struct sfs_dinode *sfi)
@@ -81,6 +145,10 @@ swapinode(struct sfs_dinode *sfi)
 	sfi->sfi_size = SWAP32(sfi->sfi_size);
 	sfi->sfi_type = SWAP16(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAP16(sfi->sfi_linkcount);
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
+	sfi->sfi_nextents = SWAP16(sfi->sfi_nextents);
+	sfi->sfi_extdepth = SWAP16(sfi->sfi_extdepth);
+	swapextents(sfi->sfi_extents, SFS_NINOEXTENTS);
 
 	for (i=0; i<NUM_D; i++) {
 		SET_D(sfi, i) = SWAP32(GET_D(sfi, i));
@@ -99,6 +167,15 @@ swapinode(struct sfs_dinode *sfi)
 	}
 }
 
+static
+void
+swapextblock(struct sfs_extblock *eb)
+{
+	eb->seb_nextents = SWAP32(eb->seb_nextents);
+	eb->seb_reserved = SWAP32(eb->seb_reserved);
+	swapextents(eb->seb_extents, SFS_EXTPERBLOCK(blocksize));
+}
+
 static
 void
 swapdir(struct sfs_direntry *sfd)
@@ -110,8 +187,8 @@ static
 void
 swapindir(uint32_t *entries)
 {
-	int i;
-	for (i=0; i<SFS_DBPERIDB; i++) {
+	uint32_t i;
+	for (i=0; i<SFS_DBPERIDB(blocksize); i++) {
 		entries[i] = SWAP32(entries[i]);
 	}
 }
@@ -130,26 +207,63 @@ swapindir(uint32_t *entries)
  */
 static
 uint32_t
-ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
+ibmap(uint32_t iblock, uint64_t offset, uint64_t entrysize)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t *entries;
+	uint32_t ret;
 
 	if (iblock == 0) {
 		return 0;
 	}
 
+	entries = domalloc(blocksize);
 	diskread(entries, iblock);
 	swapindir(entries);
 
 	if (entrysize > 1) {
 		uint32_t index = offset / entrysize;
 		offset %= entrysize;
-		return ibmap(entries[index], offset, entrysize/SFS_DBPERIDB);
+		ret = ibmap(entries[index], offset,
+			    entrysize/SFS_DBPERIDB(blocksize));
 	}
 	else {
-		assert(offset < SFS_DBPERIDB);
-		return entries[offset];
+		assert(offset < SFS_DBPERIDB(blocksize));
+		ret = entries[offset];
+	}
+	free(entries);
+	return ret;
+}
+
+/*
+ * Extent bmap: look up FILEBLOCK in the N extents EXTS, which are
+ * sorted. Returns the index of the extent with the highest starting
+ * block not past FILEBLOCK, or -1.
+ */
+static
+int
+extfind(const struct sfs_extent *exts, unsigned n, uint32_t fileblock)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		if (exts[i].sfe_fileblock > fileblock) {
+			break;
+		}
 	}
+	return (int)i - 1;
+}
+
+static
+uint32_t
+extbmap(const struct sfs_extent *exts, unsigned n, uint32_t fileblock)
+{
+	int i;
+
+	i = extfind(exts, n, fileblock);
+	if (i < 0 || fileblock - exts[i].sfe_fileblock >= exts[i].sfe_len) {
+		return 0;
+	}
+	return exts[i].sfe_diskblock + (fileblock - exts[i].sfe_fileblock);
 }
 
 /*
@@ -161,7 +275,25 @@ static
 uint32_t
 bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 {
-	uint32_t iblock, offset;
+	struct sfs_extblock *eb;
+	uint32_t iblock, offset, ret;
+	int i;
+
+	if (sfi->sfi_flags & SFS_IF_EXTENTS) {
+		if (sfi->sfi_extdepth == 0) {
+			return extbmap(sfi->sfi_extents, sfi->sfi_nextents,
+				       fileblock);
+		}
+		i = extfind(sfi->sfi_extents, sfi->sfi_nextents, fileblock);
+		if (i < 0) {
+			return 0;
+		}
+		eb = domalloc(blocksize);
+		sfs_readextblock(sfi->sfi_extents[i].sfe_diskblock, eb);
+		ret = extbmap(eb->seb_extents, eb->seb_nextents, fileblock);
+		free(eb);
+		return ret;
+	}
 
 	if (fileblock < INOMAX_D) {
 		return GET_D(sfi, fileblock);
@@ -194,7 +326,7 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 void
 sfs_readsb(uint32_t blocknum, struct sfs_superblock *sb)
 {
-	diskread(sb, blocknum);
+	readpartial(sb, sizeof(*sb), blocknum);
 	swapsb(sb);
 }
 
@@ -202,7 +334,7 @@ void
 sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb)
 {
 	swapsb(sb);
-	diskwrite(sb, blocknum);
+	writepartial(sb, sizeof(*sb), blocknum);
 	swapsb(sb);
 }
 
@@ -233,7 +365,7 @@ sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits)
 void
 sfs_readinode(uint32_t ino, struct sfs_dinode *sfi)
 {
-	diskread(sfi, ino);
+	readpartial(sfi, sizeof(*sfi), ino);
 	swapinode(sfi);
 }
 
@@ -241,7 +373,7 @@ void
 sfs_writeinode(uint32_t ino, struct sfs_dinode *sfi)
 {
 	swapinode(sfi);
-	diskwrite(sfi, ino);
+	writepartial(sfi, sizeof(*sfi), ino);
 	swapinode(sfi);
 }
 
@@ -264,6 +396,25 @@ sfs_writeindirect(uint32_t blocknum, uint32_t *entries)
 	swapindir(entries);
 }
 
+/*
+ *  extent blocks - blocknum is a disk block number.
+ */
+
+void
+sfs_readextblock(uint32_t blocknum, struct sfs_extblock *eb)
+{
+	diskread(eb, blocknum);
+	swapextblock(eb);
+}
+
+void
+sfs_writeextblock(uint32_t blocknum, struct sfs_extblock *eb)
+{
+	swapextblock(eb);
+	diskwrite(eb, blocknum);
+	swapextblock(eb);
+}
+
 ////////////////////////////////////////////////////////////
 // directory I/O
 
@@ -274,7 +425,7 @@ static
 void
 sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = blocksize/sizeof(struct sfs_direntry);
 	unsigned j;
 
 	if (diskblock != 0) {
@@ -285,7 +436,7 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 	}
 	else {
 		warnx("Warning: sparse directory found");
-		bzero(d, SFS_BLOCKSIZE);
+		bzero(d, blocksize);
 	}
 }
 
@@ -297,7 +448,7 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 void
 sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = blocksize/sizeof(struct sfs_direntry);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 	unsigned left, thismany;
@@ -330,7 +481,7 @@ static
 void
 sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = blocksize/sizeof(struct sfs_direntry);
 	unsigned j, bad;
 
 	if (diskblock != 0) {
@@ -362,7 +513,7 @@ sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 void
 sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = blocksize/sizeof(struct sfs_direntry);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 	unsigned left, thismany;
@@ -462,3 +613,123 @@ sfsdir_tryadd(struct sfs_direntry *d, int nd, const char *name, uint32_t ino)
 	}
 	return -1;
 }
+
+/*
+ * Hashed directories. (See <kern/sfs.h> for the layout.)
+ */
+
+/*
+ * Hash a name. Looks at no more than SFS_NAMELEN bytes.
+ */
+static
+uint32_t
+sfsdir_hash(const char *name)
+{
+	uint32_t h;
+	unsigned i;
+
+	h = SFS_DIRHASH_BASIS;
+	for (i=0; i<SFS_NAMELEN && name[i] != 0; i++) {
+		h = (h ^ (unsigned char)name[i]) * SFS_DIRHASH_PRIME;
+	}
+	return h;
+}
+
+/*
+ * Check if a directory of size SIZE can be a hashed directory, that
+ * is, if it's a power of two number of blocks.
+ */
+int
+sfsdir_hashsizeok(uint32_t size)
+{
+	uint32_t nb;
+
+	nb = size / blocksize;
+	return size % blocksize == 0 && nb > 0 && (nb & (nb - 1)) == 0;
+}
+
+/*
+ * Check the placement of the entries in a hashed directory: every
+ * bucket from an entry's home bucket up to the one it's in must be
+ * full. Returns the number of entries that are in the wrong place.
+ */
+unsigned
+sfsdir_hashcheck(const struct sfs_direntry *d, unsigned nd)
+{
+	const unsigned atonce = blocksize/sizeof(struct sfs_direntry);
+	unsigned nb = nd / atonce;
+	unsigned mask = nb - 1;
+	unsigned i, j, b, home, bad;
+	int *full;
+
+	assert(nb > 0 && (nb & mask) == 0 && nd % atonce == 0);
+
+	full = domalloc(nb * sizeof(int));
+	for (b=0; b<nb; b++) {
+		full[b] = 1;
+		for (j=0; j<atonce; j++) {
+			if (d[b*atonce + j].sfd_ino == SFS_NOINO) {
+				full[b] = 0;
+			}
+		}
+	}
+
+	bad = 0;
+	for (i=0; i<nd; i++) {
+		if (d[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		home = sfsdir_hash(d[i].sfd_name) & mask;
+		for (b = home; b != i / atonce; b = (b + 1) & mask) {
+			if (!full[b]) {
+				bad++;
+				break;
+			}
+		}
+	}
+
+	free(full);
+	return bad;
+}
+
+/*
+ * Lay out the entries of a hashed directory again, so that each is
+ * where a lookup will find it.
+ */
+void
+sfsdir_rehash(struct sfs_direntry *d, unsigned nd)
+{
+	const unsigned atonce = blocksize/sizeof(struct sfs_direntry);
+	unsigned nb = nd / atonce;
+	unsigned mask = nb - 1;
+	struct sfs_direntry *old;
+	unsigned i, j, b;
+
+	assert(nb > 0 && (nb & mask) == 0 && nd % atonce == 0);
+
+	old = domalloc(nd * sizeof(struct sfs_direntry));
+	memcpy(old, d, nd * sizeof(struct sfs_direntry));
+	memset(d, 0, nd * sizeof(struct sfs_direntry));
+
+	for (i=0; i<nd; i++) {
+		if (old[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		/* There's room somewhere, since everything fit before */
+		b = sfsdir_hash(old[i].sfd_name) & mask;
+		while (1) {
+			for (j=0; j<atonce; j++) {
+				if (d[b*atonce + j].sfd_ino == SFS_NOINO) {
+					break;
+				}
+			}
+			if (j < atonce) {
+				break;
+			}
+			b = (b + 1) & mask;
+		}
+		d[b*atonce + j] = old[i];
+	}
+
+	free(old);
+}
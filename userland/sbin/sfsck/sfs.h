@@ -41,10 +41,15 @@
 struct sfs_superblock;
 struct sfs_dinode;
 struct sfs_direntry;
+struct sfs_extblock;
 
 /* Call this before anything else in this module */
 void sfs_setup(void);
 
+/* The volume's block size; set it once the superblock has been read */
+void sfs_setblocksize(uint32_t size);
+uint32_t sfs_blocksize(void);
+
 /*
  * Read and write ops for SFS structures
  */
@@ -65,6 +70,10 @@ void sfs_writeinode(uint32_t inum, struct sfs_dinode *sfi);
 void sfs_readindirect(uint32_t blocknum, uint32_t *entries);
 void sfs_writeindirect(uint32_t blocknum, uint32_t *entries);
 
+/* extent block */
+void sfs_readextblock(uint32_t blocknum, struct sfs_extblock *eb);
+void sfs_writeextblock(uint32_t blocknum, struct sfs_extblock *eb);
+
 /* directory - ND should be the number of directory entries D points to */
 void sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd);
 void sfs_writedir(const struct sfs_dinode *sfi,
@@ -74,6 +83,11 @@ void sfs_writedir(const struct sfs_dinode *sfi,
 int sfsdir_tryadd(struct sfs_direntry *d, int nd,
 		  const char *name, uint32_t ino);
 
+/* Hashed directories: check the size, check placement, and fix it. */
+int sfsdir_hashsizeok(uint32_t size);
+unsigned sfsdir_hashcheck(const struct sfs_direntry *d, unsigned nd);
+void sfsdir_rehash(struct sfs_direntry *d, unsigned nd);
+
 /* Sort a directory by creating a permutation vector. */
 void sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector);
 